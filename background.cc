@@ -0,0 +1,225 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include "background.h"
+
+// The variance a new model starts with, and the least any pixel is taken
+// to have, in the model's units: 4 and 2 levels in each channel.
+#define MODEL_SEED_VARIANCE (3 * 4 * 4 * 16)
+#define MODEL_MIN_VARIANCE (3 * 2 * 2 * 16)
+
+// Passing pixels follow the frame this many times more slowly, as a
+// power of two.
+#define MODEL_SLOW_SHIFT 2
+
+#define MODEL_MAX_RATE 8
+
+namespace {
+
+struct ModelBands {
+    ModelRowKernel modelRow;
+    const FrameView *curr;
+    uint16_t *lanes;                    // the model of curr's first pixel
+    size_t stride;                      // uint16_t between model rows
+    const ModelParams *params;
+    int32_t *rows;                      // a row of weights for each part
+    size_t rowStride;                   // int32_t between parts' rows
+    Background::RowVisitor visit;
+    void *context;
+};
+
+struct ModelSums {
+    const FrameView *curr;
+    FindSums partial[WORKERS_MAX];
+    FrameHistogram *histograms;         // one per part, or NULL
+    HistogramRowKernel histogramRow;
+};
+
+}
+
+// Adds a row of weighRow()-style weights to the band's sums, and the
+// row's pixels to the band's histogram, if any.
+static void addRow(void *context, unsigned part, const int32_t *w,
+                   uint32_t count, int32_t x, int32_t y) {
+    ModelSums *bands = static_cast<ModelSums *>(context);
+    FindSums &sums = bands->partial[part];
+    int64_t rowW = 0, rowWx = 0;
+    uint32_t passed = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        rowW += w[i];
+        rowWx += (int64_t) w[i] * (x + i);
+        passed += w[i] != 0;
+    }
+    sums.w += rowW;
+    sums.wx += rowWx;
+    sums.wy += rowW * y;
+    sums.count += passed;
+
+    if (bands->histograms) {
+        bands->histogramRow(bands->curr->pixel(x, y), count,
+                            bands->histograms[part]);
+    }
+}
+
+static void modelBand(void *context, unsigned part, unsigned parts) {
+    ModelBands *bands = static_cast<ModelBands *>(context);
+    const FrameView &curr = *bands->curr;
+    unsigned begin, end;
+    workerRange(curr.height, part, parts, begin, end);
+
+    int32_t *w = bands->rows + part * bands->rowStride;
+    for (unsigned row = begin; row < end; ++row) {
+        int32_t y = curr.y + row;
+        uint16_t *lanes = bands->lanes + row * bands->stride;
+        if (row + FRAME_PREFETCH_ROWS < end) {
+            framePrefetch(curr.pixel(curr.x, y + FRAME_PREFETCH_ROWS),
+                          FRAME_PREFETCH_BYTES);
+            framePrefetch((const uint8_t *)
+                              (lanes + FRAME_PREFETCH_ROWS * bands->stride),
+                          2 * FRAME_PREFETCH_BYTES);
+        }
+
+        bands->modelRow(curr.pixel(curr.x, y), lanes, curr.width,
+                        *bands->params, w);
+        bands->visit(bands->context, part, w, curr.width, curr.x, y);
+    }
+}
+
+Background::Background()
+    : lanes(NULL), capacity(0), rows(NULL), rowCapacity(0),
+      x(0), y(0), width(0), height(0)
+{
+}
+
+Background::~Background() {
+    delete[] lanes;
+    delete[] rows;
+}
+
+void Background::reset(const FrameView &frame) {
+    size_t needed = (size_t) frame.width * frame.height * 4;
+    if (needed > capacity) {
+        delete[] lanes;
+        lanes = new uint16_t[needed];
+        capacity = needed;
+    }
+
+    // Any band of any frame the model covers fits its row of weights.
+    needed = (size_t) frame.width * WORKERS_MAX;
+    if (needed > rowCapacity) {
+        delete[] rows;
+        rows = new int32_t[needed];
+        rowCapacity = needed;
+    }
+
+    x = frame.x;
+    y = frame.y;
+    width = frame.width;
+    height = frame.height;
+
+    uint16_t *model = lanes;
+    for (int32_t py = y; py < y + height; ++py) {
+        const uint8_t *pixel = frame.pixel(x, py);
+        for (int32_t px = 0; px < width; ++px, pixel += 4, model += 4) {
+            model[0] = pixel[0] << 8;
+            model[1] = pixel[1] << 8;
+            model[2] = pixel[2] << 8;
+            model[3] = MODEL_SEED_VARIANCE;
+        }
+    }
+}
+
+void Background::clear() {
+    delete[] lanes;
+    lanes = NULL;
+    capacity = 0;
+    delete[] rows;
+    rows = NULL;
+    rowCapacity = 0;
+    x = y = width = height = 0;
+}
+
+FindSums Background::update(ModelRowKernel modelRow, const FrameView &curr,
+                            const ModelParams &params, WorkerPool *workers,
+                            FrameHistogram *histogram,
+                            HistogramRowKernel histogramRow) {
+    // As in findSums(), each band counts into its own histogram, so the
+    // workers never share a cache line.
+    FrameHistogram histograms[WORKERS_MAX];
+    unsigned parts = bandParts(workers, curr.height);
+
+    ModelSums bands;
+    memset(bands.partial, 0, sizeof(bands.partial));
+    bands.curr = &curr;
+    bands.histograms = histogram;
+    bands.histogramRow = histogramRow;
+    if (histogram && parts > 1) {
+        memset(histograms, 0, parts * sizeof(histograms[0]));
+        bands.histograms = histograms;
+    }
+    update(modelRow, curr, params, addRow, &bands, workers);
+
+    FindSums sums = bands.partial[0];
+    for (unsigned i = 1; i < parts; ++i) {
+        sums.w += bands.partial[i].w;
+        sums.wx += bands.partial[i].wx;
+        sums.wy += bands.partial[i].wy;
+        sums.count += bands.partial[i].count;
+    }
+
+    if (histogram && parts > 1) {
+        for (unsigned i = 0; i < parts; ++i) {
+            addHistogram(*histogram, histograms[i]);
+        }
+    }
+    return sums;
+}
+
+unsigned Background::update(ModelRowKernel modelRow, const FrameView &curr,
+                            const ModelParams &params, RowVisitor visit,
+                            void *context, WorkerPool *workers) {
+    unsigned parts = bandParts(workers, curr.height);
+
+    ModelBands bands;
+    bands.modelRow = modelRow;
+    bands.curr = &curr;
+    bands.stride = (size_t) width * 4;
+    bands.lanes = lanes + (curr.y - y) * bands.stride + (curr.x - x) * 4;
+    bands.params = &params;
+    bands.rows = rows;
+    bands.rowStride = width;
+    bands.visit = visit;
+    bands.context = context;
+    if (parts > 1) {
+        workers->run(modelBand, &bands, parts);
+    } else {
+        modelBand(&bands, 0, 1);
+    }
+    return parts;
+}
+
+ModelParams modelParams(double rWeight, double gWeight, double bWeight,
+                        double floor, double sigmas, unsigned rate) {
+    ModelParams params;
+    params.weights = findWeights(rWeight, gWeight, bWeight,
+                                 floor * (rWeight + gWeight + bWeight));
+
+    // Unpassed pixels weigh 0, so only positive deviations can pass.
+    params.weights.threshold = std::max(params.weights.threshold, 0);
+
+    // The model keeps 16 times the sum of the three channels' variances.
+    // Taking them as equal and independent, d's variance is the sum of
+    // the squared weights times a 48th of that.
+    double squares = (double) params.weights.r * params.weights.r +
+                     (double) params.weights.g * params.weights.g +
+                     (double) params.weights.b * params.weights.b;
+    params.spread = (float) (sigmas * sigmas * squares / 48);
+    params.minVariance = MODEL_MIN_VARIANCE;
+
+    rate = std::max(1u, std::min(rate, (unsigned) MODEL_MAX_RATE));
+    params.rate = rate;
+    params.slowRate = std::min(rate + MODEL_SLOW_SHIFT,
+                               (unsigned) MODEL_MAX_RATE);
+    return params;
+}
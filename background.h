@@ -0,0 +1,80 @@
+#ifndef OFFGRID_BACKGROUND_H
+#define OFFGRID_BACKGROUND_H
+
+#include "kernels.h"
+
+// A model of what each pixel of a region usually looks like, for find()
+// to threshold against instead of a single reference frame.
+//
+// Every pixel keeps an exponential running mean of its r, g and b, in 8.8
+// fixed point, and of the sum of their squared deviations from it, in
+// 12.4 fixed point and saturating at 4095, in four uint16_t lanes: 8 bytes
+// a pixel. Each frame is weighed against the model and folded into it in
+// the same pass, in place, so slow changes in lighting are absorbed as
+// they happen. Pixels that pass are folded in more slowly, so a target
+// that stops fades out gradually, and one that moves leaves no ghost
+// where it was, as it would in a reference frame.
+class Background {
+public:
+    Background();
+    ~Background();
+
+    // Starts the model over from a frame, with every pixel's mean its
+    // colour and its variance a guess.
+    void reset(const FrameView &frame);
+
+    // Drops the model.
+    void clear();
+
+    bool empty() const { return lanes == NULL; }
+
+    bool covers(int32_t px, int32_t py, int32_t w, int32_t h) const {
+        return lanes && px >= x && py >= y &&
+               px + w <= x + width && py + h <= y + height;
+    }
+
+    // Weighs curr, which the model must cover, against it with modelRow,
+    // and updates the model with it. Returns the sums over the pixels that
+    // passed, as findSums() does, splitting the rows between workers.
+    // Given a histogram, each row of curr is also added to it with
+    // histogramRow while the row is still in cache.
+    FindSums update(ModelRowKernel modelRow, const FrameView &curr,
+                    const ModelParams &params, WorkerPool *workers = NULL,
+                    FrameHistogram *histogram = NULL,
+                    HistogramRowKernel histogramRow = NULL);
+
+    // Called with each row's weights, from frame column x of row y, by
+    // the worker handling band part of the rows. Each band's rows come in
+    // order, and the bands are in row order.
+    typedef void (*RowVisitor)(void *context, unsigned part,
+                               const int32_t *w, uint32_t count,
+                               int32_t x, int32_t y);
+
+    // Like update(), but hands each row's weights to visit instead of
+    // summing them. Returns the number of bands.
+    unsigned update(ModelRowKernel modelRow, const FrameView &curr,
+                    const ModelParams &params, RowVisitor visit,
+                    void *context, WorkerPool *workers = NULL);
+
+private:
+    uint16_t *lanes;
+    size_t capacity;    // in uint16_t
+    int32_t *rows;      // a row of weights for each band, width apart
+    size_t rowCapacity; // in int32_t
+    int32_t x;          // frame co-ordinates of the pixels covered
+    int32_t y;
+    int32_t width;
+    int32_t height;
+
+    Background(const Background &);
+    Background &operator=(const Background &);
+};
+
+// Model parameters for find()'s weights. A pixel passes if its weighted
+// deviation is more than floor times the sum of the weights, as if each
+// channel had changed by floor, and more than sigmas standard deviations.
+// The model follows each frame 1 / 2^rate of the way.
+ModelParams modelParams(double rWeight, double gWeight, double bWeight,
+                        double floor, double sigmas, unsigned rate);
+
+#endif
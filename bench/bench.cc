@@ -0,0 +1,215 @@
+// Times find()'s frame traversal on a synthetic 1600x1200 frame, in the
+// original column-major order and through the row engine with each
+// kernel the CPU supports, then with the widest kernel on 1, 2, ... of
+// the CPU's threads, and findBlobs() the same way. Then times sample()
+// over scattered LEDs, in the order given and through a sample plan,
+// building an integral image, updating a background model and counting
+// histograms with each kernel. Run it on the Pi with:
+//
+//     ./build/Debug/offgrid_bench [iterations]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "background.h"
+#include "blobs.h"
+#include "kernels.h"
+
+#define WIDTH 1600
+#define HEIGHT 1200
+#define LEDS 20000
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The loop find() used before the row engine: x outer, y inner, so every
+// access jumps a whole row.
+static uint32_t findColumnMajor(const uint8_t *curr, const uint8_t *tare,
+                                double rWeight, double gWeight,
+                                double bWeight, double threshold,
+                                double &xSum) {
+    uint32_t count = 0;
+    for (uint32_t x = 0; x < WIDTH; ++x) {
+        for (uint32_t y = 0; y < HEIGHT; ++y) {
+            size_t offset = (y * WIDTH + x) << 2;
+            double sum = rWeight * (curr[offset + 0] - tare[offset + 0]) +
+                         gWeight * (curr[offset + 1] - tare[offset + 1]) +
+                         bWeight * (curr[offset + 2] - tare[offset + 2]);
+            if (sum > threshold) {
+                xSum += sum * x;
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+static void report(const char *name, double seconds, int iterations,
+                   uint32_t count) {
+    double perFrame = seconds / iterations;
+    double bytes = 2.0 * WIDTH * HEIGHT * 4;
+    printf("%-14s %8.2f ms/frame %8.1f MB/s  (count %u)\n",
+           name, perFrame * 1e3, bytes / perFrame / 1e6, count);
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 20;
+    size_t size = (size_t) WIDTH * HEIGHT * 4;
+    uint8_t *curr = (uint8_t *) malloc(size);
+    uint8_t *tare = (uint8_t *) malloc(size);
+
+    srand(1);
+    for (size_t i = 0; i < size; ++i) {
+        tare[i] = rand() & 0x3f;
+        curr[i] = tare[i] + (rand() % 100 == 0 ? 0xc0 : 0);
+    }
+
+    double rWeight = 1, gWeight = 1, bWeight = 1;
+    double threshold = 0.5 * 255 * (rWeight + gWeight + bWeight);
+    FrameView currView = frameView(curr, 0, 0, WIDTH, HEIGHT);
+    FrameView tareView = frameView(tare, 0, 0, WIDTH, HEIGHT);
+
+    double xSum = 0;
+    uint32_t count = 0;
+    double start = now();
+    for (int i = 0; i < iterations; ++i) {
+        count = findColumnMajor(curr, tare, rWeight, gWeight, bWeight,
+                                threshold, xSum);
+    }
+    report("column-major", now() - start, iterations, count);
+
+    const char *isas[] = { "scalar", "sse2", "avx2", "neon" };
+    FindWeights weights = findWeights(rWeight, gWeight, bWeight, threshold);
+    for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); ++k) {
+        const Kernels *kernels = kernelsFor(isas[k]);
+        if (!kernels) {
+            continue;
+        }
+
+        FindSums sums = { 0, 0, 0, 0 };
+        start = now();
+        for (int i = 0; i < iterations; ++i) {
+            sums = findSums(kernels->findRow, currView, tareView, weights);
+        }
+        report(isas[k], now() - start, iterations, sums.count);
+    }
+
+    unsigned cpus = WorkerPool().size();
+    for (unsigned threads = 1; threads <= cpus; ++threads) {
+        WorkerPool workers(threads);
+        char name[32];
+        snprintf(name, sizeof(name), "%s x%u", kernels().isa, threads);
+
+        FindSums sums = { 0, 0, 0, 0 };
+        start = now();
+        for (int i = 0; i < iterations; ++i) {
+            sums = findSums(kernels().findRow, currView, tareView, weights,
+                            &workers);
+        }
+        report(name, now() - start, iterations, sums.count);
+    }
+
+    std::vector<Blob> blobs;
+    for (unsigned threads = 1; threads <= cpus; ++threads) {
+        WorkerPool workers(threads);
+        char name[32];
+        snprintf(name, sizeof(name), "blobs x%u", threads);
+
+        start = now();
+        for (int i = 0; i < iterations; ++i) {
+            findBlobs(kernels().weighRow, currView, tareView, weights, 1,
+                      blobs, &workers);
+        }
+        report(name, now() - start, iterations, blobs.size());
+    }
+
+    SamplePoint *points = new SamplePoint[LEDS];
+    uint8_t *rgb = new uint8_t[LEDS * 3];
+    for (uint32_t i = 0; i < LEDS; ++i) {
+        samplePointAt(points[i], (rand() % WIDTH) << 16,
+                      (rand() % HEIGHT) << 16);
+        points[i].index = i;
+        points[i].kernel = NULL;
+    }
+
+    start = now();
+    for (int i = 0; i < iterations; ++i) {
+        for (uint32_t j = 0; j < LEDS; ++j) {
+            kernels().sample(currView, points[j].x, points[j].y, rgb + j * 3);
+        }
+    }
+    printf("%-14s %8.2f ms/frame\n", "sample",
+           (now() - start) / iterations * 1e3);
+
+    planSamples(points, LEDS, currView);
+    start = now();
+    for (int i = 0; i < iterations; ++i) {
+        samplePlanned(kernels(), currView, points, LEDS, rgb);
+    }
+    printf("%-14s %8.2f ms/frame\n", "sample plan",
+           (now() - start) / iterations * 1e3);
+
+    IntegralImage table;
+    table.sums = new uint32_t[integralImageSize(WIDTH, HEIGHT)];
+    for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); ++k) {
+        const Kernels *kernels = kernelsFor(isas[k]);
+        if (!kernels) {
+            continue;
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "integral %s", isas[k]);
+        start = now();
+        for (int i = 0; i < iterations; ++i) {
+            integralImage(kernels->integralRow, currView, table);
+        }
+        printf("%-14s %8.2f ms/frame\n", name,
+               (now() - start) / iterations * 1e3);
+    }
+    delete[] table.sums;
+
+    Background background;
+    ModelParams params = modelParams(rWeight, gWeight, bWeight, 16, 4, 5);
+    for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); ++k) {
+        const Kernels *kernels = kernelsFor(isas[k]);
+        if (!kernels) {
+            continue;
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "model %s", isas[k]);
+        background.reset(tareView);
+        FindSums sums = { 0, 0, 0, 0 };
+        start = now();
+        for (int i = 0; i < iterations; ++i) {
+            sums = background.update(kernels->modelRow, currView, params);
+        }
+        report(name, now() - start, iterations, sums.count);
+    }
+
+    FrameHistogram histogram;
+    for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); ++k) {
+        const Kernels *kernels = kernelsFor(isas[k]);
+        if (!kernels) {
+            continue;
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "histogram %s", isas[k]);
+        start = now();
+        for (int i = 0; i < iterations; ++i) {
+            frameHistogram(kernels->histogramRow, currView, histogram);
+        }
+        report(name, now() - start, iterations, histogram.luma[0]);
+    }
+
+    delete[] points;
+    delete[] rgb;
+    free(curr);
+    free(tare);
+    return 0;
+}
@@ -0,0 +1,379 @@
+// Checks findGPU()'s sums against findSums(). Renders synthetic frames
+// into a headless EGL pbuffer, runs the RASPITEX_CAPTURE_SUMS weigh and
+// reduce passes over regions of them at each capture scale, and compares
+// each region's sums with findSums() over the same frames, read back as
+// BGRA at that scale. Only the capture passes and shader helpers are
+// built in, against the system EGL and GLES2, so it runs wherever Mesa
+// can make a surfaceless pbuffer, e.g. on llvmpipe with
+// LIBGL_ALWAYS_SOFTWARE=1:
+//
+//     ./build/Debug/offgrid_sums_check [w h]
+//
+// Exits non-zero if a region's count differs or its centroid is out by
+// more than SUMS_TOLERANCE pixels.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <vector>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+
+extern "C" {
+#include "raspicam/RaspiTexCapture.h"
+#include "raspicam/RaspiTexShader.h"
+}
+
+#include "kernels.h"
+
+#define WIDTH 1600
+#define HEIGHT 1200
+
+// The sums are reduced as floats, so centroids are not exact.
+#define SUMS_TOLERANCE 0.01
+
+#define FRAME_VSHADER_SOURCE \
+    "attribute vec2 vertex;\n" \
+    "varying vec2 texcoord;\n" \
+    "void main(void) {\n" \
+    "   texcoord = 0.5 * (vertex + 1.0);\n" \
+    "   gl_Position = vec4(vertex, 0.0, 1.0);\n" \
+    "}\n"
+
+#define FRAME_FSHADER_SOURCE \
+    "precision mediump float;\n" \
+    "uniform sampler2D tex;\n" \
+    "varying vec2 texcoord;\n" \
+    "void main(void) {\n" \
+    "    gl_FragColor = texture2D(tex, texcoord);\n" \
+    "}\n"
+
+static const GLfloat quad[] = {
+    -1.0f, -1.0f, 1.0f, 1.0f, 1.0f, -1.0f,
+    -1.0f, 1.0f, 1.0f, 1.0f, -1.0f, -1.0f,
+};
+
+// Draws width x height RGBA pixels, with row 0 at the bottom, into the
+// pbuffer as a scene would.
+class FrameDrawer {
+public:
+    bool init() {
+        static const char *const uniforms[] = { "tex", NULL };
+        memset(&shader, 0, sizeof(shader));
+        shader.vertex_source = FRAME_VSHADER_SOURCE;
+        shader.fragment_source = FRAME_FSHADER_SOURCE;
+        shader.uniform_names[0] = uniforms[0];
+        shader.attribute_names[0] = "vertex";
+        if (raspitexutil_build_shader_program(&shader) != 0) {
+            return false;
+        }
+
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+        return true;
+    }
+
+    void draw(const std::vector<uint8_t> &pixels, int width, int height) {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, width, height);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+        glUseProgram(shader.program);
+        glUniform1i(shader.uniform_locations[0], 0);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glEnableVertexAttribArray(shader.attribute_locations[0]);
+        glVertexAttribPointer(shader.attribute_locations[0], 2, GL_FLOAT,
+                              GL_FALSE, 0, 0);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+    }
+
+private:
+    RASPITEXUTIL_SHADER_PROGRAM_T shader;
+    GLuint texture;
+    GLuint vbo;
+};
+
+// Prefers Mesa's surfaceless platform, which needs no window system, and
+// falls back to the default display.
+static EGLDisplay getDisplay() {
+#if defined(EGL_EXT_platform_base) && defined(EGL_MESA_platform_surfaceless)
+    const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+        eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (extensions && getPlatformDisplay &&
+        strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+        return getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                  EGL_DEFAULT_DISPLAY, NULL);
+    }
+#endif
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+static bool makeContext(int width, int height) {
+    EGLDisplay display = getDisplay();
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY ||
+        !eglInitialize(display, &major, &minor)) {
+        fprintf(stderr, "no EGL display\n");
+        return false;
+    }
+
+    static const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_ALPHA_SIZE, 8,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configs = 0;
+    if (!eglChooseConfig(display, configAttribs, &config, 1, &configs) ||
+        configs < 1) {
+        fprintf(stderr, "no RGBA8 pbuffer config\n");
+        return false;
+    }
+
+    const EGLint surfaceAttribs[] = {
+        EGL_WIDTH, width,
+        EGL_HEIGHT, height,
+        EGL_NONE
+    };
+    static const EGLint contextAttribs[] = {
+        EGL_CONTEXT_CLIENT_VERSION, 2,
+        EGL_NONE
+    };
+    eglBindAPI(EGL_OPENGL_ES_API);
+    EGLSurface surface = eglCreatePbufferSurface(display, config,
+                                                 surfaceAttribs);
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT,
+                                          contextAttribs);
+    if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(display, surface, surface, context)) {
+        fprintf(stderr, "can't make a %dx%d pbuffer current: 0x%x\n",
+                width, height, eglGetError());
+        return false;
+    }
+    return true;
+}
+
+// Runs a capture's passes over the pbuffer and reads back its texel
+// regions, as raspitexutil_capture does.
+static bool capture(RASPITEXCAPTURE_FRAME *frame,
+                    const RASPITEX_CAPTURE_PARAMS &params,
+                    std::vector<uint8_t> &out) {
+    RASPITEX_RECT texels[RASPITEX_MAX_RECTS];
+    int count = 0;
+    if (raspitexcapture_bind(frame, &params, texels, &count) != 0) {
+        raspitexcapture_unbind(frame);
+        return false;
+    }
+
+    size_t size = 0;
+    for (int i = 0; i < count; ++i) {
+        size += (size_t) texels[i].width * texels[i].height * 4;
+    }
+    out.resize(size);
+
+    uint8_t *texel = &out[0];
+    for (int i = 0; i < count; ++i) {
+        const RASPITEX_RECT &r = texels[i];
+        glReadPixels(r.x, r.y, r.width, r.height, GL_RGBA, GL_UNSIGNED_BYTE,
+                     texel);
+        texel += (size_t) r.width * r.height * 4;
+    }
+    raspitexcapture_unbind(frame);
+    return glGetError() == GL_NO_ERROR;
+}
+
+// A dim noisy scene, and the same scene a little brighter with squares
+// of colour painted over it, some without green, so that weights of
+// either sign pass somewhere.
+static void makeFrames(int width, int height, std::vector<uint8_t> &ref,
+                       std::vector<uint8_t> &curr) {
+    size_t size = (size_t) width * height * 4;
+    ref.resize(size);
+    curr.resize(size);
+
+    srand(1);
+    for (size_t i = 0; i < size; ++i) {
+        ref[i] = (i & 3) == 3 ? 0xff : rand() & 0x3f;
+        curr[i] = (i & 3) == 3 ? 0xff : ref[i] + (rand() & 0x0f);
+    }
+
+    for (int square = 0; square < 12; ++square) {
+        int side = 4 + rand() % 60;
+        int x0 = rand() % (width - side);
+        int y0 = rand() % (height - side);
+        uint8_t r = 0x80 + rand() % 0x80;
+        uint8_t g = rand() % 2 ? 0 : 0xc0;
+        uint8_t b = 0x80 + rand() % 0x80;
+        for (int y = y0; y < y0 + side; ++y) {
+            uint8_t *pixel = &curr[((size_t) y * width + x0) * 4];
+            for (int x = 0; x < side; ++x, pixel += 4) {
+                pixel[0] = r;
+                pixel[1] = g;
+                pixel[2] = b;
+            }
+        }
+    }
+}
+
+// Compares one region's sums from the GPU with findSums(), and prints
+// both. Returns false if they disagree.
+static bool checkRegion(const std::vector<uint8_t> &ref,
+                        const std::vector<uint8_t> &curr,
+                        int width, int height, const RASPITEX_RECT &rect,
+                        const RASPITEX_CAPTURE_PARAMS &params,
+                        const uint8_t *texels) {
+    double gpu[RASPITEX_NUM_SUMS];
+    for (int i = 0; i < RASPITEX_NUM_SUMS; ++i) {
+        gpu[i] = raspitexutil_unpack_float(texels + (i << 2));
+    }
+
+    FindWeights weights = findWeights(params.weights[0], params.weights[1],
+                                      params.weights[2], params.threshold);
+    FrameView refView = frameView(&ref[0], 0, 0, width, height);
+    FrameView currView = frameSubView(
+        frameView(&curr[0], 0, 0, width, height),
+        rect.x, rect.y, rect.width, rect.height);
+    FindSums cpu = findSums(kernels().findRow, currView, refView, weights);
+
+    bool ok = gpu[RASPITEX_SUM_COUNT] == cpu.count;
+    double gx = 0, gy = 0, cx = 0, cy = 0;
+    if (cpu.count && gpu[RASPITEX_SUM_W]) {
+        gx = gpu[RASPITEX_SUM_WX] / gpu[RASPITEX_SUM_W];
+        gy = gpu[RASPITEX_SUM_WY] / gpu[RASPITEX_SUM_W];
+        cx = (double) cpu.wx / cpu.w;
+        cy = (double) cpu.wy / cpu.w;
+        ok = ok && fabs(gx - cx) <= SUMS_TOLERANCE &&
+             fabs(gy - cy) <= SUMS_TOLERANCE;
+    }
+
+    printf("  %4d,%-4d %4dx%-4d  count %7.0f / %-7u  x %8.3f / %-8.3f"
+           "  y %8.3f / %-8.3f %s\n",
+           rect.x, rect.y, rect.width, rect.height,
+           gpu[RASPITEX_SUM_COUNT], cpu.count, gx, cx, gy, cy,
+           ok ? "" : "MISMATCH");
+    return ok;
+}
+
+// Sums regions of the frames at one capture scale with each set of
+// weights. Returns the number of regions that disagreed.
+static int checkScale(FrameDrawer &drawer, int width, int height,
+                      int scale) {
+    RASPITEXCAPTURE_FRAME frame;
+    raspitexcapture_frame_init(&frame, width, height, scale);
+    int cw = frame.capture_width;
+    int ch = frame.capture_height;
+
+    std::vector<uint8_t> refFrame, currFrame, ref, curr, sums;
+    makeFrames(width, height, refFrame, currFrame);
+
+    // The reference and current frames as the CPU would see them at
+    // this scale, with the first also stored as the GPU's reference.
+    RASPITEX_CAPTURE_PARAMS params;
+    memset(&params, 0, sizeof(params));
+    params.mode = RASPITEX_CAPTURE_BGRA;
+    params.flags = RASPITEX_CAPTURE_SET_REFERENCE;
+    drawer.draw(refFrame, width, height);
+    bool ok = capture(&frame, params, ref);
+    params.flags = 0;
+    drawer.draw(currFrame, width, height);
+    ok = ok && capture(&frame, params, curr);
+    if (!ok) {
+        fprintf(stderr, "scale %d: BGRA capture failed\n", scale);
+        raspitexcapture_gl_term(&frame);
+        return 1;
+    }
+
+    static const double weightSets[][3] = {
+        { 1, 1, 1 },
+        { 1, 0.5, 0.25 },
+        { 0.5, -1, 0.5 },
+    };
+    const RASPITEX_RECT regions[] = {
+        { 0, 0, cw, ch },
+        { 13, 7, cw / 2, ch / 3 },
+        { cw / 3, ch / 2, cw - cw / 3, ch - ch / 2 },
+        { cw - 37, ch - 29, 37, 29 },
+        { cw / 2, ch / 2, 1, 1 },
+    };
+    int numRegions = sizeof(regions) / sizeof(regions[0]);
+
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(weightSets) / sizeof(weightSets[0]);
+         ++i) {
+        const double *w = weightSets[i];
+        printf("scale %d (%dx%d), weights %g, %g, %g:\n",
+               scale, cw, ch, w[0], w[1], w[2]);
+
+        // As diffParams() builds them, but without replacing the
+        // reference, so every set is weighed against the same frame.
+        memset(&params, 0, sizeof(params));
+        params.mode = RASPITEX_CAPTURE_SUMS;
+        params.flags = RASPITEX_CAPTURE_DIFF;
+        params.weights[0] = w[0];
+        params.weights[1] = w[1];
+        params.weights[2] = w[2];
+        params.threshold = 0.5 * 255 * (w[0] + w[1] + w[2]);
+        params.num_rects = numRegions;
+        memcpy(params.rects, regions, sizeof(regions));
+
+        if (!capture(&frame, params, sums)) {
+            fprintf(stderr, "scale %d: sums capture failed\n", scale);
+            ++failures;
+            continue;
+        }
+        for (int r = 0; r < numRegions; ++r) {
+            if (!checkRegion(ref, curr, cw, ch, regions[r], params,
+                             &sums[r * RASPITEX_NUM_SUMS * 4])) {
+                ++failures;
+            }
+        }
+    }
+
+    raspitexcapture_gl_term(&frame);
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    int width = argc > 2 ? atoi(argv[1]) : WIDTH;
+    int height = argc > 2 ? atoi(argv[2]) : HEIGHT;
+    if (width < 256 || height < 256) {
+        fprintf(stderr, "usage: %s [width height], at least 256x256\n",
+                argv[0]);
+        return 2;
+    }
+
+    FrameDrawer drawer;
+    if (!makeContext(width, height) || !drawer.init()) {
+        return 2;
+    }
+    printf("%s, %s kernels\n", glGetString(GL_RENDERER), kernels().isa);
+
+    int failures = 0;
+    for (int scale = 1; scale <= 4; scale <<= 1) {
+        failures += checkScale(drawer, width, height, scale);
+    }
+
+    printf("%s: %d region(s) disagree\n", failures ? "FAIL" : "ok",
+           failures);
+    return failures ? 1 : 0;
+}
@@ -3,10 +3,18 @@
         "target_name": "offgrid",
         "sources": [
             "offgrid.cc",
+            "background.cc",
+            "blobs.cc",
+            "kernels.cc",
+            "search.cc",
+            "tracker.cc",
+            "workers.cc",
             "raspicam/RaspiCamControl.c",
             "raspicam/RaspiCLI.c",
             "raspicam/RaspiPreview.c",
             "raspicam/RaspiTex.c",
+            "raspicam/RaspiTexCapture.c",
+            "raspicam/RaspiTexShader.c",
             "raspicam/RaspiTexUtil.c",
             "raspicam/tga.c",
             "raspicam/gl_scenes/calibration.c",
@@ -32,5 +40,46 @@
             "-lEGL",
             "-lm",
         ]
+    }, {
+        "target_name": "offgrid_bench",
+        "type": "executable",
+        "sources": [
+            "bench/bench.cc",
+            "background.cc",
+            "blobs.cc",
+            "kernels.cc",
+            "workers.cc",
+        ],
+        "include_dirs": [
+            ".",
+        ],
+        "libraries": [
+            "-lrt",
+            "-lpthread",
+        ]
+    }, {
+        "target_name": "offgrid_sums_check",
+        "type": "executable",
+        "sources": [
+            "bench/sums_check.cc",
+            "kernels.cc",
+            "workers.cc",
+            "raspicam/RaspiTexCapture.c",
+            "raspicam/RaspiTexShader.c",
+        ],
+        "defines": [
+            "RASPITEX_STANDALONE",
+        ],
+        "include_dirs": [
+            ".",
+            "./raspicam",
+        ],
+        "libraries": [
+            "-lGLESv2",
+            "-lEGL",
+            "-lm",
+            "-lrt",
+            "-lpthread",
+        ]
     }]
 }
@@ -0,0 +1,218 @@
+#include <algorithm>
+
+#include "blobs.h"
+
+namespace {
+
+// Passing pixels [x1, x2) of row y.
+struct BlobRun {
+    int32_t x1, x2;
+    int32_t y;
+    int64_t w;
+    int64_t wx;
+};
+
+// A run's place in the union-find forest. Roots hold their group's sums.
+struct BlobNode {
+    uint32_t parent;
+    Blob blob;
+};
+
+// Cuts a row of weights, from column x of row y, into runs of passing
+// pixels.
+void appendRuns(const int32_t *w, uint32_t count, int32_t x, int32_t y,
+                std::vector<BlobRun> &runs) {
+    uint32_t i = 0;
+    while (i < count) {
+        if (!w[i]) {
+            ++i;
+            continue;
+        }
+
+        BlobRun run;
+        run.x1 = x + i;
+        run.y = y;
+        run.w = run.wx = 0;
+        for (; i < count && w[i]; ++i) {
+            run.w += w[i];
+            run.wx += (int64_t) w[i] * (x + i);
+        }
+        run.x2 = x + i;
+        runs.push_back(run);
+    }
+}
+
+struct RunVisitor {
+    WeighRowKernel weighRow;
+    const FindWeights &weights;
+    std::vector<int32_t> w;
+    std::vector<BlobRun> &runs;
+
+    RunVisitor(WeighRowKernel weighRow, const FindWeights &weights,
+               uint32_t width, std::vector<BlobRun> &runs)
+        : weighRow(weighRow), weights(weights), w(width), runs(runs) {}
+
+    void operator()(const uint8_t *curr, const uint8_t *ref,
+                    uint32_t count, int32_t x, int32_t y) {
+        weighRow(curr, ref, count, weights, &w[0]);
+        appendRuns(&w[0], count, x, y, runs);
+    }
+};
+
+struct RunBands {
+    WeighRowKernel weighRow;
+    const FrameView *curr;
+    const FrameView *ref;
+    const FindWeights *weights;
+    std::vector<BlobRun> runs[WORKERS_MAX];
+};
+
+bool heavier(const Blob &a, const Blob &b) {
+    return a.w > b.w;
+}
+
+}
+
+static void runBand(void *context, unsigned part, unsigned parts) {
+    RunBands *bands = static_cast<RunBands *>(context);
+    const FrameView &curr = *bands->curr;
+    unsigned begin, end;
+    workerRange(curr.height, part, parts, begin, end);
+
+    FrameView band = frameSubView(curr, curr.x, curr.y + begin,
+                                  curr.width, end - begin);
+    RunVisitor visitor(bands->weighRow, *bands->weights, curr.width,
+                       bands->runs[part]);
+    frameForEachRow(band, *bands->ref, visitor);
+}
+
+// Collects the runs of a row the background model weighed.
+static void modelRuns(void *context, unsigned part, const int32_t *w,
+                      uint32_t count, int32_t x, int32_t y) {
+    std::vector<BlobRun> *runs = static_cast<std::vector<BlobRun> *>(context);
+    appendRuns(w, count, x, y, runs[part]);
+}
+
+static uint32_t findRoot(std::vector<BlobNode> &nodes, uint32_t i) {
+    while (nodes[i].parent != i) {
+        nodes[i].parent = nodes[nodes[i].parent].parent;
+        i = nodes[i].parent;
+    }
+    return i;
+}
+
+// Merges the groups of nodes a and b into whichever root came first.
+static void join(std::vector<BlobNode> &nodes, uint32_t a, uint32_t b) {
+    a = findRoot(nodes, a);
+    b = findRoot(nodes, b);
+    if (a == b) {
+        return;
+    }
+    if (b < a) {
+        std::swap(a, b);
+    }
+
+    Blob &into = nodes[a].blob;
+    const Blob &from = nodes[b].blob;
+    into.w += from.w;
+    into.wx += from.wx;
+    into.wy += from.wy;
+    into.area += from.area;
+    into.x1 = std::min(into.x1, from.x1);
+    into.y1 = std::min(into.y1, from.y1);
+    into.x2 = std::max(into.x2, from.x2);
+    into.y2 = std::max(into.y2, from.y2);
+    nodes[b].parent = a;
+}
+
+// Joins runs, which are in row order, into the groups they touch, and
+// fills blobs with those of at least minArea pixels, heaviest first.
+static void joinRuns(const std::vector<BlobRun> &runs, uint32_t minArea,
+                     std::vector<Blob> &blobs) {
+    blobs.clear();
+
+    std::vector<BlobNode> nodes(runs.size());
+    size_t above = 0, aboveEnd = 0;     // runs of the row above
+    size_t rowBegin = 0;
+    for (size_t i = 0; i < runs.size(); ++i) {
+        const BlobRun &run = runs[i];
+        if (i == 0 || run.y != runs[i - 1].y) {
+            bool adjacent = i > 0 && run.y == runs[i - 1].y + 1;
+            above = adjacent ? rowBegin : i;
+            aboveEnd = i;
+            rowBegin = i;
+        }
+
+        BlobNode &node = nodes[i];
+        node.parent = i;
+        node.blob.w = run.w;
+        node.blob.wx = run.wx;
+        node.blob.wy = run.w * run.y;
+        node.blob.area = run.x2 - run.x1;
+        node.blob.x1 = run.x1;
+        node.blob.y1 = run.y;
+        node.blob.x2 = run.x2;
+        node.blob.y2 = run.y + 1;
+
+        // Runs above that end before this one starts can't touch it or
+        // any run after it. Diagonal neighbours count as touching.
+        while (above < aboveEnd && runs[above].x2 < run.x1) {
+            ++above;
+        }
+        for (size_t j = above; j < aboveEnd && runs[j].x1 <= run.x2; ++j) {
+            join(nodes, j, i);
+        }
+    }
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (nodes[i].parent == i && nodes[i].blob.area >= minArea) {
+            blobs.push_back(nodes[i].blob);
+        }
+    }
+    std::sort(blobs.begin(), blobs.end(), heavier);
+}
+
+// Appends the later bands' runs to the first band's. The bands are in
+// row order, so their runs are too.
+static std::vector<BlobRun> &mergeRuns(std::vector<BlobRun> *runs,
+                                       unsigned parts) {
+    for (unsigned i = 1; i < parts; ++i) {
+        runs[0].insert(runs[0].end(), runs[i].begin(), runs[i].end());
+    }
+    return runs[0];
+}
+
+void findBlobs(WeighRowKernel weighRow, const FrameView &curr,
+               const FrameView &ref, const FindWeights &weights,
+               uint32_t minArea, std::vector<Blob> &blobs,
+               WorkerPool *workers) {
+
+    // Unpassed pixels weigh 0, so only positive weights can mark a blob.
+    FindWeights positive = weights;
+    positive.threshold = std::max(weights.threshold, 0);
+
+    unsigned parts = bandParts(workers, curr.height);
+
+    RunBands bands;
+    bands.weighRow = weighRow;
+    bands.curr = &curr;
+    bands.ref = &ref;
+    bands.weights = &positive;
+    if (parts > 1) {
+        workers->run(runBand, &bands, parts);
+    } else {
+        runBand(&bands, 0, 1);
+    }
+
+    joinRuns(mergeRuns(bands.runs, parts), minArea, blobs);
+}
+
+void findBlobs(Background &background, ModelRowKernel modelRow,
+               const FrameView &curr, const ModelParams &params,
+               uint32_t minArea, std::vector<Blob> &blobs,
+               WorkerPool *workers) {
+    std::vector<BlobRun> runs[WORKERS_MAX];
+    unsigned parts = background.update(modelRow, curr, params, modelRuns,
+                                       runs, workers);
+    joinRuns(mergeRuns(runs, parts), minArea, blobs);
+}
@@ -0,0 +1,42 @@
+#ifndef OFFGRID_BLOBS_H
+#define OFFGRID_BLOBS_H
+
+#include <vector>
+
+#include "background.h"
+#include "kernels.h"
+
+// An 8-connected group of pixels that passed find()'s threshold. Sums are
+// in the units of FindWeights, as for FindSums.
+struct Blob {
+    int64_t w;
+    int64_t wx;
+    int64_t wy;
+    uint32_t area;      // pixels
+    int32_t x1, y1;     // bounding box, with x2 and y2 exclusive
+    int32_t x2, y2;
+};
+
+// Labels the connected groups of pixels of curr whose weighted difference
+// from ref, which must contain it, is positive and passes the threshold.
+// Fills blobs with those of at least minArea pixels, heaviest first.
+//
+// Each row is thresholded by weighRow and cut into runs of passing pixels,
+// in bands of rows split between workers if given. The runs are then
+// joined to the touching runs of the row above in one pass with
+// union-find, so the cost beyond the thresholding is per run, not per
+// pixel.
+void findBlobs(WeighRowKernel weighRow, const FrameView &curr,
+               const FrameView &ref, const FindWeights &weights,
+               uint32_t minArea, std::vector<Blob> &blobs,
+               WorkerPool *workers = NULL);
+
+// Like findBlobs() above, but labels the pixels of curr that pass the
+// background model, which must cover it, updating the model as
+// Background::update() does in the same pass.
+void findBlobs(Background &background, ModelRowKernel modelRow,
+               const FrameView &curr, const ModelParams &params,
+               uint32_t minArea, std::vector<Blob> &blobs,
+               WorkerPool *workers = NULL);
+
+#endif
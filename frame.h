@@ -0,0 +1,77 @@
+#ifndef OFFGRID_FRAME_H
+#define OFFGRID_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The Pi's ARM11 has 32-byte cache lines and its Cortex-A cores 64-byte
+// ones; prefetching every 64 bytes covers both well enough.
+#define FRAME_CACHE_LINE 64
+
+// How far ahead of the current row to prefetch, and how much of it. The
+// hardware prefetcher follows the stream once it has been started.
+#define FRAME_PREFETCH_ROWS 2
+#define FRAME_PREFETCH_BYTES (4 * FRAME_CACHE_LINE)
+
+// A rectangle of 4-byte pixels inside a row-major buffer. Co-ordinates
+// are frame co-ordinates, so views of differently sized captures of the
+// same frame can be walked together.
+struct FrameView {
+    const uint8_t *data;    // pixel (x, y)
+    size_t stride;          // bytes from one row to the next
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+
+    const uint8_t *pixel(int32_t px, int32_t py) const {
+        return data + (size_t) (py - y) * stride + ((size_t) (px - x) << 2);
+    }
+
+    bool contains(int32_t px, int32_t py, int32_t w, int32_t h) const {
+        return px >= x && py >= y &&
+               px + w <= x + width && py + h <= y + height;
+    }
+};
+
+// A view of a tightly packed capture of the given region.
+static inline FrameView frameView(const uint8_t *buffer,
+                                  int32_t x, int32_t y,
+                                  int32_t width, int32_t height) {
+    FrameView view = { buffer, (size_t) width << 2, x, y, width, height };
+    return view;
+}
+
+// The part of view covering a region, which it must contain.
+static inline FrameView frameSubView(const FrameView &view,
+                                     int32_t x, int32_t y,
+                                     int32_t width, int32_t height) {
+    FrameView sub = { view.pixel(x, y), view.stride, x, y, width, height };
+    return sub;
+}
+
+static inline void framePrefetch(const uint8_t *p, size_t bytes) {
+    for (size_t i = 0; i < bytes; i += FRAME_CACHE_LINE) {
+        __builtin_prefetch(p + i);
+    }
+}
+
+// Calls visit(curr, ref, count, x, y) for each row of curr, top to
+// bottom, with ref pointing at the same pixel of a second view that
+// contains it. Both buffers are read strictly in address order, and the
+// rows ahead are prefetched as they go.
+template <typename Visit>
+void frameForEachRow(const FrameView &curr, const FrameView &ref,
+                     Visit &visit) {
+    for (int32_t y = curr.y; y < curr.y + curr.height; ++y) {
+        int32_t ahead = y + FRAME_PREFETCH_ROWS;
+        if (ahead < curr.y + curr.height) {
+            framePrefetch(curr.pixel(curr.x, ahead), FRAME_PREFETCH_BYTES);
+            framePrefetch(ref.pixel(curr.x, ahead), FRAME_PREFETCH_BYTES);
+        }
+        visit(curr.pixel(curr.x, y), ref.pixel(curr.x, y),
+              (uint32_t) curr.width, curr.x, y);
+    }
+}
+
+#endif
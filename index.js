@@ -3,8 +3,59 @@ var offgrid = require('./build/Debug/offgrid');
 // Selectively re-export and/or wrap offgrid methods.
 exports.save = offgrid.save;
 exports.tare = offgrid.tare;
+exports.pinReference = offgrid.pinReference;
 exports.setData = offgrid.setData;
 exports.sample = offgrid.sample;
+exports.sampleGPU = offgrid.sampleGPU;
 exports.find = offgrid.find;
+exports.adaptiveWindow = offgrid.adaptiveWindow;
+exports.backgroundModel = offgrid.backgroundModel;
+exports.findBlobs = offgrid.findBlobs;
+exports.track = offgrid.track;
+exports.resetTracks = offgrid.resetTracks;
+exports.findBright = offgrid.findBright;
+exports.findMask = offgrid.findMask;
+exports.findGPU = offgrid.findGPU;
+exports.analyze = offgrid.analyze;
+exports.stats = offgrid.stats;
+exports.regionMeans = offgrid.regionMeans;
 exports.width = offgrid.width;
 exports.height = offgrid.height;
+exports.poolStats = offgrid.poolStats;
+exports.captureStats = offgrid.captureStats;
+exports.kernelISA = offgrid.kernelISA;
+exports.threads = offgrid.threads;
+
+// The native tare, sample*, find*, track, analyze, stats and regionMeans
+// methods accept a trailing callback(error, result), in which case they
+// return immediately and the result is delivered once the GL thread has
+// captured the next frame.
+// These wrappers expose the same asynchronous calls as promises.
+function promisify(method) {
+  return function() {
+    var args = Array.prototype.slice.call(arguments);
+    return new Promise(function(resolve, reject) {
+      args.push(function(error, result) {
+        if (error) {
+          reject(error);
+        } else {
+          resolve(result);
+        }
+      });
+      method.apply(offgrid, args);
+    });
+  };
+}
+
+exports.tareAsync = promisify(offgrid.tare);
+exports.sampleAsync = promisify(offgrid.sample);
+exports.sampleGPUAsync = promisify(offgrid.sampleGPU);
+exports.findAsync = promisify(offgrid.find);
+exports.findBlobsAsync = promisify(offgrid.findBlobs);
+exports.trackAsync = promisify(offgrid.track);
+exports.findBrightAsync = promisify(offgrid.findBright);
+exports.findMaskAsync = promisify(offgrid.findMask);
+exports.findGPUAsync = promisify(offgrid.findGPU);
+exports.analyzeAsync = promisify(offgrid.analyze);
+exports.statsAsync = promisify(offgrid.stats);
+exports.regionMeansAsync = promisify(offgrid.regionMeans);
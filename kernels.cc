@@ -0,0 +1,1413 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OFFGRID_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON) || defined(__arm__)
+#define OFFGRID_ARM 1
+#if defined(__arm__) && !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+// 32-bit Raspbian builds without -mfpu=neon, so the NEON kernels are
+// compiled for it explicitly and only chosen if the CPU has it.
+#pragma GCC push_options
+#pragma GCC target("fpu=neon")
+#endif
+#include <arm_neon.h>
+#if defined(__arm__) && !defined(__aarch64__)
+#pragma GCC pop_options
+#define NEON_TARGET __attribute__((target("fpu=neon")))
+#else
+#define NEON_TARGET
+#endif
+#endif
+
+// Pixels per SIMD iteration.
+#define BLOCK 16
+
+// Blocks between flushes of the 32-bit accumulators. With |w| < 2^22 the
+// running sums stay below 2^31 for this many blocks.
+#define BLOCKS_PER_FLUSH 16
+
+static const int32_t kMaxPixelWeight = 1 << 22;
+
+FindWeights findWeights(double rWeight, double gWeight, double bWeight,
+                        double threshold) {
+    // The largest power of two scale, up to 256, that keeps
+    // 255 * (|r| + |g| + |b|) below kMaxPixelWeight.
+    double total = 255 * (fabs(rWeight) + fabs(gWeight) + fabs(bWeight));
+    double scale = 256;
+    while (scale > 1.0 / 256 && total * scale >= kMaxPixelWeight) {
+        scale /= 2;
+    }
+
+    FindWeights weights;
+    weights.r = (int16_t) lrint(rWeight * scale);
+    weights.g = (int16_t) lrint(gWeight * scale);
+    weights.b = (int16_t) lrint(bWeight * scale);
+
+    // Pixel sums are integers, so sum > threshold iff sum > floor(threshold).
+    double t = floor(threshold * scale);
+    if (t > INT32_MAX) {
+        t = INT32_MAX;
+    } else if (t < INT32_MIN) {
+        t = INT32_MIN;
+    }
+    weights.threshold = (int32_t) t;
+    weights.scale = scale;
+    return weights;
+}
+
+static inline int32_t pixelWeight(const uint8_t *c, const uint8_t *t,
+                                  const FindWeights &weights) {
+    return weights.r * (c[0] - t[0]) +
+           weights.g * (c[1] - t[1]) +
+           weights.b * (c[2] - t[2]);
+}
+
+static void findRowScalar(const uint8_t *curr, const uint8_t *tare,
+                          uint32_t count, uint32_t x, uint32_t y,
+                          const FindWeights &weights, FindSums &sums) {
+    for (uint32_t i = 0; i < count; ++i, curr += 4, tare += 4) {
+        int32_t w = pixelWeight(curr, tare, weights);
+        if (w > weights.threshold) {
+            sums.w += w;
+            sums.wx += (int64_t) w * (x + i);
+            sums.wy += (int64_t) w * y;
+            ++sums.count;
+        }
+    }
+}
+
+static void weighRowScalar(const uint8_t *curr, const uint8_t *tare,
+                           uint32_t count, const FindWeights &weights,
+                           int32_t *w) {
+    for (uint32_t i = 0; i < count; ++i, curr += 4, tare += 4) {
+        int32_t weight = pixelWeight(curr, tare, weights);
+        w[i] = weight > weights.threshold ? weight : 0;
+    }
+}
+
+// The largest value a model's variance lane holds.
+#define MODEL_MAX_VARIANCE 0xffff
+
+// Moves one model lane 1 / 2^rate of the way to target, without leaving
+// 16 bits: the result never exceeds the larger of the two.
+static inline uint16_t modelStep(uint16_t lane, uint32_t target,
+                                 unsigned rate) {
+    return lane - (lane >> rate) + (target >> rate);
+}
+
+static void modelRowScalar(const uint8_t *curr, uint16_t *model,
+                           uint32_t count, const ModelParams &params,
+                           int32_t *w) {
+    const FindWeights &weights = params.weights;
+    for (uint32_t i = 0; i < count; ++i, curr += 4, model += 4) {
+        int32_t dr = curr[0] - ((model[0] + 128) >> 8);
+        int32_t dg = curr[1] - ((model[1] + 128) >> 8);
+        int32_t db = curr[2] - ((model[2] + 128) >> 8);
+        int32_t d = weights.r * dr + weights.g * dg + weights.b * db;
+
+        float deviation = (float) d;
+        float variance = std::max((float) model[3], params.minVariance);
+        bool passed = d > weights.threshold &&
+                      deviation * deviation > params.spread * variance;
+        w[i] = passed ? d : 0;
+
+        uint32_t squares = (uint32_t) (dr * dr + dg * dg + db * db) << 4;
+        unsigned rate = passed ? params.slowRate : params.rate;
+        model[0] = modelStep(model[0], (uint32_t) curr[0] << 8, rate);
+        model[1] = modelStep(model[1], (uint32_t) curr[1] << 8, rate);
+        model[2] = modelStep(model[2], (uint32_t) curr[2] << 8, rate);
+        model[3] = modelStep(model[3],
+                             std::min(squares, (uint32_t) MODEL_MAX_VARIANCE),
+                             rate);
+    }
+}
+
+// Folds the per-pixel-offset accumulators of a run of blocks into sums.
+// acc[i] is the sum of w at offset i of each block, and prior[i] the sum
+// over blocks of acc[i] before that block was added, so that
+// sum(w * block) = (blocks - 1) * acc[i] - prior[i].
+static void flushBlocks(const int32_t acc[BLOCK], const int32_t prior[BLOCK],
+                        uint32_t count, uint32_t blocks, uint32_t x,
+                        uint32_t y, FindSums &sums) {
+    int64_t w = 0;
+    int64_t wx = 0;
+    for (int i = 0; i < BLOCK; ++i) {
+        int64_t byBlock = (int64_t) (blocks - 1) * acc[i] - prior[i];
+        w += acc[i];
+        wx += (int64_t) acc[i] * (x + i) + BLOCK * byBlock;
+    }
+    sums.w += w;
+    sums.wx += wx;
+    sums.wy += w * y;
+    sums.count += count;
+}
+
+static inline int32_t clampCoord(int32_t v, int32_t lo, int32_t size) {
+    return v < lo ? lo : v >= lo + size ? lo + size - 1 : v;
+}
+
+static void sampleScalar(const FrameView &frame, int32_t x, int32_t y,
+                         uint8_t rgb[3]) {
+    uint32_t sum[3] = { 0, 0, 0 };
+
+    for (int32_t dy = -1; dy <= 1; ++dy) {
+        int32_t b = clampCoord(y + dy, frame.y, frame.height);
+        for (int32_t dx = -1; dx <= 1; ++dx) {
+            int32_t a = clampCoord(x + dx, frame.x, frame.width);
+            uint32_t coefficient = (dx == 0 && dy == 0) ? 4 : 1;
+            const uint8_t *p = frame.pixel(a, b);
+            sum[0] += coefficient * p[0];
+            sum[1] += coefficient * p[1];
+            sum[2] += coefficient * p[2];
+        }
+    }
+
+    rgb[0] = sum[0] / 12;
+    rgb[1] = sum[1] / 12;
+    rgb[2] = sum[2] / 12;
+}
+
+static void sampleBlockScalar(const uint8_t *p, size_t stride,
+                              uint8_t rgb[3]) {
+    for (int c = 0; c < 3; ++c) {
+        const uint8_t *q = p + c;
+        uint32_t sum = q[0] + q[4] + q[8] +
+                       q[2 * stride] + q[2 * stride + 4] + q[2 * stride + 8] +
+                       q[stride] + 4 * q[stride + 4] + q[stride + 8];
+        rgb[c] = sum / 12;
+    }
+}
+
+// Pixels whose neighbourhood can be loaded as four whole pixels per row.
+static inline bool sampleInterior(const FrameView &frame,
+                                  int32_t x, int32_t y) {
+    return x > frame.x && x + 2 < frame.x + frame.width &&
+           y > frame.y && y + 1 < frame.y + frame.height;
+}
+
+// Rows of Pascal's triangle. Row 2r, normalised, is the binomial
+// approximation to a Gaussian of variance r / 2, and sums to 4^r.
+static const uint32_t kBinomial[2 * SAMPLE_MAX_RADIUS + 1]
+                               [2 * SAMPLE_MAX_RADIUS + 1] = {
+    { 1 },
+    { 1, 1 },
+    { 1, 2, 1 },
+    { 1, 3, 3, 1 },
+    { 1, 4, 6, 4, 1 },
+    { 1, 5, 10, 10, 5, 1 },
+    { 1, 6, 15, 20, 15, 6, 1 },
+    { 1, 7, 21, 35, 35, 21, 7, 1 },
+    { 1, 8, 28, 56, 70, 56, 28, 8, 1 },
+};
+
+// Weights of the shapes sampleShaped() is specialised for, given the
+// radius and a pixel's column i and row j in the (2r + 1)^2 square.
+struct BoxShape {
+    static uint32_t weight(int, int, int) { return 1; }
+    static uint32_t total(int r) { return (2 * r + 1) * (2 * r + 1); }
+};
+
+struct GaussianShape {
+    static uint32_t weight(int r, int i, int j) {
+        return kBinomial[2 * r][i] * kBinomial[2 * r][j];
+    }
+    static uint32_t total(int r) { return 1u << (4 * r); }
+};
+
+// One shape and radius of sample kernel. Both are constants, so the loops
+// unroll and the weights and divisor fold into the code.
+template <typename Shape, int R>
+static void sampleShaped(const FrameView &frame, int32_t x, int32_t y,
+                         uint8_t rgb[3]) {
+    uint32_t sum[3] = { 0, 0, 0 };
+
+    if (frame.contains(x - R, y - R, 2 * R + 1, 2 * R + 1)) {
+        const uint8_t *row = frame.pixel(x - R, y - R);
+        for (int j = 0; j <= 2 * R; ++j, row += frame.stride) {
+            for (int i = 0; i <= 2 * R; ++i) {
+                uint32_t weight = Shape::weight(R, i, j);
+                sum[0] += weight * row[4 * i + 0];
+                sum[1] += weight * row[4 * i + 1];
+                sum[2] += weight * row[4 * i + 2];
+            }
+        }
+    } else {
+        for (int j = 0; j <= 2 * R; ++j) {
+            int32_t b = clampCoord(y - R + j, frame.y, frame.height);
+            for (int i = 0; i <= 2 * R; ++i) {
+                int32_t a = clampCoord(x - R + i, frame.x, frame.width);
+                uint32_t weight = Shape::weight(R, i, j);
+                const uint8_t *p = frame.pixel(a, b);
+                sum[0] += weight * p[0];
+                sum[1] += weight * p[1];
+                sum[2] += weight * p[2];
+            }
+        }
+    }
+
+    rgb[0] = sum[0] / Shape::total(R);
+    rgb[1] = sum[1] / Shape::total(R);
+    rgb[2] = sum[2] / Shape::total(R);
+}
+
+static const SampleKernel kShaped[][SAMPLE_MAX_RADIUS + 1] = {
+    {   // SAMPLE_BOX
+        sampleShaped<BoxShape, 0>,
+        sampleShaped<BoxShape, 1>,
+        sampleShaped<BoxShape, 2>,
+        sampleShaped<BoxShape, 3>,
+        sampleShaped<BoxShape, 4>,
+    },
+    {   // SAMPLE_GAUSSIAN
+        sampleShaped<GaussianShape, 0>,
+        sampleShaped<GaussianShape, 1>,
+        sampleShaped<GaussianShape, 2>,
+        sampleShaped<GaussianShape, 3>,
+        sampleShaped<GaussianShape, 4>,
+    },
+};
+
+SampleKernel sampleKernelFor(SampleShape shape, unsigned radius) {
+    if (shape == SAMPLE_CENTRE) {
+        return NULL;
+    }
+    if (radius > SAMPLE_MAX_RADIUS) {
+        radius = SAMPLE_MAX_RADIUS;
+    }
+    return kShaped[shape - SAMPLE_BOX][radius];
+}
+
+static void integralRowScalar(const uint8_t *row, uint32_t count,
+                              const uint32_t *above, uint32_t *out) {
+    uint32_t run[4] = { 0, 0, 0, 0 };
+    for (uint32_t i = 0; i < count; ++i, row += 4, above += 4, out += 4) {
+        for (int c = 0; c < 4; ++c) {
+            run[c] += row[c];
+            out[c] = run[c] + above[c];
+        }
+    }
+}
+
+void integralImage(IntegralRowKernel integralRow, const FrameView &frame,
+                   IntegralImage &table) {
+    size_t stride = (size_t) (frame.width + 1) * 4;
+    table.x = frame.x;
+    table.y = frame.y;
+    table.width = frame.width;
+    table.height = frame.height;
+
+    memset(table.sums, 0, stride * sizeof(uint32_t));
+    uint32_t *above = table.sums;
+    for (int32_t y = frame.y; y < frame.y + frame.height; ++y) {
+        uint32_t *out = above + stride;
+        int32_t ahead = y + FRAME_PREFETCH_ROWS;
+        if (ahead < frame.y + frame.height) {
+            framePrefetch(frame.pixel(frame.x, ahead), FRAME_PREFETCH_BYTES);
+        }
+
+        out[0] = out[1] = out[2] = out[3] = 0;
+        integralRow(frame.pixel(frame.x, y), frame.width, above + 4, out + 4);
+        above = out;
+    }
+}
+
+uint32_t integralSums(const IntegralImage &table, int32_t x, int32_t y,
+                      int32_t width, int32_t height, uint32_t rgb[3]) {
+    int32_t x1 = std::max(x, table.x) - table.x;
+    int32_t y1 = std::max(y, table.y) - table.y;
+    int32_t x2 = std::min(x + width, table.x + table.width) - table.x;
+    int32_t y2 = std::min(y + height, table.y + table.height) - table.y;
+    if (x2 <= x1 || y2 <= y1) {
+        rgb[0] = rgb[1] = rgb[2] = 0;
+        return 0;
+    }
+
+    size_t stride = (size_t) (table.width + 1) * 4;
+    const uint32_t *top = table.sums + y1 * stride;
+    const uint32_t *bottom = table.sums + y2 * stride;
+    for (int c = 0; c < 3; ++c) {
+        rgb[c] = bottom[x2 * 4 + c] - bottom[x1 * 4 + c] -
+                 top[x2 * 4 + c] + top[x1 * 4 + c];
+    }
+    return (uint32_t) (x2 - x1) * (y2 - y1);
+}
+
+static inline uint8_t pixelLuma(const uint8_t *p) {
+    return (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+}
+
+static void histogramRowScalar(const uint8_t *row, uint32_t count,
+                               FrameHistogram &histogram) {
+    for (uint32_t i = 0; i < count; ++i, row += 4) {
+        ++histogram.r[row[0]];
+        ++histogram.g[row[1]];
+        ++histogram.b[row[2]];
+        ++histogram.luma[pixelLuma(row)];
+    }
+}
+
+void addHistogram(FrameHistogram &sum, const FrameHistogram &part) {
+    for (int i = 0; i < 256; ++i) {
+        sum.r[i] += part.r[i];
+        sum.g[i] += part.g[i];
+        sum.b[i] += part.b[i];
+        sum.luma[i] += part.luma[i];
+    }
+}
+
+struct HistogramBands {
+    HistogramRowKernel histogramRow;
+    const FrameView *frame;
+    FrameHistogram *histograms;         // one per part
+};
+
+static void histogramBand(void *context, unsigned part, unsigned parts) {
+    HistogramBands *bands = static_cast<HistogramBands *>(context);
+    const FrameView &frame = *bands->frame;
+    unsigned begin, end;
+    workerRange(frame.height, part, parts, begin, end);
+
+    FrameHistogram &histogram = bands->histograms[part];
+    memset(&histogram, 0, sizeof(histogram));
+    for (int32_t y = frame.y + begin; y < frame.y + (int32_t) end; ++y) {
+        bands->histogramRow(frame.pixel(frame.x, y), frame.width, histogram);
+    }
+}
+
+namespace {
+
+struct FindRowVisitor {
+    FindRowKernel findRow;
+    const FindWeights &weights;
+    FrameHistogram *histogram;
+    HistogramRowKernel histogramRow;
+    FindSums sums;
+
+    FindRowVisitor(FindRowKernel findRow, const FindWeights &weights,
+                   FrameHistogram *histogram,
+                   HistogramRowKernel histogramRow)
+        : findRow(findRow), weights(weights), histogram(histogram),
+          histogramRow(histogramRow) {
+        sums.w = sums.wx = sums.wy = 0;
+        sums.count = 0;
+    }
+
+    void operator()(const uint8_t *curr, const uint8_t *ref,
+                    uint32_t count, int32_t x, int32_t y) {
+        findRow(curr, ref, count, x, y, weights, sums);
+        if (histogram) {
+            histogramRow(curr, count, *histogram);
+        }
+    }
+};
+
+}
+
+struct FindBands {
+    FindRowKernel findRow;
+    const FrameView *curr;
+    const FrameView *ref;
+    const FindWeights *weights;
+    FindSums partial[WORKERS_MAX];
+    FrameHistogram *histograms;         // one per part, or NULL
+    HistogramRowKernel histogramRow;
+};
+
+static void findBand(void *context, unsigned part, unsigned parts) {
+    FindBands *bands = static_cast<FindBands *>(context);
+    const FrameView &curr = *bands->curr;
+    unsigned begin, end;
+    workerRange(curr.height, part, parts, begin, end);
+
+    FrameView band = curr;
+    band.data = curr.pixel(curr.x, curr.y + begin);
+    band.y = curr.y + begin;
+    band.height = end - begin;
+
+    FrameHistogram *histogram = NULL;
+    if (bands->histograms) {
+        histogram = &bands->histograms[part];
+        memset(histogram, 0, sizeof(*histogram));
+    }
+
+    FindRowVisitor visitor(bands->findRow, *bands->weights, histogram,
+                           bands->histogramRow);
+    frameForEachRow(band, *bands->ref, visitor);
+    bands->partial[part] = visitor.sums;
+}
+
+void frameHistogram(HistogramRowKernel histogramRow, const FrameView &frame,
+                    FrameHistogram &histogram, WorkerPool *workers) {
+    unsigned parts = bandParts(workers, frame.height);
+    if (parts <= 1) {
+        memset(&histogram, 0, sizeof(histogram));
+        for (int32_t y = frame.y; y < frame.y + frame.height; ++y) {
+            histogramRow(frame.pixel(frame.x, y), frame.width, histogram);
+        }
+        return;
+    }
+
+    FrameHistogram histograms[WORKERS_MAX];
+
+    HistogramBands bands;
+    bands.histogramRow = histogramRow;
+    bands.frame = &frame;
+    bands.histograms = histograms;
+    workers->run(histogramBand, &bands, parts);
+
+    histogram = histograms[0];
+    for (unsigned i = 1; i < parts; ++i) {
+        addHistogram(histogram, histograms[i]);
+    }
+}
+
+FindSums findSums(FindRowKernel findRow, const FrameView &curr,
+                  const FrameView &ref, const FindWeights &weights,
+                  WorkerPool *workers, FrameHistogram *histogram,
+                  HistogramRowKernel histogramRow) {
+    unsigned parts = bandParts(workers, curr.height);
+    if (parts <= 1) {
+        FindRowVisitor visitor(findRow, weights, histogram, histogramRow);
+        frameForEachRow(curr, ref, visitor);
+        return visitor.sums;
+    }
+
+    // Each band counts into its own histogram, so the workers never
+    // share a cache line.
+    FrameHistogram histograms[WORKERS_MAX];
+
+    FindBands bands;
+    bands.findRow = findRow;
+    bands.curr = &curr;
+    bands.ref = &ref;
+    bands.weights = &weights;
+    bands.histograms = histogram ? histograms : NULL;
+    bands.histogramRow = histogramRow;
+    workers->run(findBand, &bands, parts);
+
+    FindSums sums = bands.partial[0];
+    for (unsigned i = 1; i < parts; ++i) {
+        sums.w += bands.partial[i].w;
+        sums.wx += bands.partial[i].wx;
+        sums.wy += bands.partial[i].wy;
+        sums.count += bands.partial[i].count;
+    }
+
+    if (histogram) {
+        for (unsigned i = 0; i < parts; ++i) {
+            addHistogram(*histogram, histograms[i]);
+        }
+    }
+    return sums;
+}
+
+// Tiles the sample plan is sorted by: bands of rows, each split into
+// columns a few cache lines wide.
+#define PLAN_TILE_ROWS 16
+#define PLAN_TILE_WIDTH 64
+
+static bool planOrder(const SamplePoint &a, const SamplePoint &b) {
+    int32_t aBand = a.y / PLAN_TILE_ROWS, bBand = b.y / PLAN_TILE_ROWS;
+    if (aBand != bBand) {
+        return aBand < bBand;
+    }
+    int32_t aColumn = a.x / PLAN_TILE_WIDTH, bColumn = b.x / PLAN_TILE_WIDTH;
+    if (aColumn != bColumn) {
+        return aColumn < bColumn;
+    }
+    if (a.y != b.y) {
+        return a.y < b.y;
+    }
+    return a.x < b.x;
+}
+
+void samplePointAt(SamplePoint &point, uint32_t x, uint32_t y) {
+    point.x = x >> 16;
+    point.y = y >> 16;
+
+    uint32_t fx = x & 0xffff;
+    uint32_t fy = y & 0xffff;
+    point.bilinear = fx || fy;
+
+    // The four weights sum to exactly 65536, and none of them can reach
+    // it while there is a fraction.
+    uint32_t both = (fx * fy) >> 16;
+    point.weights[0] = 0x10000 - fx - fy + both;
+    point.weights[1] = fx - both;
+    point.weights[2] = fy - both;
+    point.weights[3] = both;
+}
+
+void planSamples(SamplePoint *points, uint32_t count,
+                 const FrameView &layout) {
+    for (uint32_t i = 0; i < count; ++i) {
+        SamplePoint &point = points[i];
+        point.offset = SAMPLE_EDGE;
+        if (sampleInterior(layout, point.x, point.y) &&
+            (!point.bilinear ||
+             sampleInterior(layout, point.x + 1, point.y + 1))) {
+            point.offset = (size_t) (point.y - 1 - layout.y) * layout.stride +
+                           ((size_t) (point.x - 1 - layout.x) << 2);
+        }
+    }
+    std::sort(points, points + count, planOrder);
+}
+
+// Samples the four pixels around a point with a fraction and blends them,
+// rounding to nearest.
+static void sampleBilinear(const Kernels &kernels, const FrameView &frame,
+                           const SamplePoint &point, uint8_t rgb[3]) {
+    uint8_t corners[4][3];
+
+    if (point.kernel) {
+        point.kernel(frame, point.x, point.y, corners[0]);
+        point.kernel(frame, point.x + 1, point.y, corners[1]);
+        point.kernel(frame, point.x, point.y + 1, corners[2]);
+        point.kernel(frame, point.x + 1, point.y + 1, corners[3]);
+    } else if (point.offset != SAMPLE_EDGE) {
+        const uint8_t *p = frame.data + point.offset;
+        kernels.sampleBlock(p, frame.stride, corners[0]);
+        kernels.sampleBlock(p + 4, frame.stride, corners[1]);
+        kernels.sampleBlock(p + frame.stride, frame.stride, corners[2]);
+        kernels.sampleBlock(p + frame.stride + 4, frame.stride, corners[3]);
+    } else {
+        kernels.sample(frame, point.x, point.y, corners[0]);
+        kernels.sample(frame, point.x + 1, point.y, corners[1]);
+        kernels.sample(frame, point.x, point.y + 1, corners[2]);
+        kernels.sample(frame, point.x + 1, point.y + 1, corners[3]);
+    }
+
+    for (int c = 0; c < 3; ++c) {
+        uint32_t sum = point.weights[0] * corners[0][c] +
+                       point.weights[1] * corners[1][c] +
+                       point.weights[2] * corners[2][c] +
+                       point.weights[3] * corners[3][c];
+        rgb[c] = (sum + 0x8000) >> 16;
+    }
+}
+
+void samplePlanned(const Kernels &kernels, const FrameView &frame,
+                   const SamplePoint *points, uint32_t count,
+                   uint8_t *rgb) {
+    for (uint32_t i = 0; i < count; ++i) {
+        const SamplePoint &point = points[i];
+        if (i + 1 < count && points[i + 1].offset != SAMPLE_EDGE) {
+            const uint8_t *next = frame.data + points[i + 1].offset;
+            __builtin_prefetch(next);
+            __builtin_prefetch(next + frame.stride);
+            __builtin_prefetch(next + 2 * frame.stride);
+        }
+
+        uint8_t *out = rgb + (size_t) point.index * 3;
+        if (point.bilinear) {
+            sampleBilinear(kernels, frame, point, out);
+        } else if (point.kernel) {
+            point.kernel(frame, point.x, point.y, out);
+        } else if (point.offset != SAMPLE_EDGE) {
+            kernels.sampleBlock(frame.data + point.offset, frame.stride, out);
+        } else {
+            kernels.sample(frame, point.x, point.y, out);
+        }
+    }
+}
+
+static const Kernels kScalar = {
+    "scalar", findRowScalar, weighRowScalar, modelRowScalar, sampleScalar,
+    sampleBlockScalar, integralRowScalar, histogramRowScalar
+};
+
+#ifdef OFFGRID_X86
+
+// Weighted differences of 8 pixels, given as two vectors of 4. Channels
+// are split into 32-bit lanes, narrowed to 16 bits and multiplied in
+// (r, g) and (b, 0) pairs with madd.
+static inline void weighSSE2(__m128i c0, __m128i c1, __m128i t0, __m128i t1,
+                             __m128i rg, __m128i b0, __m128i out[2]) {
+    const __m128i low = _mm_set1_epi32(0xff);
+
+    __m128i dr = _mm_packs_epi32(
+        _mm_sub_epi32(_mm_and_si128(c0, low), _mm_and_si128(t0, low)),
+        _mm_sub_epi32(_mm_and_si128(c1, low), _mm_and_si128(t1, low)));
+    __m128i dg = _mm_packs_epi32(
+        _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(c0, 8), low),
+                      _mm_and_si128(_mm_srli_epi32(t0, 8), low)),
+        _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(c1, 8), low),
+                      _mm_and_si128(_mm_srli_epi32(t1, 8), low)));
+    __m128i db = _mm_packs_epi32(
+        _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(c0, 16), low),
+                      _mm_and_si128(_mm_srli_epi32(t0, 16), low)),
+        _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(c1, 16), low),
+                      _mm_and_si128(_mm_srli_epi32(t1, 16), low)));
+    __m128i zero = _mm_setzero_si128();
+
+    out[0] = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(dr, dg), rg),
+                           _mm_madd_epi16(_mm_unpacklo_epi16(db, zero), b0));
+    out[1] = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(dr, dg), rg),
+                           _mm_madd_epi16(_mm_unpackhi_epi16(db, zero), b0));
+}
+
+static void findRowSSE2(const uint8_t *curr, const uint8_t *tare,
+                        uint32_t count, uint32_t x, uint32_t y,
+                        const FindWeights &weights, FindSums &sums) {
+    const __m128i rg = _mm_set1_epi32(
+        (uint16_t) weights.r | ((uint32_t) (uint16_t) weights.g << 16));
+    const __m128i b0 = _mm_set1_epi32((uint16_t) weights.b);
+    const __m128i threshold = _mm_set1_epi32(weights.threshold);
+
+    while (count >= BLOCK) {
+        uint32_t blocks = count / BLOCK;
+        if (blocks > BLOCKS_PER_FLUSH) {
+            blocks = BLOCKS_PER_FLUSH;
+        }
+
+        __m128i acc[4], prior[4];
+        __m128i passed = _mm_setzero_si128();
+        for (int k = 0; k < 4; ++k) {
+            acc[k] = prior[k] = _mm_setzero_si128();
+        }
+
+        for (uint32_t n = 0; n < blocks; ++n) {
+            const __m128i *c = (const __m128i *) (curr + n * BLOCK * 4);
+            const __m128i *t = (const __m128i *) (tare + n * BLOCK * 4);
+            __m128i w[4];
+            weighSSE2(_mm_loadu_si128(c + 0), _mm_loadu_si128(c + 1),
+                      _mm_loadu_si128(t + 0), _mm_loadu_si128(t + 1),
+                      rg, b0, w);
+            weighSSE2(_mm_loadu_si128(c + 2), _mm_loadu_si128(c + 3),
+                      _mm_loadu_si128(t + 2), _mm_loadu_si128(t + 3),
+                      rg, b0, w + 2);
+
+            for (int k = 0; k < 4; ++k) {
+                __m128i mask = _mm_cmpgt_epi32(w[k], threshold);
+                prior[k] = _mm_add_epi32(prior[k], acc[k]);
+                acc[k] = _mm_add_epi32(acc[k], _mm_and_si128(w[k], mask));
+                passed = _mm_sub_epi32(passed, mask);
+            }
+        }
+
+        int32_t accLanes[BLOCK], priorLanes[BLOCK], passedLanes[4];
+        for (int k = 0; k < 4; ++k) {
+            _mm_storeu_si128((__m128i *) (accLanes + 4 * k), acc[k]);
+            _mm_storeu_si128((__m128i *) (priorLanes + 4 * k), prior[k]);
+        }
+        _mm_storeu_si128((__m128i *) passedLanes, passed);
+
+        flushBlocks(accLanes, priorLanes,
+                    passedLanes[0] + passedLanes[1] +
+                    passedLanes[2] + passedLanes[3],
+                    blocks, x, y, sums);
+
+        curr += blocks * BLOCK * 4;
+        tare += blocks * BLOCK * 4;
+        x += blocks * BLOCK;
+        count -= blocks * BLOCK;
+    }
+
+    findRowScalar(curr, tare, count, x, y, weights, sums);
+}
+
+// Sums the three pixels starting at p, with the middle one weighted by
+// centre, as 16-bit channel lanes 0-3.
+static inline __m128i sampleRowSSE2(const uint8_t *p, __m128i centre) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i px = _mm_loadu_si128((const __m128i *) p);
+    __m128i lo = _mm_unpacklo_epi8(px, zero);   // pixels 0, 1
+    __m128i hi = _mm_unpackhi_epi8(px, zero);   // pixels 2, 3
+    __m128i p1 = _mm_mullo_epi16(_mm_srli_si128(lo, 8), centre);
+    return _mm_add_epi16(_mm_add_epi16(lo, hi), p1);
+}
+
+static void weighRowSSE2(const uint8_t *curr, const uint8_t *tare,
+                         uint32_t count, const FindWeights &weights,
+                         int32_t *w) {
+    const __m128i rg = _mm_set1_epi32(
+        (uint16_t) weights.r | ((uint32_t) (uint16_t) weights.g << 16));
+    const __m128i b0 = _mm_set1_epi32((uint16_t) weights.b);
+    const __m128i threshold = _mm_set1_epi32(weights.threshold);
+
+    for (; count >= 8; count -= 8, curr += 32, tare += 32, w += 8) {
+        const __m128i *c = (const __m128i *) curr;
+        const __m128i *t = (const __m128i *) tare;
+        __m128i weight[2];
+        weighSSE2(_mm_loadu_si128(c + 0), _mm_loadu_si128(c + 1),
+                  _mm_loadu_si128(t + 0), _mm_loadu_si128(t + 1),
+                  rg, b0, weight);
+        for (int k = 0; k < 2; ++k) {
+            __m128i mask = _mm_cmpgt_epi32(weight[k], threshold);
+            _mm_storeu_si128((__m128i *) (w + 4 * k),
+                             _mm_and_si128(weight[k], mask));
+        }
+    }
+
+    weighRowScalar(curr, tare, count, weights, w);
+}
+
+static void sampleBlockSSE2(const uint8_t *p, size_t stride,
+                            uint8_t rgb[3]) {
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i four = _mm_set1_epi16(4);
+    __m128i sum = _mm_add_epi16(
+        _mm_add_epi16(sampleRowSSE2(p, one),
+                      sampleRowSSE2(p + stride, four)),
+        sampleRowSSE2(p + 2 * stride, one));
+
+    uint16_t lanes[8];
+    _mm_storeu_si128((__m128i *) lanes, sum);
+    rgb[0] = lanes[0] / 12;
+    rgb[1] = lanes[1] / 12;
+    rgb[2] = lanes[2] / 12;
+}
+
+static void sampleSSE2(const FrameView &frame, int32_t x, int32_t y,
+                       uint8_t rgb[3]) {
+    if (sampleInterior(frame, x, y)) {
+        sampleBlockSSE2(frame.pixel(x - 1, y - 1), frame.stride, rgb);
+    } else {
+        sampleScalar(frame, x, y, rgb);
+    }
+}
+
+// Adds one pixel, in the low four bytes of px16 widened to 16 bits, to
+// the running sums and stores them plus the entry above.
+static inline __m128i integralPixelSSE2(__m128i run, __m128i px16,
+                                        const uint32_t *above, uint32_t *out) {
+    run = _mm_add_epi32(run, _mm_unpacklo_epi16(px16, _mm_setzero_si128()));
+    __m128i sum = _mm_add_epi32(run, _mm_loadu_si128((const __m128i *) above));
+    _mm_storeu_si128((__m128i *) out, sum);
+    return run;
+}
+
+static void integralRowSSE2(const uint8_t *row, uint32_t count,
+                            const uint32_t *above, uint32_t *out) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i run = zero;
+
+    for (; count >= 4; count -= 4, row += 16, above += 16, out += 16) {
+        __m128i px = _mm_loadu_si128((const __m128i *) row);
+        __m128i lo = _mm_unpacklo_epi8(px, zero);
+        __m128i hi = _mm_unpackhi_epi8(px, zero);
+        run = integralPixelSSE2(run, lo, above, out);
+        run = integralPixelSSE2(run, _mm_srli_si128(lo, 8), above + 4, out + 4);
+        run = integralPixelSSE2(run, hi, above + 8, out + 8);
+        run = integralPixelSSE2(run, _mm_srli_si128(hi, 8), above + 12,
+                                out + 12);
+    }
+
+    for (; count > 0; --count, row += 4, above += 4, out += 4) {
+        int32_t pixel;
+        memcpy(&pixel, row, 4);
+        __m128i px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero);
+        run = integralPixelSSE2(run, px, above, out);
+    }
+}
+
+// Adds adjacent pairs of 32-bit lanes: a's two pairs, then b's.
+static inline __m128i pairSumsSSE2(__m128i a, __m128i b) {
+    __m128 x = _mm_castsi128_ps(a), y = _mm_castsi128_ps(b);
+    return _mm_add_epi32(
+        _mm_castps_si128(_mm_shuffle_ps(x, y, _MM_SHUFFLE(2, 0, 2, 0))),
+        _mm_castps_si128(_mm_shuffle_ps(x, y, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+// modelStep() on every lane of two pixels' models.
+static inline __m128i modelStepSSE2(__m128i lanes, __m128i target,
+                                    __m128i rate) {
+    return _mm_add_epi16(_mm_sub_epi16(lanes, _mm_srl_epi16(lanes, rate)),
+                         _mm_srl_epi16(target, rate));
+}
+
+// Four pixels at a time, each pixel's channels and model in four 16-bit
+// lanes. Weighted deviations and squared ones are summed with madd.
+static void modelRowSSE2(const uint8_t *curr, uint16_t *model,
+                         uint32_t count, const ModelParams &params,
+                         int32_t *w) {
+    const FindWeights &weights = params.weights;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rgb = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    const __m128i half = _mm_set1_epi16(128);
+    const __m128i channelWeights = _mm_set_epi16(
+        0, weights.b, weights.g, weights.r, 0, weights.b, weights.g, weights.r);
+    const __m128i threshold = _mm_set1_epi32(weights.threshold);
+    const __m128i maxVariance = _mm_set1_epi32(MODEL_MAX_VARIANCE);
+    const __m128 spread = _mm_set1_ps(params.spread);
+    const __m128 minVariance = _mm_set1_ps(params.minVariance);
+    const __m128i rate = _mm_cvtsi32_si128(params.rate);
+    const __m128i slowRate = _mm_cvtsi32_si128(params.slowRate);
+
+    for (; count >= 4; count -= 4, curr += 16, model += 16, w += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i *) curr);
+        __m128i c0 = _mm_unpacklo_epi8(px, zero);
+        __m128i c1 = _mm_unpackhi_epi8(px, zero);
+        __m128i m0 = _mm_loadu_si128((const __m128i *) model);
+        __m128i m1 = _mm_loadu_si128((const __m128i *) (model + 8));
+
+        // Deviations from the rounded means, 0 in the variance lanes.
+        __m128i d0 = _mm_and_si128(
+            _mm_sub_epi16(c0, _mm_srli_epi16(_mm_add_epi16(m0, half), 8)),
+            rgb);
+        __m128i d1 = _mm_and_si128(
+            _mm_sub_epi16(c1, _mm_srli_epi16(_mm_add_epi16(m1, half), 8)),
+            rgb);
+
+        __m128i d = pairSumsSSE2(_mm_madd_epi16(d0, channelWeights),
+                                 _mm_madd_epi16(d1, channelWeights));
+        __m128i squares = pairSumsSSE2(_mm_madd_epi16(d0, d0),
+                                       _mm_madd_epi16(d1, d1));
+        __m128i variance = _mm_castps_si128(_mm_shuffle_ps(
+            _mm_castsi128_ps(_mm_srli_epi64(m0, 48)),
+            _mm_castsi128_ps(_mm_srli_epi64(m1, 48)),
+            _MM_SHUFFLE(2, 0, 2, 0)));
+
+        __m128 deviation = _mm_cvtepi32_ps(d);
+        __m128 spreadVariance = _mm_mul_ps(
+            spread, _mm_max_ps(_mm_cvtepi32_ps(variance), minVariance));
+        __m128i passed = _mm_and_si128(
+            _mm_cmpgt_epi32(d, threshold),
+            _mm_castps_si128(_mm_cmpgt_ps(_mm_mul_ps(deviation, deviation),
+                                          spreadVariance)));
+        _mm_storeu_si128((__m128i *) w, _mm_and_si128(d, passed));
+
+        // Targets: the pixel's channels in 8.8, and its squared deviation
+        // in the variance lane.
+        squares = _mm_slli_epi32(squares, 4);
+        __m128i over = _mm_cmpgt_epi32(squares, maxVariance);
+        squares = _mm_or_si128(_mm_andnot_si128(over, squares),
+                               _mm_and_si128(over, maxVariance));
+        __m128i t0 = _mm_or_si128(
+            _mm_slli_epi16(_mm_and_si128(c0, rgb), 8),
+            _mm_slli_epi64(_mm_unpacklo_epi32(zero, squares), 16));
+        __m128i t1 = _mm_or_si128(
+            _mm_slli_epi16(_mm_and_si128(c1, rgb), 8),
+            _mm_slli_epi64(_mm_unpackhi_epi32(zero, squares), 16));
+
+        __m128i slow0 = _mm_unpacklo_epi32(passed, passed);
+        __m128i slow1 = _mm_unpackhi_epi32(passed, passed);
+        m0 = _mm_or_si128(
+            _mm_andnot_si128(slow0, modelStepSSE2(m0, t0, rate)),
+            _mm_and_si128(slow0, modelStepSSE2(m0, t0, slowRate)));
+        m1 = _mm_or_si128(
+            _mm_andnot_si128(slow1, modelStepSSE2(m1, t1, rate)),
+            _mm_and_si128(slow1, modelStepSSE2(m1, t1, slowRate)));
+        _mm_storeu_si128((__m128i *) model, m0);
+        _mm_storeu_si128((__m128i *) (model + 8), m1);
+    }
+
+    modelRowScalar(curr, model, count, params, w);
+}
+
+static const Kernels kSSE2 = {
+    "sse2", findRowSSE2, weighRowSSE2, modelRowSSE2, sampleSSE2,
+    sampleBlockSSE2, integralRowSSE2, histogramRowScalar
+};
+
+// GCC doesn't clear the upper halves of the ymm registers on leaving
+// target("avx2") code, and the SSE code built without VEX that runs next
+// stalls on every instruction until they are. So the AVX2 kernels end
+// their 256-bit work with vzeroupper before returning or calling out.
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET
+static inline void weighAVX2(__m256i c0, __m256i c1, __m256i t0, __m256i t1,
+                             __m256i rg, __m256i b0, __m256i out[2]) {
+    const __m256i low = _mm256_set1_epi32(0xff);
+
+    // packs and unpack work within 128-bit halves, so after both the
+    // pixels come out of madd in their original order: c0 then c1.
+    __m256i dr = _mm256_packs_epi32(
+        _mm256_sub_epi32(_mm256_and_si256(c0, low),
+                         _mm256_and_si256(t0, low)),
+        _mm256_sub_epi32(_mm256_and_si256(c1, low),
+                         _mm256_and_si256(t1, low)));
+    __m256i dg = _mm256_packs_epi32(
+        _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(c0, 8), low),
+                         _mm256_and_si256(_mm256_srli_epi32(t0, 8), low)),
+        _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(c1, 8), low),
+                         _mm256_and_si256(_mm256_srli_epi32(t1, 8), low)));
+    __m256i db = _mm256_packs_epi32(
+        _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(c0, 16), low),
+                         _mm256_and_si256(_mm256_srli_epi32(t0, 16), low)),
+        _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(c1, 16), low),
+                         _mm256_and_si256(_mm256_srli_epi32(t1, 16), low)));
+    __m256i zero = _mm256_setzero_si256();
+
+    out[0] = _mm256_add_epi32(
+        _mm256_madd_epi16(_mm256_unpacklo_epi16(dr, dg), rg),
+        _mm256_madd_epi16(_mm256_unpacklo_epi16(db, zero), b0));
+    out[1] = _mm256_add_epi32(
+        _mm256_madd_epi16(_mm256_unpackhi_epi16(dr, dg), rg),
+        _mm256_madd_epi16(_mm256_unpackhi_epi16(db, zero), b0));
+}
+
+// Weighs blocks of BLOCK pixels into acc and prior as findRowSSE2() does,
+// with the number that passed in each lane of passed. It is kept apart
+// from findRowAVX2() so that flushBlocks() runs after vzeroupper.
+AVX2_TARGET
+static void findBlocksAVX2(const uint8_t *curr, const uint8_t *tare,
+                           uint32_t blocks, const FindWeights &weights,
+                           int32_t acc[BLOCK], int32_t prior[BLOCK],
+                           int32_t passed[8]) {
+    const __m256i rg = _mm256_set1_epi32(
+        (uint16_t) weights.r | ((uint32_t) (uint16_t) weights.g << 16));
+    const __m256i b0 = _mm256_set1_epi32((uint16_t) weights.b);
+    const __m256i threshold = _mm256_set1_epi32(weights.threshold);
+
+    __m256i accSum[2], priorSum[2];
+    __m256i passedSum = _mm256_setzero_si256();
+    accSum[0] = accSum[1] = priorSum[0] = priorSum[1] =
+        _mm256_setzero_si256();
+
+    for (uint32_t n = 0; n < blocks; ++n) {
+        const __m256i *c = (const __m256i *) (curr + n * BLOCK * 4);
+        const __m256i *t = (const __m256i *) (tare + n * BLOCK * 4);
+        __m256i w[2];
+        weighAVX2(_mm256_loadu_si256(c + 0), _mm256_loadu_si256(c + 1),
+                  _mm256_loadu_si256(t + 0), _mm256_loadu_si256(t + 1),
+                  rg, b0, w);
+
+        for (int k = 0; k < 2; ++k) {
+            __m256i mask = _mm256_cmpgt_epi32(w[k], threshold);
+            priorSum[k] = _mm256_add_epi32(priorSum[k], accSum[k]);
+            accSum[k] = _mm256_add_epi32(accSum[k],
+                                         _mm256_and_si256(w[k], mask));
+            passedSum = _mm256_sub_epi32(passedSum, mask);
+        }
+    }
+
+    for (int k = 0; k < 2; ++k) {
+        _mm256_storeu_si256((__m256i *) (acc + 8 * k), accSum[k]);
+        _mm256_storeu_si256((__m256i *) (prior + 8 * k), priorSum[k]);
+    }
+    _mm256_storeu_si256((__m256i *) passed, passedSum);
+    _mm256_zeroupper();
+}
+
+static void findRowAVX2(const uint8_t *curr, const uint8_t *tare,
+                        uint32_t count, uint32_t x, uint32_t y,
+                        const FindWeights &weights, FindSums &sums) {
+    while (count >= BLOCK) {
+        uint32_t blocks = count / BLOCK;
+        if (blocks > BLOCKS_PER_FLUSH) {
+            blocks = BLOCKS_PER_FLUSH;
+        }
+
+        int32_t acc[BLOCK], prior[BLOCK], passed[8];
+        findBlocksAVX2(curr, tare, blocks, weights, acc, prior, passed);
+
+        uint32_t passedCount = 0;
+        for (int k = 0; k < 8; ++k) {
+            passedCount += passed[k];
+        }
+        flushBlocks(acc, prior, passedCount, blocks, x, y, sums);
+
+        curr += blocks * BLOCK * 4;
+        tare += blocks * BLOCK * 4;
+        x += blocks * BLOCK;
+        count -= blocks * BLOCK;
+    }
+
+    findRowScalar(curr, tare, count, x, y, weights, sums);
+}
+
+// As weighRowSSE2(), 16 pixels at a time.
+AVX2_TARGET
+static void weighRowAVX2(const uint8_t *curr, const uint8_t *tare,
+                         uint32_t count, const FindWeights &weights,
+                         int32_t *w) {
+    const __m256i rg = _mm256_set1_epi32(
+        (uint16_t) weights.r | ((uint32_t) (uint16_t) weights.g << 16));
+    const __m256i b0 = _mm256_set1_epi32((uint16_t) weights.b);
+    const __m256i threshold = _mm256_set1_epi32(weights.threshold);
+
+    for (; count >= 16; count -= 16, curr += 64, tare += 64, w += 16) {
+        const __m256i *c = (const __m256i *) curr;
+        const __m256i *t = (const __m256i *) tare;
+        __m256i weight[2];
+        weighAVX2(_mm256_loadu_si256(c + 0), _mm256_loadu_si256(c + 1),
+                  _mm256_loadu_si256(t + 0), _mm256_loadu_si256(t + 1),
+                  rg, b0, weight);
+        for (int k = 0; k < 2; ++k) {
+            __m256i mask = _mm256_cmpgt_epi32(weight[k], threshold);
+            _mm256_storeu_si256((__m256i *) (w + 8 * k),
+                                _mm256_and_si256(weight[k], mask));
+        }
+    }
+
+    _mm256_zeroupper();
+    weighRowScalar(curr, tare, count, weights, w);
+}
+
+// A single neighbourhood is too small to gain from 256-bit vectors.
+static const Kernels kAVX2 = {
+    "avx2", findRowAVX2, weighRowAVX2, modelRowSSE2, sampleSSE2,
+    sampleBlockSSE2, integralRowSSE2, histogramRowScalar
+};
+
+#endif // OFFGRID_X86
+
+#ifdef OFFGRID_ARM
+
+// Weighted differences of 8 pixels from de-interleaved channel halves.
+NEON_TARGET
+static inline int32x4x2_t weighNEON(uint8x8_t cr, uint8x8_t cg, uint8x8_t cb,
+                                    uint8x8_t tr, uint8x8_t tg, uint8x8_t tb,
+                                    const FindWeights &weights) {
+    int16x8_t dr = vreinterpretq_s16_u16(vsubl_u8(cr, tr));
+    int16x8_t dg = vreinterpretq_s16_u16(vsubl_u8(cg, tg));
+    int16x8_t db = vreinterpretq_s16_u16(vsubl_u8(cb, tb));
+
+    int32x4x2_t w;
+    w.val[0] = vmull_n_s16(vget_low_s16(dr), weights.r);
+    w.val[0] = vmlal_n_s16(w.val[0], vget_low_s16(dg), weights.g);
+    w.val[0] = vmlal_n_s16(w.val[0], vget_low_s16(db), weights.b);
+    w.val[1] = vmull_n_s16(vget_high_s16(dr), weights.r);
+    w.val[1] = vmlal_n_s16(w.val[1], vget_high_s16(dg), weights.g);
+    w.val[1] = vmlal_n_s16(w.val[1], vget_high_s16(db), weights.b);
+    return w;
+}
+
+NEON_TARGET
+static void findRowNEON(const uint8_t *curr, const uint8_t *tare,
+                        uint32_t count, uint32_t x, uint32_t y,
+                        const FindWeights &weights, FindSums &sums) {
+    const int32x4_t threshold = vdupq_n_s32(weights.threshold);
+
+    while (count >= BLOCK) {
+        uint32_t blocks = count / BLOCK;
+        if (blocks > BLOCKS_PER_FLUSH) {
+            blocks = BLOCKS_PER_FLUSH;
+        }
+
+        int32x4_t acc[4], prior[4];
+        uint32x4_t passed = vdupq_n_u32(0);
+        for (int k = 0; k < 4; ++k) {
+            acc[k] = prior[k] = vdupq_n_s32(0);
+        }
+
+        for (uint32_t n = 0; n < blocks; ++n) {
+            uint8x16x4_t c = vld4q_u8(curr + n * BLOCK * 4);
+            uint8x16x4_t t = vld4q_u8(tare + n * BLOCK * 4);
+            int32x4x2_t lo = weighNEON(
+                vget_low_u8(c.val[0]), vget_low_u8(c.val[1]),
+                vget_low_u8(c.val[2]), vget_low_u8(t.val[0]),
+                vget_low_u8(t.val[1]), vget_low_u8(t.val[2]), weights);
+            int32x4x2_t hi = weighNEON(
+                vget_high_u8(c.val[0]), vget_high_u8(c.val[1]),
+                vget_high_u8(c.val[2]), vget_high_u8(t.val[0]),
+                vget_high_u8(t.val[1]), vget_high_u8(t.val[2]), weights);
+            int32x4_t w[4] = { lo.val[0], lo.val[1], hi.val[0], hi.val[1] };
+
+            for (int k = 0; k < 4; ++k) {
+                uint32x4_t mask = vcgtq_s32(w[k], threshold);
+                prior[k] = vaddq_s32(prior[k], acc[k]);
+                acc[k] = vaddq_s32(acc[k], vandq_s32(
+                    w[k], vreinterpretq_s32_u32(mask)));
+                passed = vsubq_u32(passed, mask);
+            }
+        }
+
+        int32_t accLanes[BLOCK], priorLanes[BLOCK];
+        uint32_t passedLanes[4];
+        for (int k = 0; k < 4; ++k) {
+            vst1q_s32(accLanes + 4 * k, acc[k]);
+            vst1q_s32(priorLanes + 4 * k, prior[k]);
+        }
+        vst1q_u32(passedLanes, passed);
+
+        flushBlocks(accLanes, priorLanes,
+                    passedLanes[0] + passedLanes[1] +
+                    passedLanes[2] + passedLanes[3],
+                    blocks, x, y, sums);
+
+        curr += blocks * BLOCK * 4;
+        tare += blocks * BLOCK * 4;
+        x += blocks * BLOCK;
+        count -= blocks * BLOCK;
+    }
+
+    findRowScalar(curr, tare, count, x, y, weights, sums);
+}
+
+// Sums the three pixels starting at p, the middle one weighted by centre.
+NEON_TARGET
+static inline uint16x4_t sampleRowNEON(const uint8_t *p, uint16_t centre) {
+    uint16x8_t px = vmovl_u8(vld1_u8(p));      // pixels 0, 1
+    uint16x4_t p2 = vget_low_u16(vmovl_u8(vld1_u8(p + 8)));
+    uint16x4_t sum = vadd_u16(vget_low_u16(px), p2);
+    return vmla_n_u16(sum, vget_high_u16(px), centre);
+}
+
+NEON_TARGET
+static void weighRowNEON(const uint8_t *curr, const uint8_t *tare,
+                         uint32_t count, const FindWeights &weights,
+                         int32_t *w) {
+    const int32x4_t threshold = vdupq_n_s32(weights.threshold);
+
+    for (; count >= 8; count -= 8, curr += 32, tare += 32, w += 8) {
+        uint8x8x4_t c = vld4_u8(curr);
+        uint8x8x4_t t = vld4_u8(tare);
+        int32x4x2_t weight = weighNEON(c.val[0], c.val[1], c.val[2],
+                                       t.val[0], t.val[1], t.val[2],
+                                       weights);
+        for (int k = 0; k < 2; ++k) {
+            uint32x4_t mask = vcgtq_s32(weight.val[k], threshold);
+            vst1q_s32(w + 4 * k, vandq_s32(weight.val[k],
+                                           vreinterpretq_s32_u32(mask)));
+        }
+    }
+
+    weighRowScalar(curr, tare, count, weights, w);
+}
+
+NEON_TARGET
+static void sampleBlockNEON(const uint8_t *p, size_t stride,
+                            uint8_t rgb[3]) {
+    uint16x4_t sum = vadd_u16(
+        vadd_u16(sampleRowNEON(p, 1), sampleRowNEON(p + stride, 4)),
+        sampleRowNEON(p + 2 * stride, 1));
+
+    uint16_t lanes[4];
+    vst1_u16(lanes, sum);
+    rgb[0] = lanes[0] / 12;
+    rgb[1] = lanes[1] / 12;
+    rgb[2] = lanes[2] / 12;
+}
+
+NEON_TARGET
+static void sampleNEON(const FrameView &frame, int32_t x, int32_t y,
+                       uint8_t rgb[3]) {
+    if (sampleInterior(frame, x, y)) {
+        sampleBlockNEON(frame.pixel(x - 1, y - 1), frame.stride, rgb);
+    } else {
+        sampleScalar(frame, x, y, rgb);
+    }
+}
+
+NEON_TARGET
+static void integralRowNEON(const uint8_t *row, uint32_t count,
+                            const uint32_t *above, uint32_t *out) {
+    uint32x4_t run = vdupq_n_u32(0);
+
+    for (; count >= 4; count -= 4, row += 16, above += 16, out += 16) {
+        uint8x16_t px = vld1q_u8(row);
+        uint16x8_t lo = vmovl_u8(vget_low_u8(px));
+        uint16x8_t hi = vmovl_u8(vget_high_u8(px));
+        uint16x4_t pixels[4] = {
+            vget_low_u16(lo), vget_high_u16(lo),
+            vget_low_u16(hi), vget_high_u16(hi)
+        };
+        for (int k = 0; k < 4; ++k) {
+            run = vaddq_u32(run, vmovl_u16(pixels[k]));
+            vst1q_u32(out + k * 4, vaddq_u32(run, vld1q_u32(above + k * 4)));
+        }
+    }
+
+    for (; count > 0; --count, row += 4, above += 4, out += 4) {
+        uint32_t pixel[4] = { row[0], row[1], row[2], row[3] };
+        run = vaddq_u32(run, vld1q_u32(pixel));
+        vst1q_u32(out, vaddq_u32(run, vld1q_u32(above)));
+    }
+}
+
+// The sums of each pixel's four 32-bit products.
+NEON_TARGET
+static inline int32x2_t pixelSumsNEON(int32x4_t a, int32x4_t b) {
+    return vpadd_s32(vpadd_s32(vget_low_s32(a), vget_high_s32(a)),
+                     vpadd_s32(vget_low_s32(b), vget_high_s32(b)));
+}
+
+// modelStep() on every lane of two pixels' models.
+NEON_TARGET
+static inline uint16x8_t modelStepNEON(uint16x8_t lanes, uint16x8_t target,
+                                       int16x8_t rate) {
+    return vaddq_u16(vsubq_u16(lanes, vshlq_u16(lanes, rate)),
+                     vshlq_u16(target, rate));
+}
+
+// Four pixels at a time, as modelRowSSE2() does them.
+NEON_TARGET
+static void modelRowNEON(const uint8_t *curr, uint16_t *model,
+                         uint32_t count, const ModelParams &params,
+                         int32_t *w) {
+    const FindWeights &weights = params.weights;
+    const int16_t channelLanes[4] = { weights.r, weights.g, weights.b, 0 };
+    const uint16_t rgbLanes[8] = {
+        0xffff, 0xffff, 0xffff, 0, 0xffff, 0xffff, 0xffff, 0
+    };
+    const int16x4_t channelWeights = vld1_s16(channelLanes);
+    const uint16x8_t rgb = vld1q_u16(rgbLanes);
+    const int32x4_t threshold = vdupq_n_s32(weights.threshold);
+    const uint32x4_t maxVariance = vdupq_n_u32(MODEL_MAX_VARIANCE);
+    const float32x4_t spread = vdupq_n_f32(params.spread);
+    const float32x4_t minVariance = vdupq_n_f32(params.minVariance);
+    // Negative counts shift right.
+    const int16x8_t rate = vdupq_n_s16(-(int16_t) params.rate);
+    const int16x8_t slowRate = vdupq_n_s16(-(int16_t) params.slowRate);
+
+    for (; count >= 4; count -= 4, curr += 16, model += 16, w += 4) {
+        uint8x16_t px = vld1q_u8(curr);
+        uint16x8_t c0 = vmovl_u8(vget_low_u8(px));
+        uint16x8_t c1 = vmovl_u8(vget_high_u8(px));
+        uint16x8_t m0 = vld1q_u16(model);
+        uint16x8_t m1 = vld1q_u16(model + 8);
+
+        // Deviations from the rounded means, 0 in the variance lanes.
+        int16x8_t d0 = vreinterpretq_s16_u16(vandq_u16(
+            vsubq_u16(c0, vrshrq_n_u16(m0, 8)), rgb));
+        int16x8_t d1 = vreinterpretq_s16_u16(vandq_u16(
+            vsubq_u16(c1, vrshrq_n_u16(m1, 8)), rgb));
+
+        int32x4_t d = vcombine_s32(
+            pixelSumsNEON(vmull_s16(vget_low_s16(d0), channelWeights),
+                          vmull_s16(vget_high_s16(d0), channelWeights)),
+            pixelSumsNEON(vmull_s16(vget_low_s16(d1), channelWeights),
+                          vmull_s16(vget_high_s16(d1), channelWeights)));
+        int32x4_t squares = vcombine_s32(
+            pixelSumsNEON(vmull_s16(vget_low_s16(d0), vget_low_s16(d0)),
+                          vmull_s16(vget_high_s16(d0), vget_high_s16(d0))),
+            pixelSumsNEON(vmull_s16(vget_low_s16(d1), vget_low_s16(d1)),
+                          vmull_s16(vget_high_s16(d1), vget_high_s16(d1))));
+        uint32x4_t variance = vcombine_u32(
+            vmovn_u64(vshrq_n_u64(vreinterpretq_u64_u16(m0), 48)),
+            vmovn_u64(vshrq_n_u64(vreinterpretq_u64_u16(m1), 48)));
+
+        float32x4_t deviation = vcvtq_f32_s32(d);
+        float32x4_t spreadVariance = vmulq_f32(
+            spread, vmaxq_f32(vcvtq_f32_u32(variance), minVariance));
+        uint32x4_t passed = vandq_u32(
+            vcgtq_s32(d, threshold),
+            vcgtq_f32(vmulq_f32(deviation, deviation), spreadVariance));
+        vst1q_s32(w, vandq_s32(d, vreinterpretq_s32_u32(passed)));
+
+        // Targets: the pixel's channels in 8.8, and its squared deviation
+        // in the variance lane.
+        uint32x4_t clamped = vminq_u32(
+            vshlq_n_u32(vreinterpretq_u32_s32(squares), 4), maxVariance);
+        uint16x8_t t0 = vorrq_u16(
+            vshlq_n_u16(vandq_u16(c0, rgb), 8),
+            vreinterpretq_u16_u64(
+                vshlq_n_u64(vmovl_u32(vget_low_u32(clamped)), 48)));
+        uint16x8_t t1 = vorrq_u16(
+            vshlq_n_u16(vandq_u16(c1, rgb), 8),
+            vreinterpretq_u16_u64(
+                vshlq_n_u64(vmovl_u32(vget_high_u32(clamped)), 48)));
+
+        uint32x4x2_t slow = vzipq_u32(passed, passed);
+        m0 = vbslq_u16(vreinterpretq_u16_u32(slow.val[0]),
+                       modelStepNEON(m0, t0, slowRate),
+                       modelStepNEON(m0, t0, rate));
+        m1 = vbslq_u16(vreinterpretq_u16_u32(slow.val[1]),
+                       modelStepNEON(m1, t1, slowRate),
+                       modelStepNEON(m1, t1, rate));
+        vst1q_u16(model, m0);
+        vst1q_u16(model + 8, m1);
+    }
+
+    modelRowScalar(curr, model, count, params, w);
+}
+
+// Works out eight pixels' lumas at once, then counts them and the channels
+// one by one, as counting doesn't vectorise.
+NEON_TARGET
+static void histogramRowNEON(const uint8_t *row, uint32_t count,
+                             FrameHistogram &histogram) {
+    for (; count >= 8; count -= 8, row += 32) {
+        uint8x8x4_t px = vld4_u8(row);
+        uint16x8_t sum = vmull_u8(px.val[0], vdup_n_u8(77));
+        sum = vmlal_u8(sum, px.val[1], vdup_n_u8(150));
+        sum = vmlal_u8(sum, px.val[2], vdup_n_u8(29));
+
+        uint8_t lumas[8];
+        vst1_u8(lumas, vrshrn_n_u16(sum, 8));
+        for (int k = 0; k < 8; ++k) {
+            ++histogram.r[row[4 * k]];
+            ++histogram.g[row[4 * k + 1]];
+            ++histogram.b[row[4 * k + 2]];
+            ++histogram.luma[lumas[k]];
+        }
+    }
+
+    histogramRowScalar(row, count, histogram);
+}
+
+static const Kernels kNEON = {
+    "neon", findRowNEON, weighRowNEON, modelRowNEON, sampleNEON,
+    sampleBlockNEON, integralRowNEON, histogramRowNEON
+};
+
+#endif // OFFGRID_ARM
+
+static bool supported(const Kernels &k) {
+#ifdef OFFGRID_X86
+    if (&k == &kAVX2) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (&k == &kSSE2) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+#ifdef OFFGRID_ARM
+    if (&k == &kNEON) {
+#if defined(__arm__) && !defined(__aarch64__)
+        return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+        return true;
+#endif
+    }
+#endif
+    return &k == &kScalar;
+}
+
+// Widest first.
+static const Kernels *const kAll[] = {
+#ifdef OFFGRID_X86
+    &kAVX2,
+    &kSSE2,
+#endif
+#ifdef OFFGRID_ARM
+    &kNEON,
+#endif
+    &kScalar,
+};
+
+const Kernels *kernelsFor(const char *isa) {
+    for (size_t i = 0; i < sizeof(kAll) / sizeof(kAll[0]); ++i) {
+        if (strcmp(kAll[i]->isa, isa) == 0) {
+            return supported(*kAll[i]) ? kAll[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+static const Kernels *selectKernels() {
+    const char *forced = getenv("OFFGRID_ISA");
+    if (forced) {
+        const Kernels *k = kernelsFor(forced);
+        if (k) {
+            return k;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(kAll) / sizeof(kAll[0]); ++i) {
+        if (supported(*kAll[i])) {
+            return kAll[i];
+        }
+    }
+    return &kScalar;
+}
+
+const Kernels &kernels() {
+    static const Kernels *selected = selectKernels();
+    return *selected;
+}
@@ -0,0 +1,214 @@
+#ifndef OFFGRID_KERNELS_H
+#define OFFGRID_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "workers.h"
+
+// Fixed-point form of find()'s weights and threshold. The weights are
+// scaled by a power of two chosen so that a pixel's weighted difference
+// always fits in 22 bits, which keeps the SIMD accumulators in 32 bits.
+struct FindWeights {
+    int16_t r, g, b;
+    int32_t threshold;
+    double scale;       // what the weights were multiplied by
+};
+
+// Sums over the pixels whose weighted difference w passes the threshold,
+// in the units of FindWeights. Only ratios of w, wx and wy are meaningful.
+struct FindSums {
+    int64_t w;
+    int64_t wx;
+    int64_t wy;
+    uint32_t count;
+};
+
+// Counts of each channel value over a region, and of each luma value,
+// taken as (77 r + 150 g + 29 b + 128) >> 8 after BT.601.
+struct FrameHistogram {
+    uint32_t r[256];
+    uint32_t g[256];
+    uint32_t b[256];
+    uint32_t luma[256];
+};
+
+FindWeights findWeights(double rWeight, double gWeight, double bWeight,
+                        double threshold);
+
+// How find() weighs pixels against a background model (see background.h)
+// and how quickly the model follows the scene. A pixel passes if its
+// weighted deviation d from the model's mean exceeds weights.threshold and
+// d^2 exceeds spread times its variance, i.e. if it is both far enough
+// and enough standard deviations from what the pixel usually looks like.
+struct ModelParams {
+    FindWeights weights;
+    float spread;
+    float minVariance;      // a floor on each pixel's variance
+    uint8_t rate;           // pixels that don't pass move 1 / 2^rate of
+    uint8_t slowRate;       // the way to the frame, and ones that do
+                            // 1 / 2^slowRate, both at most 8
+};
+
+// Adds count pixels of one row to sums. curr and tare point at the first
+// pixel, 4 bytes each, and x and y are its frame co-ordinates.
+typedef void (*FindRowKernel)(const uint8_t *curr, const uint8_t *tare,
+                              uint32_t count, uint32_t x, uint32_t y,
+                              const FindWeights &weights, FindSums &sums);
+
+// Writes the weighted difference of each of count pixels to w, or 0 for
+// pixels that do not pass the threshold.
+typedef void (*WeighRowKernel)(const uint8_t *curr, const uint8_t *tare,
+                               uint32_t count, const FindWeights &weights,
+                               int32_t *w);
+
+// Weighs count pixels against their models as WeighRowKernel weighs them
+// against a tare, writing d, or 0 for pixels that do not pass, to w. Then
+// moves each model towards its pixel. curr points at the first pixel, 4
+// bytes each, and model at its model, 4 uint16_t each (see background.h).
+typedef void (*ModelRowKernel)(const uint8_t *curr, uint16_t *model,
+                               uint32_t count, const ModelParams &params,
+                               int32_t *w);
+
+// The 3x3 neighbourhood average of pixel (x, y) with the centre weighted
+// 4, truncated to whole values. Neighbours beyond the frame are clamped
+// to its edge.
+typedef void (*SampleKernel)(const FrameView &frame, int32_t x, int32_t y,
+                             uint8_t rgb[3]);
+
+// The same average for a pixel whose 3x3 neighbourhood, and the pixel to
+// the right of it, lie inside the frame. p points at the top left
+// neighbour.
+typedef void (*SampleBlockKernel)(const uint8_t *p, size_t stride,
+                                  uint8_t rgb[3]);
+
+// Adds count pixels of one row to histogram.
+typedef void (*HistogramRowKernel)(const uint8_t *row, uint32_t count,
+                                   FrameHistogram &histogram);
+
+// Writes one row of an integral image (see IntegralImage): entry i of out
+// gets the sums over pixels 0 to i of row plus entry i of above.
+typedef void (*IntegralRowKernel)(const uint8_t *row, uint32_t count,
+                                  const uint32_t *above, uint32_t *out);
+
+// One implementation of every kernel. All of them give bit-identical
+// results to the "scalar" reference.
+struct Kernels {
+    const char *isa;
+    FindRowKernel findRow;
+    WeighRowKernel weighRow;
+    ModelRowKernel modelRow;
+    SampleKernel sample;
+    SampleBlockKernel sampleBlock;
+    IntegralRowKernel integralRow;
+    HistogramRowKernel histogramRow;
+};
+
+// Shapes of neighbourhood an LED can be sampled over.
+enum SampleShape {
+    SAMPLE_CENTRE,      // the 3x3 average above, with the centre weighted 4
+    SAMPLE_BOX,         // an even average of a (2r + 1)^2 square
+    SAMPLE_GAUSSIAN     // a binomial approximation to a Gaussian, radius r
+};
+
+#define SAMPLE_MAX_RADIUS 4
+
+// The kernel for a shape and radius, which is capped at SAMPLE_MAX_RADIUS,
+// or NULL for SAMPLE_CENTRE, whose kernels come from kernels(). Each one
+// is specialised for its radius. Neighbours beyond the frame are clamped
+// to its edge and the average is truncated, as for SampleKernel.
+SampleKernel sampleKernelFor(SampleShape shape, unsigned radius);
+
+// Marks a SamplePoint too near the frame's edge for sampleBlock.
+#define SAMPLE_EDGE ((size_t) -1)
+
+// One LED position in a sample plan.
+struct SamplePoint {
+    int32_t x;
+    int32_t y;
+    uint32_t index;         // where the caller listed it
+    size_t offset;          // bytes from the frame to its top left neighbour
+    SampleKernel kernel;    // see sampleKernelFor(), or NULL for the default
+    bool bilinear;          // whether the position has a fraction, and so
+    uint16_t weights[4];    // how much of the samples at (x, y), (x + 1, y),
+                            // (x, y + 1) and (x + 1, y + 1) to blend, out
+                            // of 65536
+};
+
+// Places point at 16.16 fixed-point co-ordinates. If they have a fraction
+// the point is sampled by blending the four pixels around it, with the
+// weights worked out here so sampling stays in integers.
+void samplePointAt(SamplePoint &point, uint32_t x, uint32_t y);
+
+// Fills in the offsets of placed points in frames laid out as layout (whose data
+// is ignored), and sorts them into bands of rows and then columns, so
+// sampling them in order reads the frame roughly in address order.
+void planSamples(SamplePoint *points, uint32_t count,
+                 const FrameView &layout);
+
+// Samples planned points from frame, which must be laid out as the plan
+// was, writing each one's r, g, b to rgb + 3 * index, i.e. back in the
+// caller's order.
+void samplePlanned(const Kernels &kernels, const FrameView &frame,
+                   const SamplePoint *points, uint32_t count,
+                   uint8_t *rgb);
+
+// Per-channel sums over every rectangle of a frame that starts at its top
+// left corner. Entry (i, j) holds four lanes, r, g, b and the fourth byte,
+// summed over the i by j pixels above and left of it, so the first row and
+// column are zero. Lanes wrap at 32 bits, which still leaves the sum over
+// any region of fewer than 2^24 pixels exact.
+struct IntegralImage {
+    uint32_t *sums;     // (width + 1) * (height + 1) entries, 4 lanes each
+    int32_t x;          // frame co-ordinates of the pixels covered
+    int32_t y;
+    int32_t width;
+    int32_t height;
+};
+
+// The number of uint32_t an integral image of a region needs.
+static inline size_t integralImageSize(int32_t width, int32_t height) {
+    return (size_t) (width + 1) * (height + 1) * 4;
+}
+
+// Fills in table, whose sums must have room for the frame, from the frame
+// in one pass over its rows.
+void integralImage(IntegralRowKernel integralRow, const FrameView &frame,
+                   IntegralImage &table);
+
+// The r, g, b sums over a region, clipped to the table, from four entries.
+// Returns the number of pixels summed.
+uint32_t integralSums(const IntegralImage &table, int32_t x, int32_t y,
+                      int32_t width, int32_t height, uint32_t rgb[3]);
+
+// Counts every pixel of frame into histogram, which is cleared first.
+// Given workers, frame is split into bands of rows, each counted into a
+// histogram of its own, and the bands' histograms are added up at the
+// end.
+void frameHistogram(HistogramRowKernel histogramRow, const FrameView &frame,
+                    FrameHistogram &histogram, WorkerPool *workers = NULL);
+
+// Adds part's counts to sum's, as the bands' histograms are merged.
+void addHistogram(FrameHistogram &sum, const FrameHistogram &part);
+
+// Runs findRow over every row of curr against the same pixels of ref,
+// which must contain it, in the order frameForEachRow() gives. Given
+// workers, curr is split into bands of rows whose sums are merged, which
+// gives the same result as a single pass. Given a histogram, each row of
+// curr is also added to it with histogramRow while the row is still in
+// cache.
+FindSums findSums(FindRowKernel findRow, const FrameView &curr,
+                  const FrameView &ref, const FindWeights &weights,
+                  WorkerPool *workers = NULL,
+                  FrameHistogram *histogram = NULL,
+                  HistogramRowKernel histogramRow = NULL);
+
+// The widest kernels the CPU supports, chosen on first use. Setting
+// OFFGRID_ISA in the environment (e.g. to "scalar") forces a narrower one.
+const Kernels &kernels();
+
+// The kernels for a named ISA, or NULL if the CPU or build lacks it.
+const Kernels *kernelsFor(const char *isa);
+
+#endif
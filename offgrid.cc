@@ -10,10 +10,12 @@
 #include <math.h>
 #include <iostream>
 #include <string>
+#include <vector>
 #include <algorithm>
 
 #include <node.h>
 #include <v8.h>
+#include <uv.h>
 
 #include "bcm_host.h"
 #include "interface/vcos/vcos.h"
@@ -35,6 +37,13 @@ extern "C" {
 #include "raspicam/tga.h"
 }
 
+#include "background.h"
+#include "blobs.h"
+#include "kernels.h"
+#include "search.h"
+#include "tracker.h"
+#include "workers.h"
+
 #include <semaphore.h>
 
 #define VERSION_STRING "v1.3.8"
@@ -56,6 +65,13 @@ extern "C" {
 /// Video render needs at least 2 buffers.
 #define VIDEO_OUTPUT_BUFFERS_NUM 3
 
+/// find()'s background model by default: pixels pass 16 levels and 4
+/// standard deviations from their means, which follow each frame 1/32 of
+/// the way.
+#define BACKGROUND_FLOOR 16
+#define BACKGROUND_SIGMAS 4
+#define BACKGROUND_RATE 5
+
 using namespace v8;
 
 class OffGrid;
@@ -83,10 +99,20 @@ public:
 
     RASPITEX_STATE raspitex_state; /// GL renderer state and parameters
 
-    OffGrid() : tareBuffer(NULL)
-              , tareSize(0)
+    OffGrid() : latest()
+              , baseline()
+              , pinned(false)
+              , gpuReferenced(false)
               , xyData(NULL)
+              , rgbData(NULL)
               , xyCount(0)
+              , integralData(NULL)
+              , integralSize(0)
+              , adaptive(true)
+              , modelled(true)
+              , modelFloor(BACKGROUND_FLOOR)
+              , modelSigmas(BACKGROUND_SIGMAS)
+              , modelRate(BACKGROUND_RATE)
     {
         bcm_host_init();
 
@@ -155,8 +181,10 @@ public:
             exit(-1);
         }
 
-        width = raspitex_state.width;
-        height = raspitex_state.height;
+        // From here on width and height describe captured frames, which
+        // are smaller than the GL window when --glscale is given.
+        width = raspitex_state.capture_frame.capture_width;
+        height = raspitex_state.capture_frame.capture_height;
         setWindow(0, 0, width, height);
     }
 
@@ -175,16 +203,183 @@ public:
         raspitex_set_defaults(&raspitex_state);
     }
 
+    // Captures the next frame, or only the given region of it.
+    uint8_t *capture(const RASPITEX_RECT *rect, size_t &size,
+                     RASPITEX_CAPTURE_MODE mode = RASPITEX_CAPTURE_BGRA) {
+        return capture(captureParams(rect, mode), size);
+    }
+
+    uint8_t *capture(const RASPITEX_CAPTURE_PARAMS &params, size_t &size) {
+        return raspitex_capture_params_to_buffer(&raspitex_state,
+                                                 &params, &size);
+    }
+
+    // Asks the GL thread for a capture without waiting for it; see
+    // raspitex_request_capture().
+    bool requestCapture(const RASPITEX_CAPTURE_PARAMS &params,
+                        RASPITEX_CAPTURE_CALLBACK callback, void *context) {
+        return raspitex_request_capture(&raspitex_state, &params,
+                                        callback, context) == 0;
+    }
+
+    // A capture of rect, or of the whole frame if it is NULL.
+    RASPITEX_CAPTURE_PARAMS captureParams(const RASPITEX_RECT *rect,
+                                          RASPITEX_CAPTURE_MODE mode =
+                                              RASPITEX_CAPTURE_BGRA) const {
+        RASPITEX_CAPTURE_PARAMS params;
+        memset(&params, 0, sizeof(params));
+        params.mode = mode;
+        if (rect) {
+            params.rects[0] = *rect;
+            params.num_rects = 1;
+        }
+        return params;
+    }
+
+    // A GPU capture of the pixels in rect whose weighted difference from
+    // the previous such capture passes find()'s threshold, as a mask or as
+    // sums. The frame becomes the reference for the next one.
+    RASPITEX_CAPTURE_PARAMS diffParams(RASPITEX_CAPTURE_MODE mode,
+                                       const RASPITEX_RECT &rect,
+                                       double rWeight, double gWeight,
+                                       double bWeight) const {
+        RASPITEX_CAPTURE_PARAMS params;
+        memset(&params, 0, sizeof(params));
+        params.mode = mode;
+        params.rects[0] = rect;
+        params.num_rects = 1;
+        params.flags = RASPITEX_CAPTURE_DIFF | RASPITEX_CAPTURE_SET_REFERENCE;
+        params.weights[0] = rWeight;
+        params.weights[1] = gWeight;
+        params.weights[2] = bWeight;
+        params.threshold = 0.5 * 255 * (rWeight + gWeight + bWeight);
+        return params;
+    }
+
+    // The search window as a capture region.
+    RASPITEX_RECT window() const {
+        RASPITEX_RECT rect = {
+            (int32_t) winX1, (int32_t) winY1,
+            (int32_t) (winX2 - winX1), (int32_t) (winY2 - winY1)
+        };
+        return rect;
+    }
+
+    // Where find() looks next: around the target's predicted position,
+    // if it is following one, within the search window.
+    RASPITEX_RECT findWindow() const {
+        RASPITEX_RECT rect = window();
+        if (!adaptive || !search.tracking()) {
+            return rect;
+        }
+
+        int32_t x, y, w, h;
+        search.region(width, height, x, y, w, h);
+        int32_t x1 = std::max(x, rect.x);
+        int32_t y1 = std::max(y, rect.y);
+        int32_t x2 = std::min(x + w, rect.x + rect.width);
+        int32_t y2 = std::min(y + h, rect.y + rect.height);
+        if (x2 <= x1 || y2 <= y1) {
+            return rect;
+        }
+
+        RASPITEX_RECT predicted = { x1, y1, x2 - x1, y2 - y1 };
+        return predicted;
+    }
+
+    // Turns find()'s predictive window on or off. Either way the target
+    // is forgotten, so the next find() searches the whole window.
+    void adaptiveWindow(bool enabled) {
+        adaptive = enabled;
+        search.reset();
+    }
+
+    // Turns the background model that find(), findBlobs(), track() and
+    // analyze() weigh captures against (while the reference is not
+    // pinned) on or off, and sets how a pixel passes: by deviating from
+    // its mean by more than floor levels (as weighted) and more than
+    // sigmas standard deviations. The model follows each frame 1 / 2^rate
+    // of the way. Turning it on starts it
+    // over from the reference frame, if there is one.
+    void backgroundModel(bool enabled, double floor, double sigmas,
+                         unsigned rate) {
+        modelled = enabled;
+        modelFloor = floor;
+        modelSigmas = sigmas;
+        modelRate = rate;
+
+        if (!modelled) {
+            background.clear();
+        } else if (latest.buffer) {
+            background.reset(frameView(latest.buffer,
+                                       latest.rect.x, latest.rect.y,
+                                       latest.rect.width,
+                                       latest.rect.height));
+        }
+    }
+
+    // The search window widened on the left so that it starts on a packed
+    // luma texel, as RASPITEX_CAPTURE_LUMA requires.
+    RASPITEX_RECT lumaWindow() const {
+        RASPITEX_RECT rect = window();
+        int32_t pad = rect.x & 3;
+        rect.x -= pad;
+        rect.width += pad;
+        return rect;
+    }
+
+    // The search window widened on the left to a multiple of 32 pixels,
+    // as RASPITEX_CAPTURE_MASK requires.
+    RASPITEX_RECT maskWindow() const {
+        RASPITEX_RECT rect = window();
+        int32_t pad = rect.x & 31;
+        rect.x -= pad;
+        rect.width += pad;
+        return rect;
+    }
+
     void tare() {
-        free(tareBuffer);
-        tareBuffer = raspitex_capture_to_buffer(&raspitex_state, &tareSize);
+        size_t size = 0;
+        RASPITEX_RECT rect = window();
+        uint8_t *buffer = capture(&rect, size);
+        tare(buffer, size, rect);
+    }
+
+    // Adopts a captured region as the new reference frame, and as the
+    // baseline while it is pinned, and starts the background model over
+    // from it.
+    void tare(uint8_t *buffer, size_t size, const RASPITEX_RECT &rect) {
+        if (modelled && buffer) {
+            background.reset(frameView(buffer, rect.x, rect.y,
+                                       rect.width, rect.height));
+        }
+        if (pinned) {
+            if (buffer) {
+                raspitex_retain_buffer(&raspitex_state, buffer, 1);
+            }
+            replace(baseline, buffer, size, rect);
+        }
+        replace(latest, buffer, size, rect);
+    }
+
+    // While pinned, find() diffs every capture against the frame that was
+    // the reference when it was pinned (or the next tare()), rather than
+    // against the previous capture.
+    void pinReference(bool pin) {
+        if (pin && !pinned && latest.buffer) {
+            raspitex_retain_buffer(&raspitex_state, latest.buffer, 1);
+            replace(baseline, latest.buffer, latest.size, latest.rect);
+        } else if (!pin) {
+            replace(baseline, NULL, 0, RASPITEX_RECT());
+        }
+        pinned = pin;
     }
 
     void setWindow(uint32_t x1, uint32_t y1,
                    uint32_t x2, uint32_t y2) {
         uint32_t zero = 0;
-        uint32_t w = raspitex_state.width;
-        uint32_t h = raspitex_state.height;
+        uint32_t w = width;
+        uint32_t h = height;
 
         winX1 = std::min(std::max(zero, x1), w);
         winY1 = std::min(std::max(zero, y1), h);
@@ -192,166 +387,978 @@ public:
         winY2 = std::min(std::max(winY1, y2), h);
     }
 
-    bool setData(Isolate *isolate, const Handle<Array>& input) {
+    // Takes the LED positions as [[x, y], ...] or as a Uint32Array,
+    // Float32Array or Float64Array of packed x, y pairs, which are read
+    // with no per-LED V8 calls. Fractional positions are sampled between
+    // pixels. Options may give the shape sample() averages each LED over, as
+    // {shape: "centre" (the default), "box" or "gaussian", radius}, where
+    // radius is a number or has one entry per LED.
+    bool setData(Isolate *isolate, Handle<Value> input,
+                 Handle<Value> options) {
+        uint32_t *xy = NULL;
+        size_t count = 0;
+
+        if (input->IsUint32Array() || input->IsFloat32Array() ||
+            input->IsFloat64Array()) {
+            Handle<TypedArray> packed = Handle<TypedArray>::Cast(input);
+            const uint8_t *contents = static_cast<const uint8_t *>(
+                packed->Buffer()->GetContents().Data()) +
+                packed->ByteOffset();
+            count = packed->Length() / 2;
+            xy = new uint32_t[count * 2];
+
+            if (input->IsUint32Array()) {
+                const uint32_t *in =
+                    reinterpret_cast<const uint32_t *>(contents);
+                for (size_t i = 0; i < count * 2; ++i) {
+                    xy[i] = in[i] << 16;
+                }
+            } else if (input->IsFloat32Array()) {
+                const float *in = reinterpret_cast<const float *>(contents);
+                for (size_t i = 0; i < count * 2; ++i) {
+                    xy[i] = fixedPoint(in[i]);
+                }
+            } else {
+                const double *in = reinterpret_cast<const double *>(contents);
+                for (size_t i = 0; i < count * 2; ++i) {
+                    xy[i] = fixedPoint(in[i]);
+                }
+            }
+        } else if (input->IsArray()) {
+            Handle<Array> pairs = Handle<Array>::Cast(input);
+            count = pairs->Length();
+            xy = new uint32_t[count * 2];
+
+            for (size_t i = 0; i < count; ++i) {
+                Handle<Array> pair = Handle<Array>::Cast(pairs->Get(i));
+                xy[2 * i] = fixedPoint(pair->Get(0)->NumberValue());
+                xy[2 * i + 1] = fixedPoint(pair->Get(1)->NumberValue());
+            }
+        } else {
+            return false;
+        }
+
+        SampleShape shape = SAMPLE_CENTRE;
+        uint8_t *radii = new uint8_t[count];
+        std::fill(radii, radii + count, 1);
+
+        if (options->IsObject()) {
+            Handle<Object> object = Handle<Object>::Cast(options);
+            String::Utf8Value name(object->Get(
+                String::NewFromUtf8(isolate, "shape")));
+            if (*name && strcmp(*name, "box") == 0) {
+                shape = SAMPLE_BOX;
+            } else if (*name && strcmp(*name, "gaussian") == 0) {
+                shape = SAMPLE_GAUSSIAN;
+            }
+
+            Handle<Value> radius = object->Get(
+                String::NewFromUtf8(isolate, "radius"));
+            if (radius->IsObject()) {
+                Handle<Object> each = Handle<Object>::Cast(radius);
+                for (size_t i = 0; i < count; ++i) {
+                    radii[i] = std::min(each->Get(i)->Uint32Value(),
+                                        (uint32_t) SAMPLE_MAX_RADIUS);
+                }
+            } else if (radius->IsNumber()) {
+                std::fill(radii, radii + count,
+                          std::min(radius->Uint32Value(),
+                                   (uint32_t) SAMPLE_MAX_RADIUS));
+            }
+        }
+
+        setPoints(xy, count, shape, radii);
+        delete[] radii;
+        delete[] xy;
+        return true;
+    }
+
+    // A non-negative co-ordinate in 16.16 fixed point, rounded to nearest.
+    static uint32_t fixedPoint(double value) {
+        return value > 0 ? (uint32_t) (value * 65536 + 0.5) : 0;
+    }
+
+    // Centres count packed x, y pairs, in 16.16 fixed point, in the frame
+    // as the LED positions, each to be sampled over the given shape with
+    // its own radius. The whole map moves by whole pixels, so fractions
+    // are kept.
+    void setPoints(const uint32_t *xy, size_t count, SampleShape shape,
+                   const uint8_t *radii) {
         delete[] xyData;
-        xyCount = input->Length();
-        xyData = new Datum[xyCount];
-        Local<Array> output = Array::New(isolate, xyCount);
-        rgbOutput.Reset(isolate, output);
+        delete[] rgbData;
+        xyCount = count;
+        xyData = new SamplePoint[xyCount];
+        rgbData = new uint8_t[xyCount * 3];
+
+        // The [r, g, b] arrays are only made if sample() is asked for them.
+        rgbOutput.Reset();
 
         uint32_t xMax = 0;
         uint32_t yMax = 0;
 
         for (size_t i = 0; i < xyCount; ++i) {
-            Handle<Array> pair = Handle<Array>::Cast(input->Get(i));
-
-            uint32_t x = pair->Get(0)->Uint32Value();
+            uint32_t x = xy[2 * i];
             if (x > xMax) {
                 xMax = x;
             }
 
-            uint32_t y = pair->Get(1)->Uint32Value();
+            uint32_t y = xy[2 * i + 1];
             if (y > yMax) {
                 yMax = y;
             }
 
-            xyData[i].x = x;
-            xyData[i].y = y;
+            xyData[i].index = i;
+            xyData[i].kernel = sampleKernelFor(shape, radii[i]);
         }
 
-        uint32_t xAdjust = (raspitex_state.width - xMax) >> 1;
-        uint32_t yAdjust = (raspitex_state.height - yMax) >> 1;
+        uint32_t xAdjust = ((width << 16) - xMax) >> 17 << 16;
+        uint32_t yAdjust = ((height << 16) - yMax) >> 17 << 16;
+        RASPITEX_POINT *points = new RASPITEX_POINT[xyCount];
 
         for (size_t i = 0; i < xyCount; ++i) {
-            xyData[i].x += xAdjust;
-            xyData[i].y += yAdjust;
+            uint32_t x = xy[2 * i] + xAdjust;
+            uint32_t y = xy[2 * i + 1] + yAdjust;
+            samplePointAt(xyData[i], x, y);
 
-            output->Set(i, Array::New(isolate, 3));
+            // The GPU samples whole pixels.
+            points[i].x = (x + 0x8000) >> 16;
+            points[i].y = (y + 0x8000) >> 16;
         }
 
-        return true;
+        // The GPU keeps its own copy for sampleGPU(), in the order given.
+        raspitex_set_points(&raspitex_state, points, xyCount);
+        delete[] points;
+
+        // sample() visits them sorted by where they are in the frame.
+        planSamples(xyData, xyCount, frameView(NULL, 0, 0, width, height));
     }
 
-    Handle<Array> sample(Isolate *isolate) {
+    Handle<Value> sample(Isolate *isolate, Handle<Value> target) {
         if (xyData == NULL) {
             return Array::New(isolate, 0);
         }
 
-        Handle<Array> output = Handle<Array>::New(isolate, rgbOutput);
-
-        size_t size;
-        uint8_t *buffer = raspitex_capture_to_buffer(&raspitex_state, &size);
+        size_t size = 0;
+        return sample(isolate, capture(NULL, size), target);
+    }
 
-        for (size_t i = 0; i < xyCount; ++i) {
-            uint32_t x = xyData[i].x;
-            uint32_t y = xyData[i].y;
+    // Samples the LED positions from a captured buffer, which is released.
+    // The result goes into target if it is a big enough Uint8Array or
+    // Float32Array, as r, g, b triples in the order of setData().
+    Handle<Value> sample(Isolate *isolate, uint8_t *buffer,
+                         Handle<Value> target) {
+        if (xyData == NULL || buffer == NULL) {
+            raspitex_release_buffer(&raspitex_state, buffer);
+            return Array::New(isolate, 0);
+        }
 
-            uint8_t denominator = 0;
+        sampleFrame(frameView(buffer, 0, 0, width, height));
+        raspitex_release_buffer(&raspitex_state, buffer);
 
-            uint32_t rSum = 0;
-            uint32_t gSum = 0;
-            uint32_t bSum = 0;
+        return sampleOutput(isolate, rgbData, 3, target);
+    }
 
-            for (uint32_t a = x - 1; a <= x + 1; ++a) {
-                for (uint32_t b = y - 1; b <= y + 1; ++b) {
-                    size_t offset = (y * raspitex_state.width + x) << 2;
+    // Samples every LED position of a whole frame into rgbData. The LEDs
+    // are split between the worker threads in plan order, so each thread
+    // reads its own band of the frame.
+    void sampleFrame(const FrameView &frame) {
+        SampleBands bands;
+        bands.kernels = &kernels();
+        bands.frame = frame;
+        bands.points = xyData;
+        bands.rgb = rgbData;
+        bands.count = xyCount;
+        workers.run(sampleBand, &bands, xyCount / MIN_BAND_POINTS);
+    }
 
-                    uint8_t coefficient = 1;
-                    if (a == x && b == y) {
-                        coefficient = 4;
-                    }
+    // Copies each LED's r, g, b, found every stride bytes from rgb, into
+    // target if it is a typed array with room for them all, or else into
+    // the [r, g, b] arrays sample() returns. Only the main thread may
+    // touch either.
+    Handle<Value> sampleOutput(Isolate *isolate, const uint8_t *rgb,
+                               size_t stride, Handle<Value> target) {
+        if (target->IsUint8Array() &&
+            Handle<Uint8Array>::Cast(target)->Length() >= xyCount * 3) {
+            Handle<Uint8Array> bytes = Handle<Uint8Array>::Cast(target);
+            uint8_t *out = static_cast<uint8_t *>(
+                bytes->Buffer()->GetContents().Data()) + bytes->ByteOffset();
+            for (size_t i = 0; i < xyCount; ++i, rgb += stride, out += 3) {
+                out[0] = rgb[0];
+                out[1] = rgb[1];
+                out[2] = rgb[2];
+            }
+            return target;
+        }
 
-                    rSum += coefficient * buffer[offset + 0];
-                    gSum += coefficient * buffer[offset + 1];
-                    bSum += coefficient * buffer[offset + 2];
+        if (target->IsFloat32Array() &&
+            Handle<Float32Array>::Cast(target)->Length() >= xyCount * 3) {
+            Handle<Float32Array> floats = Handle<Float32Array>::Cast(target);
+            float *out = reinterpret_cast<float *>(
+                static_cast<uint8_t *>(
+                    floats->Buffer()->GetContents().Data()) +
+                floats->ByteOffset());
+            for (size_t i = 0; i < xyCount; ++i, rgb += stride, out += 3) {
+                out[0] = rgb[0];
+                out[1] = rgb[1];
+                out[2] = rgb[2];
+            }
+            return target;
+        }
 
-                    denominator += coefficient;
-                }
+        if (rgbOutput.IsEmpty()) {
+            Local<Array> arrays = Array::New(isolate, xyCount);
+            for (size_t i = 0; i < xyCount; ++i) {
+                arrays->Set(i, Array::New(isolate, 3));
             }
+            rgbOutput.Reset(isolate, arrays);
+        }
+
+        Handle<Array> output = Handle<Array>::New(isolate, rgbOutput);
 
-            Local<Array> rgb = Local<Array>::Cast(output->Get(i));
-            rgb->Set(0, Number::New(isolate, rSum / denominator));
-            rgb->Set(1, Number::New(isolate, gSum / denominator));
-            rgb->Set(2, Number::New(isolate, bSum / denominator));
+        for (size_t i = 0; i < xyCount; ++i, rgb += stride) {
+            Local<Array> result = Local<Array>::Cast(output->Get(i));
+            result->Set(0, Number::New(isolate, rgb[0]));
+            result->Set(1, Number::New(isolate, rgb[1]));
+            result->Set(2, Number::New(isolate, rgb[2]));
         }
 
-        free(buffer);
+        return output;
+    }
+
+    Handle<Value> sampleGPU(Isolate *isolate, Handle<Value> target) {
+        if (xyData == NULL) {
+            return Array::New(isolate, 0);
+        }
+
+        size_t size = 0;
+        return sampleGPU(isolate, capture(NULL, size, RASPITEX_CAPTURE_POINTS),
+                         size, target);
+    }
+
+    // Like sample(), but the GPU averages each LED's neighbourhood and
+    // only one texel per LED is read back. The buffer is released.
+    Handle<Value> sampleGPU(Isolate *isolate, uint8_t *buffer, size_t size,
+                            Handle<Value> target) {
+        if (xyData == NULL || buffer == NULL || size < (xyCount << 2)) {
+            raspitex_release_buffer(&raspitex_state, buffer);
+            return Array::New(isolate, 0);
+        }
+
+        Handle<Value> output = sampleOutput(isolate, buffer, 4, target);
+        raspitex_release_buffer(&raspitex_state, buffer);
 
         return output;
     }
 
     bool find(double rWeight, double gWeight, double bWeight,
               double &xResult, double &yResult) {
-        if (!tareBuffer) {
+        if (!reference().buffer) {
             return false;
         }
 
+        // Only the search window, or the part of it the target is
+        // predicted to be in, is read back from the GPU.
         size_t size = 0;
-        uint8_t *currBuffer = raspitex_capture_to_buffer(&raspitex_state, &size);
-        uint32_t count = 0;
-        double xSum = 0;
-        double ySum = 0;
-        double denominator = 0;
+        RASPITEX_RECT rect = findWindow();
+        uint8_t *currBuffer = capture(&rect, size);
+        return find(currBuffer, size, rect, rWeight, gWeight, bWeight,
+                    xResult, yResult);
+    }
+
+    // Weighs a captured region against the background model, or diffs
+    // it against the reference frame while the model is off or the
+    // reference is pinned, then rolls it in as the latest frame. If the
+    // model does not cover the region, or the reference covers none of
+    // it, the region just becomes the reference.
+    bool find(uint8_t *currBuffer, size_t size, const RASPITEX_RECT &rect,
+              double rWeight, double gWeight, double bWeight,
+              double &xResult, double &yResult) {
+        const Reference &reference = this->reference();
+        if (!reference.buffer || !currBuffer) {
+            raspitex_release_buffer(&raspitex_state, currBuffer);
+            return false;
+        }
+
+        FindSums sums;
+        if (modelled && !pinned) {
+            if (!background.covers(rect.x, rect.y,
+                                   rect.width, rect.height)) {
+                tare(currBuffer, size, rect);
+                return false;
+            }
+            ModelParams params = modelParams(rWeight, gWeight, bWeight,
+                                             modelFloor, modelSigmas,
+                                             modelRate);
+            sums = background.update(kernels().modelRow,
+                                     frameView(currBuffer, rect.x, rect.y,
+                                               rect.width, rect.height),
+                                     params, &workers);
+        } else if (!diffReference(currBuffer, rect, rWeight, gWeight,
+                                  bWeight, sums)) {
+            tare(currBuffer, size, rect);
+            return false;
+        }
+        uint32_t count = sums.count;
+
+        replace(latest, currBuffer, size, rect);
+
+        if (count > 5) {
+            xResult = (double) sums.wx / sums.w;
+            yResult = (double) sums.wy / sums.w;
+            search.hit(xResult, yResult);
+            return true;
+        }
+
+        search.miss();
+        return false;
+    }
+
+    // Diffs the part of a captured region that the reference frame covers
+    // against it, e.g. only some of it when the predicted window has moved
+    // on. Returns false if the reference covers none of it.
+    bool diffReference(const uint8_t *currBuffer, const RASPITEX_RECT &rect,
+                       double rWeight, double gWeight, double bWeight,
+                       FindSums &sums) {
+        const Reference &reference = this->reference();
+        const RASPITEX_RECT &covered = reference.rect;
+        int32_t x1 = std::max(rect.x, covered.x);
+        int32_t y1 = std::max(rect.y, covered.y);
+        int32_t x2 = std::min(rect.x + rect.width,
+                              covered.x + covered.width);
+        int32_t y2 = std::min(rect.y + rect.height,
+                              covered.y + covered.height);
+        if (x2 <= x1 || y2 <= y1) {
+            return false;
+        }
+
+        FrameView curr = frameSubView(
+            frameView(currBuffer, rect.x, rect.y, rect.width, rect.height),
+            x1, y1, x2 - x1, y2 - y1);
+        FrameView ref = frameView(reference.buffer, covered.x, covered.y,
+                                  covered.width, covered.height);
 
         double threshold = 0.5 *
             (255 * rWeight +
              255 * gWeight +
              255 * bWeight);
 
-        // fprintf(stderr, "threshold: %g\n", threshold);
-        // fprintf(stderr, "x1,y1,x2,y2,w,h: %d,%d,%d,%d,%d,%d\n",
-        //         winX1, winY1, winX2, winY2,
-        //         raspitex_state.width,
-        //         raspitex_state.height);
+        FindWeights weights = findWeights(rWeight, gWeight, bWeight,
+                                          threshold);
+        sums = findSums(kernels().findRow, curr, ref, weights, &workers);
+        return true;
+    }
 
-        for (uint32_t x = winX1; x < winX2; ++x) {
-            for (uint32_t y = winY1; y < winY2; ++y) {
-                size_t offset = (y * raspitex_state.width + x) << 2;
+    Handle<Value> findBlobs(Isolate *isolate, double rWeight,
+                            double gWeight, double bWeight,
+                            uint32_t minArea) {
+        if (!reference().buffer) {
+            return Undefined(isolate);
+        }
 
-                double rDelta = rWeight *
-                    (currBuffer[offset + 0] -
-                     tareBuffer[offset + 0]);
+        size_t size = 0;
+        RASPITEX_RECT rect = window();
+        uint8_t *currBuffer = capture(&rect, size);
+        return findBlobs(isolate, currBuffer, size, rect,
+                         rWeight, gWeight, bWeight, minArea);
+    }
 
-                double gDelta = gWeight *
-                    (currBuffer[offset + 1] -
-                     tareBuffer[offset + 1]);
+    // Like find(), but keeps each connected group of changed pixels apart
+    // instead of averaging them all. Returns the groups of at least
+    // minArea pixels, heaviest first, as [{x, y, area, weight, bounds:
+    // [x, y, width, height]}, ...], or undefined if there is no
+    // reference to diff against.
+    Handle<Value> findBlobs(Isolate *isolate, uint8_t *currBuffer,
+                            size_t size, const RASPITEX_RECT &rect,
+                            double rWeight, double gWeight, double bWeight,
+                            uint32_t minArea) {
+        std::vector<Blob> blobs;
+        double scale = 1;
+        if (!diffBlobs(currBuffer, size, rect, rWeight, gWeight, bWeight,
+                       minArea, blobs, scale)) {
+            return Undefined(isolate);
+        }
 
-                double bDelta = bWeight *
-                    (currBuffer[offset + 2] -
-                     tareBuffer[offset + 2]);
+        Handle<Array> result = Array::New(isolate, blobs.size());
+        for (size_t i = 0; i < blobs.size(); ++i) {
+            const Blob &blob = blobs[i];
+            Handle<Object> entry = Object::New(isolate);
+            entry->Set(String::NewFromUtf8(isolate, "x"),
+                       Number::New(isolate, (double) blob.wx / blob.w));
+            entry->Set(String::NewFromUtf8(isolate, "y"),
+                       Number::New(isolate, (double) blob.wy / blob.w));
+            entry->Set(String::NewFromUtf8(isolate, "area"),
+                       Integer::NewFromUnsigned(isolate, blob.area));
+            entry->Set(String::NewFromUtf8(isolate, "weight"),
+                       Number::New(isolate, blob.w / scale));
+
+            Handle<Array> bounds = Array::New(isolate, 4);
+            bounds->Set(0, Integer::New(isolate, blob.x1));
+            bounds->Set(1, Integer::New(isolate, blob.y1));
+            bounds->Set(2, Integer::New(isolate, blob.x2 - blob.x1));
+            bounds->Set(3, Integer::New(isolate, blob.y2 - blob.y1));
+            entry->Set(String::NewFromUtf8(isolate, "bounds"), bounds);
+            result->Set(i, entry);
+        }
+        return result;
+    }
 
-                double sum = rDelta + gDelta + bDelta;
+    Handle<Value> track(Isolate *isolate, double rWeight, double gWeight,
+                        double bWeight, uint32_t minArea) {
+        if (!reference().buffer) {
+            return Undefined(isolate);
+        }
+
+        size_t size = 0;
+        RASPITEX_RECT rect = window();
+        uint8_t *currBuffer = capture(&rect, size);
+        return track(isolate, currBuffer, size, rect,
+                     rWeight, gWeight, bWeight, minArea);
+    }
+
+    // Finds blobs as findBlobs() does and feeds them to the tracker.
+    // Returns the confirmed tracks as [{id, x, y, vx, vy, area, age,
+    // misses}, ...], with velocities in pixels per call, or undefined if
+    // there is no reference to diff against.
+    Handle<Value> track(Isolate *isolate, uint8_t *currBuffer, size_t size,
+                        const RASPITEX_RECT &rect, double rWeight,
+                        double gWeight, double bWeight, uint32_t minArea) {
+        std::vector<Blob> blobs;
+        double scale = 1;
+        if (!diffBlobs(currBuffer, size, rect, rWeight, gWeight, bWeight,
+                       minArea, blobs, scale)) {
+            return Undefined(isolate);
+        }
+        tracker.update(blobs);
+
+        const std::vector<Track> &tracks = tracker.tracks();
+        Handle<Array> result = Array::New(isolate);
+        for (size_t i = 0; i < tracks.size(); ++i) {
+            const Track &track = tracks[i];
+            if (!tracker.confirmed(track)) {
+                continue;
+            }
+
+            Handle<Object> entry = Object::New(isolate);
+            entry->Set(String::NewFromUtf8(isolate, "id"),
+                       Integer::NewFromUnsigned(isolate, track.id));
+            entry->Set(String::NewFromUtf8(isolate, "x"),
+                       Number::New(isolate, track.x));
+            entry->Set(String::NewFromUtf8(isolate, "y"),
+                       Number::New(isolate, track.y));
+            entry->Set(String::NewFromUtf8(isolate, "vx"),
+                       Number::New(isolate, track.vx));
+            entry->Set(String::NewFromUtf8(isolate, "vy"),
+                       Number::New(isolate, track.vy));
+            entry->Set(String::NewFromUtf8(isolate, "area"),
+                       Integer::NewFromUnsigned(isolate, track.area));
+            entry->Set(String::NewFromUtf8(isolate, "age"),
+                       Integer::NewFromUnsigned(isolate, track.age));
+            entry->Set(String::NewFromUtf8(isolate, "misses"),
+                       Integer::NewFromUnsigned(isolate, track.misses));
+            result->Set(result->Length(), entry);
+        }
+        return result;
+    }
+
+    // Forgets every track, and sets how far (in pixels) a blob may be
+    // from a track's prediction to match it, how many updates in a row a
+    // new track must match to get an id, and how many a confirmed one
+    // may miss before it is dropped.
+    void resetTracks(double gate, uint32_t birthHits, uint32_t deathMisses) {
+        tracker.reset(gate, birthHits, deathMisses);
+    }
+
+    // Weighs a captured region against the background model, or diffs
+    // it against the reference as find() does, into blobs, with the scale
+    // of their weights, then rolls it in as find() does. Returns false if
+    // there was nothing to weigh it against.
+    bool diffBlobs(uint8_t *currBuffer, size_t size, const RASPITEX_RECT &rect,
+                   double rWeight, double gWeight, double bWeight,
+                   uint32_t minArea, std::vector<Blob> &blobs,
+                   double &scale) {
+        const Reference &reference = this->reference();
+        if (!reference.buffer || !currBuffer) {
+            raspitex_release_buffer(&raspitex_state, currBuffer);
+            return false;
+        }
 
-                if (sum > threshold) {
-                    xSum += sum * x;
-                    ySum += sum * y;
-                    denominator += sum;
-                    // fprintf(stderr, "%d %d %g\n", x, y, sum);
+        FrameView curr = frameView(currBuffer, rect.x, rect.y,
+                                   rect.width, rect.height);
+        FrameView ref = frameView(reference.buffer,
+                                  reference.rect.x, reference.rect.y,
+                                  reference.rect.width, reference.rect.height);
+
+        if (modelled && !pinned) {
+            if (!background.covers(rect.x, rect.y,
+                                   rect.width, rect.height)) {
+                tare(currBuffer, size, rect);
+                return false;
+            }
+            ModelParams params = modelParams(rWeight, gWeight, bWeight,
+                                             modelFloor, modelSigmas,
+                                             modelRate);
+            ::findBlobs(background, kernels().modelRow, curr, params,
+                        minArea, blobs, &workers);
+            scale = params.weights.scale;
+        } else if (!ref.contains(rect.x, rect.y, rect.width, rect.height)) {
+            tare(currBuffer, size, rect);
+            return false;
+        } else {
+            double threshold = 0.5 * 255 * (rWeight + gWeight + bWeight);
+            FindWeights weights = findWeights(rWeight, gWeight, bWeight,
+                                              threshold);
+            ::findBlobs(kernels().weighRow, curr, ref, weights, minArea,
+                        blobs, &workers);
+            scale = weights.scale;
+        }
+
+        replace(latest, currBuffer, size, rect);
+        return true;
+    }
+
+    bool findBright(double threshold, double &xResult, double &yResult) {
+        size_t size = 0;
+        RASPITEX_RECT rect = lumaWindow();
+        uint8_t *buffer = capture(&rect, size, RASPITEX_CAPTURE_LUMA);
+        return findBright(buffer, rect, threshold, xResult, yResult);
+    }
+
+    // Finds the centroid of the pixels brighter than threshold (0-255) in
+    // a luma capture, weighting each by how far it exceeds the threshold.
+    // The buffer holds one byte per pixel with rows padded to a multiple
+    // of 4 pixels, and is released.
+    bool findBright(uint8_t *buffer, const RASPITEX_RECT &rect,
+                    double threshold, double &xResult, double &yResult) {
+        if (!buffer) {
+            return false;
+        }
+
+        uint32_t stride = (rect.width + 3) & ~3;
+        uint32_t count = 0;
+        double xSum = 0;
+        double ySum = 0;
+        double denominator = 0;
+
+        for (int32_t y = 0; y < rect.height; ++y) {
+            const uint8_t *row = buffer + y * stride;
+            for (int32_t x = 0; x < rect.width; ++x) {
+                double weight = row[x] - threshold;
+                if (weight > 0) {
+                    xSum += weight * (rect.x + x);
+                    ySum += weight * (rect.y + y);
+                    denominator += weight;
                     ++count;
                 }
             }
         }
 
-        free(tareBuffer);
-        tareBuffer = currBuffer;
-
-        fprintf(stderr, "count: %d\n", count);
+        raspitex_release_buffer(&raspitex_state, buffer);
 
         if (count > 5) {
             xResult = xSum / denominator;
             yResult = ySum / denominator;
-            // setWindow(std::floor(xResult) - 100,
-            //           std::floor(yResult) - 100,
-            //           std::floor(xResult) + 100,
-            //           std::floor(yResult) + 100);
             return true;
         }
 
-        // setWindow(0, 0, raspitex_state.width, raspitex_state.height);
+        return false;
+    }
+
+    bool findMask(double rWeight, double gWeight, double bWeight,
+                  double &xResult, double &yResult) {
+        size_t size = 0;
+        RASPITEX_RECT rect = maskWindow();
+        uint8_t *buffer = capture(diffParams(RASPITEX_CAPTURE_MASK, rect,
+                                             rWeight, gWeight, bWeight),
+                                  size);
+        return findMask(buffer, rect, xResult, yResult);
+    }
+
+    // Like find(), but thresholded on the GPU, which also keeps the
+    // reference frame, so only one bit per pixel is read back. The result
+    // is the unweighted centroid of the pixels that passed. The buffer
+    // holds rows of (width + 31) / 32 32-bit words, and is released.
+    bool findMask(uint8_t *buffer, const RASPITEX_RECT &rect,
+                  double &xResult, double &yResult) {
+        if (!buffer) {
+            return false;
+        }
+
+        // The first capture is against a black reference.
+        if (!gpuReferenced) {
+            gpuReferenced = true;
+            raspitex_release_buffer(&raspitex_state, buffer);
+            return false;
+        }
+
+        uint32_t stride = ((rect.width + 31) >> 5) << 2;
+        uint32_t count = 0;
+        double xSum = 0;
+        double ySum = 0;
+
+        // The padding bits at the end of each row are not pixels.
+        int32_t xEnd = rect.x + rect.width;
+        for (int32_t y = 0; y < rect.height; ++y) {
+            const uint8_t *row = buffer + y * stride;
+            for (uint32_t i = 0; i < stride; ++i) {
+                uint8_t bits = row[i];
+                for (int32_t x = rect.x + (i << 3); bits && x < xEnd;
+                     bits >>= 1, ++x) {
+                    if (bits & 1) {
+                        xSum += x;
+                        ySum += rect.y + y;
+                        ++count;
+                    }
+                }
+            }
+        }
+
+        raspitex_release_buffer(&raspitex_state, buffer);
+
+        if (count > 5) {
+            xResult = xSum / count;
+            yResult = ySum / count;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool findGPU(double rWeight, double gWeight, double bWeight,
+                 double &xResult, double &yResult) {
+        size_t size = 0;
+        RASPITEX_RECT rect = window();
+        uint8_t *buffer = capture(diffParams(RASPITEX_CAPTURE_SUMS, rect,
+                                             rWeight, gWeight, bWeight),
+                                  size);
+        return findGPU(buffer, xResult, yResult);
+    }
+
+    // Like find(), but the difference, threshold and centroid sums are all
+    // computed on the GPU against its own reference frame, and only the
+    // sums are read back. The buffer is released.
+    bool findGPU(uint8_t *buffer, double &xResult, double &yResult) {
+        if (!buffer) {
+            return false;
+        }
+
+        double sums[RASPITEX_NUM_SUMS];
+        for (int i = 0; i < RASPITEX_NUM_SUMS; ++i) {
+            sums[i] = raspitexutil_unpack_float(buffer + (i << 2));
+        }
+        raspitex_release_buffer(&raspitex_state, buffer);
+
+        if (!gpuReferenced) {
+            gpuReferenced = true;
+            return false;
+        }
+
+        if (sums[RASPITEX_SUM_COUNT] > 5) {
+            xResult = sums[RASPITEX_SUM_WX] / sums[RASPITEX_SUM_W];
+            yResult = sums[RASPITEX_SUM_WY] / sums[RASPITEX_SUM_W];
+            return true;
+        }
 
         return false;
     }
 
+    // What analyze() computes from its capture.
+    typedef struct {
+        bool sample;                    /// Sample the LEDs
+        bool find;                      /// Find within the search window
+        double rWeight, gWeight, bWeight;
+        bool histogram;                 /// Count the window's histogram
+        bool stats;                     /// Summarise it, as stats() does
+    } AnalyzeOptions;
+
+    Handle<Object> analyze(Isolate *isolate, const AnalyzeOptions &options,
+                           Handle<Value> target) {
+        size_t size = 0;
+        return analyze(isolate, capture(NULL, size), size, options, target);
+    }
+
+    // Does the work of sample(), find() and a histogram of the search
+    // window with one whole-frame capture, which is released or (if
+    // finding) rolled in as the latest reference frame. Finding weighs
+    // the window against the background model as find() does, or, while
+    // that is off or the reference is pinned, diffs its rows against the
+    // reference and counts them in the same pass. Returns an object with
+    // samples, position (if found), count, histogram {r, g, b, luma} and
+    // stats (as stats() returns them), each property only present if
+    // asked for. Samples go into target as sample() would put them.
+    Handle<Object> analyze(Isolate *isolate, uint8_t *buffer, size_t size,
+                           const AnalyzeOptions &options,
+                           Handle<Value> target) {
+        Handle<Object> result = Object::New(isolate);
+        if (!buffer) {
+            return result;
+        }
+
+        RASPITEX_RECT full = { 0, 0, (int32_t) width, (int32_t) height };
+        RASPITEX_RECT rect = window();
+        FrameView frame = frameView(buffer, 0, 0, width, height);
+        FrameView curr = frameSubView(frame, rect.x, rect.y,
+                                      rect.width, rect.height);
+
+        if (options.sample && xyData) {
+            sampleFrame(frame);
+            result->Set(String::NewFromUtf8(isolate, "samples"),
+                        sampleOutput(isolate, rgbData, 3, target));
+        }
+
+        FrameHistogram histogram;
+        FrameHistogram *counts = NULL;
+        if (options.histogram || options.stats) {
+            memset(&histogram, 0, sizeof(histogram));
+            counts = &histogram;
+        }
+
+        const Reference &reference = this->reference();
+        FrameView ref = frameView(reference.buffer,
+                                  reference.rect.x, reference.rect.y,
+                                  reference.rect.width, reference.rect.height);
+        bool modelling = modelled && !pinned;
+        bool comparable = reference.buffer && (modelling ?
+            background.covers(rect.x, rect.y, rect.width, rect.height) :
+            ref.contains(rect.x, rect.y, rect.width, rect.height));
+
+        if (options.find && comparable && modelling) {
+            ModelParams params = modelParams(options.rWeight,
+                                             options.gWeight,
+                                             options.bWeight, modelFloor,
+                                             modelSigmas, modelRate);
+            FindSums sums = background.update(kernels().modelRow, curr,
+                                              params, &workers, counts,
+                                              kernels().histogramRow);
+            setFound(isolate, result, sums);
+        } else if (options.find && comparable) {
+            double threshold = 0.5 * 255 *
+                (options.rWeight + options.gWeight + options.bWeight);
+            FindWeights weights = findWeights(options.rWeight,
+                                              options.gWeight,
+                                              options.bWeight, threshold);
+            FindSums sums = findSums(kernels().findRow, curr, ref, weights,
+                                     &workers, counts,
+                                     kernels().histogramRow);
+            setFound(isolate, result, sums);
+        } else if (counts) {
+            frameHistogram(kernels().histogramRow, curr, *counts, &workers);
+        }
+
+        if (options.histogram) {
+            Handle<Object> channels = Object::New(isolate);
+            channels->Set(String::NewFromUtf8(isolate, "r"),
+                          histogramArray(isolate, counts->r));
+            channels->Set(String::NewFromUtf8(isolate, "g"),
+                          histogramArray(isolate, counts->g));
+            channels->Set(String::NewFromUtf8(isolate, "b"),
+                          histogramArray(isolate, counts->b));
+            channels->Set(String::NewFromUtf8(isolate, "luma"),
+                          histogramArray(isolate, counts->luma));
+            result->Set(String::NewFromUtf8(isolate, "histogram"), channels);
+        }
+        if (options.stats) {
+            result->Set(String::NewFromUtf8(isolate, "stats"),
+                        statsObject(isolate, *counts,
+                                    (uint32_t) curr.width * curr.height));
+        }
+
+        if (!options.find) {
+            raspitex_release_buffer(&raspitex_state, buffer);
+        } else if (!comparable) {
+            tare(buffer, size, full);
+        } else {
+            replace(latest, buffer, size, full);
+        }
+
+        return result;
+    }
+
+    // Sets analyze()'s count, and its position if find() would have found
+    // one, from the sums over the window.
+    void setFound(Isolate *isolate, Handle<Object> result,
+                  const FindSums &sums) const {
+        result->Set(String::NewFromUtf8(isolate, "count"),
+                    Integer::NewFromUnsigned(isolate, sums.count));
+        if (sums.count > 5) {
+            Handle<Array> xy = Array::New(isolate, 2);
+            xy->Set(0, Number::New(isolate, (double) sums.wx / sums.w));
+            xy->Set(1, Number::New(isolate, (double) sums.wy / sums.w));
+            result->Set(String::NewFromUtf8(isolate, "position"), xy);
+        }
+    }
+
+    // The part of the frame covering count packed x, y, width, height
+    // rects, or a single pixel if none of them overlap it.
+    RASPITEX_RECT regionBounds(const uint32_t *rects, size_t count) const {
+        uint32_t x1 = width, y1 = height, x2 = 0, y2 = 0;
+
+        for (size_t i = 0; i < count; ++i, rects += 4) {
+            uint32_t right = std::min(rects[0] + rects[2], width);
+            uint32_t bottom = std::min(rects[1] + rects[3], height);
+            if (rects[0] >= right || rects[1] >= bottom) {
+                continue;
+            }
+            x1 = std::min(x1, rects[0]);
+            y1 = std::min(y1, rects[1]);
+            x2 = std::max(x2, right);
+            y2 = std::max(y2, bottom);
+        }
+
+        RASPITEX_RECT bounds = { 0, 0, 1, 1 };
+        if (x1 < x2 && y1 < y2) {
+            bounds.x = x1;
+            bounds.y = y1;
+            bounds.width = x2 - x1;
+            bounds.height = y2 - y1;
+        }
+        return bounds;
+    }
+
+    Handle<Value> regionMeans(Isolate *isolate, const uint32_t *rects,
+                              size_t count, Handle<Value> target) {
+        RASPITEX_RECT bounds = regionBounds(rects, count);
+        size_t size = 0;
+        return regionMeans(isolate, capture(&bounds, size), bounds,
+                           rects, count, target);
+    }
+
+    // Averages each of count packed x, y, width, height rects over a
+    // capture of bounds (see regionBounds()), which is released. The
+    // capture is summed into an integral image in one pass, after which
+    // every rect costs four lookups whatever its size. Rects are clipped
+    // to the frame, and average 0 if nothing is left. The r, g, b means go
+    // into target if it is a Float32Array with room for them, or else
+    // into a new one.
+    Handle<Value> regionMeans(Isolate *isolate, uint8_t *buffer,
+                              const RASPITEX_RECT &bounds,
+                              const uint32_t *rects, size_t count,
+                              Handle<Value> target) {
+        if (buffer == NULL) {
+            return Undefined(isolate);
+        }
+
+        size_t needed = integralImageSize(bounds.width, bounds.height);
+        if (needed > integralSize) {
+            delete[] integralData;
+            integralData = new uint32_t[needed];
+            integralSize = needed;
+        }
+
+        IntegralImage table;
+        table.sums = integralData;
+        integralImage(kernels().integralRow,
+                      frameView(buffer, bounds.x, bounds.y,
+                                bounds.width, bounds.height),
+                      table);
+        raspitex_release_buffer(&raspitex_state, buffer);
+
+        Handle<Float32Array> means;
+        if (target->IsFloat32Array() &&
+            Handle<Float32Array>::Cast(target)->Length() >= count * 3) {
+            means = Handle<Float32Array>::Cast(target);
+        } else {
+            means = Float32Array::New(
+                ArrayBuffer::New(isolate, count * 3 * sizeof(float)),
+                0, count * 3);
+        }
+
+        float *out = reinterpret_cast<float *>(
+            static_cast<uint8_t *>(means->Buffer()->GetContents().Data()) +
+            means->ByteOffset());
+        for (size_t i = 0; i < count; ++i, rects += 4, out += 3) {
+            uint32_t sums[3];
+            uint32_t area = integralSums(table, rects[0], rects[1],
+                                         rects[2], rects[3], sums);
+            for (int c = 0; c < 3; ++c) {
+                out[c] = area ? (float) sums[c] / area : 0;
+            }
+        }
+
+        return means;
+    }
+
+    Handle<Value> stats(Isolate *isolate) {
+        size_t size = 0;
+        RASPITEX_RECT rect = window();
+        uint8_t *buffer = capture(&rect, size);
+        return stats(isolate, buffer, rect);
+    }
+
+    // Counts a capture of the search window, which is released, into
+    // histograms of r, g, b and luma, split between the workers. Returns
+    // {pixels, r, g, b, luma}, each channel summarised as {mean, min, max,
+    // saturated, histogram}, where saturated counts the pixels at 255, or
+    // undefined if the capture failed.
+    Handle<Value> stats(Isolate *isolate, uint8_t *buffer,
+                        const RASPITEX_RECT &rect) {
+        if (buffer == NULL) {
+            return Undefined(isolate);
+        }
+
+        FrameHistogram histogram;
+        frameHistogram(kernels().histogramRow,
+                       frameView(buffer, rect.x, rect.y,
+                                 rect.width, rect.height),
+                       histogram, &workers);
+        raspitex_release_buffer(&raspitex_state, buffer);
+
+        return statsObject(isolate, histogram,
+                           (uint32_t) rect.width * rect.height);
+    }
+
+    static Handle<Object> statsObject(Isolate *isolate,
+                                      const FrameHistogram &histogram,
+                                      uint32_t pixels) {
+        Handle<Object> result = Object::New(isolate);
+        result->Set(String::NewFromUtf8(isolate, "pixels"),
+                    Integer::NewFromUnsigned(isolate, pixels));
+        result->Set(String::NewFromUtf8(isolate, "r"),
+                    channelStats(isolate, histogram.r));
+        result->Set(String::NewFromUtf8(isolate, "g"),
+                    channelStats(isolate, histogram.g));
+        result->Set(String::NewFromUtf8(isolate, "b"),
+                    channelStats(isolate, histogram.b));
+        result->Set(String::NewFromUtf8(isolate, "luma"),
+                    channelStats(isolate, histogram.luma));
+        return result;
+    }
+
+    // Everything but the histogram is read off it, so the pixels are only
+    // walked once.
+    static Handle<Object> channelStats(Isolate *isolate,
+                                       const uint32_t counts[256]) {
+        uint64_t total = 0, sum = 0;
+        int min = 256, max = -1;
+        for (int i = 0; i < 256; ++i) {
+            if (counts[i]) {
+                total += counts[i];
+                sum += (uint64_t) counts[i] * i;
+                min = std::min(min, i);
+                max = i;
+            }
+        }
+
+        Handle<Object> channel = Object::New(isolate);
+        channel->Set(String::NewFromUtf8(isolate, "mean"),
+                     Number::New(isolate, total ? (double) sum / total : 0));
+        channel->Set(String::NewFromUtf8(isolate, "min"),
+                     Integer::New(isolate, total ? min : 0));
+        channel->Set(String::NewFromUtf8(isolate, "max"),
+                     Integer::New(isolate, total ? max : 0));
+        channel->Set(String::NewFromUtf8(isolate, "saturated"),
+                     Integer::NewFromUnsigned(isolate, counts[255]));
+        channel->Set(String::NewFromUtf8(isolate, "histogram"),
+                     histogramArray(isolate, counts));
+        return channel;
+    }
+
+    static Handle<Uint32Array> histogramArray(Isolate *isolate,
+                                              const uint32_t counts[256]) {
+        Handle<ArrayBuffer> storage = ArrayBuffer::New(isolate, 256 * 4);
+        memcpy(storage->GetContents().Data(), counts, 256 * 4);
+        return Uint32Array::New(storage, 0, 256);
+    }
+
     void switch_scene() {
         if (raspitex_state.scene_id != RASPITEX_SCENE_SHOWTIME) {
             raspitex_state.scene_id = RASPITEX_SCENE_SHOWTIME;
@@ -363,15 +1370,31 @@ public:
     }
 
     void save(const std::string& filename) {
-        if (!tareBuffer) {
+        const Reference &reference = this->reference();
+        if (!reference.buffer) {
+            return;
+        }
+
+        // The reference may be shared with other capture requesters, so
+        // the channel swap goes into a private copy.
+        uint8_t *rgba = raspitex_acquire_buffer(&raspitex_state,
+                                                reference.size);
+        if (!rgba) {
             return;
         }
 
-        raspitexutil_brga_to_rgba(tareBuffer, tareSize);
+        raspitexutil_copy_brga_to_rgba(rgba, reference.buffer,
+                                       reference.size);
         FILE* fd = fopen(filename.c_str(), "w+");
-        write_tga(fd, width, height, tareBuffer, tareSize);
+        write_tga(fd, reference.rect.width, reference.rect.height, rgba,
+                  reference.size);
         fflush(fd);
         fclose(fd);
+        raspitex_release_buffer(&raspitex_state, rgba);
+    }
+
+    unsigned threads() const {
+        return workers.size();
     }
 
     ~OffGrid() {
@@ -379,8 +1402,15 @@ public:
             fprintf(stderr, "Closing down\n");
 
         raspitex_stop(&raspitex_state);
+
+        replace(latest, NULL, 0, RASPITEX_RECT());
+        replace(baseline, NULL, 0, RASPITEX_RECT());
         raspitex_destroy(&raspitex_state);
 
+        delete[] xyData;
+        delete[] rgbData;
+        delete[] integralData;
+
         // Disable ports that are not handled by connections.
         MMAL_PORT_T *port = camera_component->output[MMAL_CAMERA_VIDEO_PORT];
         if (port && port->is_enabled)
@@ -408,15 +1438,82 @@ public:
 
 private:
     uint32_t winX1, winX2, winY1, winY2;
-    uint8_t *tareBuffer;
-    size_t tareSize;
 
+    // A pooled capture held as a reference frame.
     typedef struct {
-        uint32_t x, y;
-    } Datum;
-    Datum *xyData;
+        uint8_t *buffer;
+        size_t size;
+        RASPITEX_RECT rect;
+    } Reference;
+
+    // Both slots hold references to pooled capture buffers, so rolling a
+    // new frame in only swaps pointers and hands the old one back to the
+    // pool; neither tare() nor find() ever copies or allocates a frame.
+    // latest is the last frame captured by find() or tare(); baseline is
+    // only held while pinned.
+    Reference latest;
+    Reference baseline;
+    bool pinned;
+
+    // Each GPU mask or sums capture differences against the frame the
+    // previous one left as the GPU's reference, so the first runs against
+    // a black reference and is dropped. findMask() and findGPU() share
+    // the flag because they share that reference.
+    bool gpuReferenced;
+
+    const Reference &reference() const {
+        return pinned ? baseline : latest;
+    }
+
+    // Drops a slot's frame and takes over the caller's reference to
+    // buffer in its place.
+    void replace(Reference &slot, uint8_t *buffer, size_t size,
+                 const RASPITEX_RECT &rect) {
+        raspitex_release_buffer(&raspitex_state, slot.buffer);
+        slot.buffer = buffer;
+        slot.size = size;
+        slot.rect = rect;
+    }
+
+    SamplePoint *xyData;                /// LED positions, see planSamples()
+    uint8_t *rgbData;                   /// 3 bytes per LED, for sample()
     size_t xyCount;
     Persistent<Array> rgbOutput;
+
+    uint32_t *integralData;             /// regionMeans()' integral image
+    size_t integralSize;                /// its capacity in uint32_t
+
+    WorkerPool workers;
+    BlobTracker tracker;
+
+    bool adaptive;                      /// find() uses search
+    SearchWindow search;
+
+    bool modelled;                      /// find() etc. use background
+    double modelFloor;                  /// see backgroundModel()
+    double modelSigmas;
+    unsigned modelRate;
+    Background background;
+
+    // sample() splits the LEDs into ranges of at least this many.
+    static const unsigned MIN_BAND_POINTS = 64;
+
+    struct SampleBands {
+        const Kernels *kernels;
+        FrameView frame;
+        const SamplePoint *points;
+        uint8_t *rgb;
+        size_t count;
+    };
+
+    static void sampleBand(void *context, unsigned part, unsigned parts) {
+        SampleBands *bands = static_cast<SampleBands *>(context);
+        unsigned begin, end;
+        workerRange(bands->count, part, parts, begin, end);
+
+        samplePlanned(*bands->kernels, bands->frame, bands->points + begin,
+                      end - begin, bands->rgb);
+    }
 };
 
 /// Comamnd ID's and Structure defining our command line options
@@ -793,32 +1890,393 @@ static void signal_handler(int signal_number)
 
 static OffGrid *sState = NULL;
 
+// findBlobs() leaves out smaller blobs unless told otherwise, as find()
+// gives up on fewer changed pixels.
+#define FIND_BLOBS_MIN_AREA 6
+
+// State for a capture requested from JS with a callback. The GL thread
+// completes the request without anyone waiting on it and hands it back
+// through sCaptureAsync, and the result is analysed and delivered on the
+// main thread.
+struct CaptureWork {
+    enum Kind {
+        TARE, SAMPLE, SAMPLE_GPU, FIND, FIND_BRIGHT, FIND_MASK, FIND_GPU,
+        ANALYZE, REGION_MEANS, FIND_BLOBS, TRACK, STATS
+    };
+
+    CaptureWork *next;                  // in sCompleted
+    Kind kind;
+    RASPITEX_RECT rect;
+    double rWeight, gWeight, bWeight;
+    double threshold;
+    uint32_t minArea;                   // findBlobs()' and track()'s smallest
+                                        // blob
+    OffGrid::AnalyzeOptions analyzeOptions;
+    uint32_t *rects;                    // regionMeans()' packed rects
+    size_t rectCount;
+    uint8_t *buffer;
+    size_t size;
+    Persistent<Value> target;           // typed array for samples, if any
+    Persistent<Function> callback;
+};
+
+// Captures completed by the GL thread, most recent first, for
+// sCaptureAsync to deliver on the main thread.
+static uv_async_t sCaptureAsync;
+static uv_mutex_t sCompletedLock;
+static CaptureWork *sCompleted = NULL;
+
+// Captures requested and not yet delivered. The loop is only kept alive
+// while there are some.
+static unsigned sOutstanding = 0;
+
+// The typed array, if any, that a sample* or analyze call given arg as
+// its first argument should write samples into.
+static Handle<Value> sample_target(CaptureWork::Kind kind, Handle<Value> arg) {
+    if (kind == CaptureWork::ANALYZE && arg->IsObject() &&
+        !arg->IsArrayBufferView()) {
+        Isolate *isolate = Isolate::GetCurrent();
+        return Handle<Object>::Cast(arg)->Get(
+            String::NewFromUtf8(isolate, "samples"));
+    }
+    return arg;
+}
+
+// Reads analyze()'s options object: {weights: [r, g, b]} to find,
+// sample: false to skip the LEDs, samples: a typed array to sample into,
+// histogram: true to count the window and stats: true to summarise it.
+static void parse_analyze_options(Handle<Value> value,
+                                  OffGrid::AnalyzeOptions &options) {
+    options.sample = true;
+    options.find = false;
+    options.rWeight = options.gWeight = options.bWeight = 0;
+    options.histogram = false;
+    options.stats = false;
+
+    if (!value->IsObject()) {
+        return;
+    }
+
+    Isolate *isolate = Isolate::GetCurrent();
+    Handle<Object> object = Handle<Object>::Cast(value);
+
+    Handle<Value> weights = object->Get(String::NewFromUtf8(isolate,
+                                                            "weights"));
+    if (weights->IsArray() && Handle<Array>::Cast(weights)->Length() >= 3) {
+        Handle<Array> rgb = Handle<Array>::Cast(weights);
+        options.find = true;
+        options.rWeight = rgb->Get(0)->NumberValue();
+        options.gWeight = rgb->Get(1)->NumberValue();
+        options.bWeight = rgb->Get(2)->NumberValue();
+    }
+
+    Handle<Value> sample = object->Get(String::NewFromUtf8(isolate,
+                                                           "sample"));
+    if (!sample->IsUndefined()) {
+        options.sample = sample->BooleanValue();
+    }
+
+    options.histogram = object->Get(String::NewFromUtf8(isolate,
+                                                        "histogram"))
+        ->BooleanValue();
+    options.stats = object->Get(String::NewFromUtf8(isolate, "stats"))
+        ->BooleanValue();
+}
+
+// Copies regionMeans()' rects, given as [[x, y, width, height], ...] or
+// as a Uint32Array of packed quads, into a new array of count * 4.
+static uint32_t *parse_rects(Handle<Value> value, size_t &count) {
+    if (value->IsUint32Array()) {
+        Handle<Uint32Array> packed = Handle<Uint32Array>::Cast(value);
+        const uint8_t *contents = static_cast<const uint8_t *>(
+            packed->Buffer()->GetContents().Data());
+        count = packed->Length() / 4;
+        uint32_t *rects = new uint32_t[count * 4];
+        memcpy(rects, contents + packed->ByteOffset(),
+               count * 4 * sizeof(uint32_t));
+        return rects;
+    }
+
+    count = value->IsArray() ? Handle<Array>::Cast(value)->Length() : 0;
+    uint32_t *rects = new uint32_t[count * 4];
+    for (size_t i = 0; i < count; ++i) {
+        Handle<Array> rect = Handle<Array>::Cast(
+            Handle<Array>::Cast(value)->Get(i));
+        for (uint32_t j = 0; j < 4; ++j) {
+            rects[i * 4 + j] = rect->Get(j)->Uint32Value();
+        }
+    }
+    return rects;
+}
+
+// What to ask the GL thread for.
+static RASPITEX_CAPTURE_PARAMS CaptureWorkParams(const CaptureWork *work) {
+    const RASPITEX_RECT *rect = &work->rect;
+    RASPITEX_CAPTURE_MODE mode = RASPITEX_CAPTURE_BGRA;
+
+    if (work->kind == CaptureWork::SAMPLE ||
+        work->kind == CaptureWork::ANALYZE) {
+        rect = NULL;
+    } else if (work->kind == CaptureWork::SAMPLE_GPU) {
+        rect = NULL;
+        mode = RASPITEX_CAPTURE_POINTS;
+    } else if (work->kind == CaptureWork::FIND_BRIGHT) {
+        mode = RASPITEX_CAPTURE_LUMA;
+    } else if (work->kind == CaptureWork::FIND_MASK ||
+               work->kind == CaptureWork::FIND_GPU) {
+        return sState->diffParams(work->kind == CaptureWork::FIND_MASK ?
+                                  RASPITEX_CAPTURE_MASK :
+                                  RASPITEX_CAPTURE_SUMS,
+                                  work->rect, work->rWeight,
+                                  work->gWeight, work->bWeight);
+    }
+    return sState->captureParams(rect, mode);
+}
+
+// Called on the GL thread, or on the main thread if the capture was
+// shared or the request failed, to hand the capture to the main thread.
+static void CaptureWorkCaptured(void *context, uint8_t *buffer,
+                                size_t size) {
+    CaptureWork *work = static_cast<CaptureWork*>(context);
+    work->buffer = buffer;
+    work->size = size;
+
+    uv_mutex_lock(&sCompletedLock);
+    work->next = sCompleted;
+    sCompleted = work;
+    uv_mutex_unlock(&sCompletedLock);
+
+    uv_async_send(&sCaptureAsync);
+}
+
+static void CaptureWorkDone(CaptureWork *work) {
+    Isolate *isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    Handle<Value> argv[2] = { Null(isolate), Undefined(isolate) };
+
+    if (work->buffer == NULL) {
+        argv[0] = Exception::Error(
+            String::NewFromUtf8(isolate, "capture failed"));
+    } else if (work->kind == CaptureWork::TARE) {
+        sState->tare(work->buffer, work->size, work->rect);
+    } else if (work->kind == CaptureWork::SAMPLE) {
+        argv[1] = sState->sample(isolate, work->buffer,
+                                 Local<Value>::New(isolate, work->target));
+    } else if (work->kind == CaptureWork::SAMPLE_GPU) {
+        argv[1] = sState->sampleGPU(isolate, work->buffer, work->size,
+                                    Local<Value>::New(isolate, work->target));
+    } else if (work->kind == CaptureWork::ANALYZE) {
+        argv[1] = sState->analyze(isolate, work->buffer, work->size,
+                                  work->analyzeOptions,
+                                  Local<Value>::New(isolate, work->target));
+    } else if (work->kind == CaptureWork::FIND_BLOBS) {
+        argv[1] = sState->findBlobs(isolate, work->buffer, work->size,
+                                    work->rect, work->rWeight, work->gWeight,
+                                    work->bWeight, work->minArea);
+    } else if (work->kind == CaptureWork::TRACK) {
+        argv[1] = sState->track(isolate, work->buffer, work->size,
+                                work->rect, work->rWeight, work->gWeight,
+                                work->bWeight, work->minArea);
+    } else if (work->kind == CaptureWork::STATS) {
+        argv[1] = sState->stats(isolate, work->buffer, work->rect);
+    } else if (work->kind == CaptureWork::REGION_MEANS) {
+        argv[1] = sState->regionMeans(isolate, work->buffer, work->rect,
+                                      work->rects, work->rectCount,
+                                      Local<Value>::New(isolate,
+                                                        work->target));
+    } else {
+        double x, y;
+        bool found;
+        if (work->kind == CaptureWork::FIND_BRIGHT) {
+            found = sState->findBright(work->buffer, work->rect,
+                                       work->threshold, x, y);
+        } else if (work->kind == CaptureWork::FIND_MASK) {
+            found = sState->findMask(work->buffer, work->rect, x, y);
+        } else if (work->kind == CaptureWork::FIND_GPU) {
+            found = sState->findGPU(work->buffer, x, y);
+        } else {
+            found = sState->find(work->buffer, work->size, work->rect,
+                                 work->rWeight, work->gWeight, work->bWeight,
+                                 x, y);
+        }
+        if (found) {
+            Handle<Array> xy = Array::New(isolate, 2);
+            xy->Set(0, Number::New(isolate, x));
+            xy->Set(1, Number::New(isolate, y));
+            argv[1] = xy;
+        }
+    }
+
+    Local<Function> callback = Local<Function>::New(isolate, work->callback);
+    work->callback.Reset();
+    work->target.Reset();
+    delete[] work->rects;
+    delete work;
+
+    // Before the callback, which may queue another capture
+    if (--sOutstanding == 0) {
+        uv_unref(reinterpret_cast<uv_handle_t*>(&sCaptureAsync));
+    }
+
+    node::MakeCallback(isolate, isolate->GetCurrentContext()->Global(),
+                       callback, 2, argv);
+}
+
+// Delivers every capture the GL thread has completed, in the order they
+// were requested. uv_async_send() calls may be coalesced into one of
+// these.
+static void CaptureWorkDeliver(uv_async_t *async) {
+    uv_mutex_lock(&sCompletedLock);
+    CaptureWork *completed = sCompleted;
+    sCompleted = NULL;
+    uv_mutex_unlock(&sCompletedLock);
+
+    CaptureWork *ordered = NULL;
+    while (completed) {
+        CaptureWork *next = completed->next;
+        completed->next = ordered;
+        ordered = completed;
+        completed = next;
+    }
+
+    while (ordered) {
+        CaptureWork *work = ordered;
+        ordered = work->next;
+        CaptureWorkDone(work);
+    }
+}
+
+// Argument i of an asynchronous call, or undefined if it is the callback
+// or beyond it.
+static Handle<Value> capture_arg(const FunctionCallbackInfo<Value>& args,
+                                 int i) {
+    if (i < args.Length() - 1) {
+        return args[i];
+    }
+    return Undefined(args.GetIsolate());
+}
+
+// Queues an asynchronous capture if the last argument is a function.
+static bool QueueCapture(const FunctionCallbackInfo<Value>& args,
+                         CaptureWork::Kind kind) {
+    int argc = args.Length();
+    if (argc == 0 || !args[argc - 1]->IsFunction()) {
+        return false;
+    }
+
+    Isolate *isolate = args.GetIsolate();
+    CaptureWork *work = new CaptureWork();
+    work->next = NULL;
+    work->kind = kind;
+    work->rect = sState->window();
+    work->rWeight = work->gWeight = work->bWeight = 0;
+    work->threshold = 0;
+    work->minArea = FIND_BLOBS_MIN_AREA;
+    work->rects = NULL;
+    work->rectCount = 0;
+
+    // Each kind reads its own arguments the way its synchronous entry
+    // point does, with those before the callback standing in for args.
+    switch (kind) {
+    case CaptureWork::SAMPLE:
+    case CaptureWork::SAMPLE_GPU:
+        work->target.Reset(isolate, capture_arg(args, 0));
+        break;
+    case CaptureWork::FIND:
+    case CaptureWork::FIND_MASK:
+    case CaptureWork::FIND_GPU:
+    case CaptureWork::FIND_BLOBS:
+    case CaptureWork::TRACK:
+        if (kind == CaptureWork::FIND) {
+            work->rect = sState->findWindow();
+        } else if (kind == CaptureWork::FIND_MASK) {
+            work->rect = sState->maskWindow();
+        }
+        work->rWeight = capture_arg(args, 0)->NumberValue();
+        work->gWeight = capture_arg(args, 1)->NumberValue();
+        work->bWeight = capture_arg(args, 2)->NumberValue();
+        if ((kind == CaptureWork::FIND_BLOBS || kind == CaptureWork::TRACK) &&
+            !capture_arg(args, 3)->IsUndefined()) {
+            work->minArea = capture_arg(args, 3)->Uint32Value();
+        }
+        break;
+    case CaptureWork::FIND_BRIGHT:
+        work->rect = sState->lumaWindow();
+        work->threshold = capture_arg(args, 0)->NumberValue();
+        break;
+    case CaptureWork::ANALYZE:
+        parse_analyze_options(capture_arg(args, 0), work->analyzeOptions);
+        work->target.Reset(isolate,
+                           sample_target(kind, capture_arg(args, 0)));
+        break;
+    case CaptureWork::REGION_MEANS:
+        work->rects = parse_rects(capture_arg(args, 0), work->rectCount);
+        work->rect = sState->regionBounds(work->rects, work->rectCount);
+        work->target.Reset(isolate, capture_arg(args, 1));
+        break;
+    case CaptureWork::TARE:
+    case CaptureWork::STATS:
+        break;
+    }
+    work->buffer = NULL;
+    work->size = 0;
+    work->callback.Reset(isolate, Local<Function>::Cast(args[argc - 1]));
+
+    if (sOutstanding++ == 0) {
+        uv_ref(reinterpret_cast<uv_handle_t*>(&sCaptureAsync));
+    }
+    if (!sState->requestCapture(CaptureWorkParams(work),
+                                CaptureWorkCaptured, work)) {
+        // Delivered as a failed capture
+        CaptureWorkCaptured(work, NULL, 0);
+    }
+    return true;
+}
+
 static void Tare(const FunctionCallbackInfo<Value>& args) {
-    sState->tare();
+    if (!QueueCapture(args, CaptureWork::TARE)) {
+        sState->tare();
+    }
+    args.GetReturnValue().Set(args.This());
+}
+
+static void PinReference(const FunctionCallbackInfo<Value>& args) {
+    sState->pinReference(args.Length() == 0 || args[0]->BooleanValue());
     args.GetReturnValue().Set(args.This());
 }
 
 static void SetData(const FunctionCallbackInfo<Value>& args) {
   Isolate *isolate = args.GetIsolate();
   Handle<Value> arg0 = args[0];
+  Handle<Value> arg1 = args[1];
 
-  if (! arg0->IsArray()) {
-      args.GetReturnValue().Set(Boolean::New(isolate, false));
-    return;
-  }
-
-  sState->setData(isolate, Handle<Array>::Cast(arg0));
-
-  args.GetReturnValue().Set(Boolean::New(isolate, true));
+  args.GetReturnValue().Set(Boolean::New(isolate,
+                                         sState->setData(isolate, arg0,
+                                                         arg1)));
 }
 
 static void Sample(const FunctionCallbackInfo<Value>& args) {
-    args.GetReturnValue().Set(sState->sample(args.GetIsolate()));
+    if (QueueCapture(args, CaptureWork::SAMPLE)) {
+        return;
+    }
+    args.GetReturnValue().Set(sState->sample(args.GetIsolate(), args[0]));
+}
+
+static void SampleGPU(const FunctionCallbackInfo<Value>& args) {
+    if (QueueCapture(args, CaptureWork::SAMPLE_GPU)) {
+        return;
+    }
+    args.GetReturnValue().Set(sState->sampleGPU(args.GetIsolate(), args[0]));
 }
 
 static void Find(const FunctionCallbackInfo<Value>& args) {
     double x, y;
 
+    if (QueueCapture(args, CaptureWork::FIND)) {
+        return;
+    }
+
     if (sState->find(args[0]->NumberValue(),
                      args[1]->NumberValue(),
                      args[2]->NumberValue(),
@@ -831,14 +2289,190 @@ static void Find(const FunctionCallbackInfo<Value>& args) {
     }
 }
 
+static void FindBlobs(const FunctionCallbackInfo<Value>& args) {
+    if (QueueCapture(args, CaptureWork::FIND_BLOBS)) {
+        return;
+    }
+
+    uint32_t minArea = args[3]->IsUndefined() ? FIND_BLOBS_MIN_AREA :
+                                                args[3]->Uint32Value();
+    args.GetReturnValue().Set(sState->findBlobs(args.GetIsolate(),
+                                                args[0]->NumberValue(),
+                                                args[1]->NumberValue(),
+                                                args[2]->NumberValue(),
+                                                minArea));
+}
+
+static void Track(const FunctionCallbackInfo<Value>& args) {
+    if (QueueCapture(args, CaptureWork::TRACK)) {
+        return;
+    }
+
+    uint32_t minArea = args[3]->IsUndefined() ? FIND_BLOBS_MIN_AREA :
+                                                args[3]->Uint32Value();
+    args.GetReturnValue().Set(sState->track(args.GetIsolate(),
+                                            args[0]->NumberValue(),
+                                            args[1]->NumberValue(),
+                                            args[2]->NumberValue(),
+                                            minArea));
+}
+
+// Takes {gate, birthHits, deathMisses}, each defaulting as BlobTracker's
+// constructor does.
+static void ResetTracks(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    double gate = 40;
+    uint32_t birthHits = 3;
+    uint32_t deathMisses = 5;
+
+    if (args[0]->IsObject()) {
+        Handle<Object> options = Handle<Object>::Cast(args[0]);
+        Handle<Value> value = options->Get(String::NewFromUtf8(isolate,
+                                                               "gate"));
+        if (value->IsNumber()) {
+            gate = value->NumberValue();
+        }
+        value = options->Get(String::NewFromUtf8(isolate, "birthHits"));
+        if (value->IsNumber()) {
+            birthHits = value->Uint32Value();
+        }
+        value = options->Get(String::NewFromUtf8(isolate, "deathMisses"));
+        if (value->IsNumber()) {
+            deathMisses = value->Uint32Value();
+        }
+    }
+
+    sState->resetTracks(gate, birthHits, deathMisses);
+    args.GetReturnValue().Set(args.This());
+}
+
+static void BackgroundModel(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    bool enabled = args.Length() == 0 || args[0]->BooleanValue();
+    double floor = BACKGROUND_FLOOR;
+    double sigmas = BACKGROUND_SIGMAS;
+    uint32_t rate = BACKGROUND_RATE;
+
+    if (args[0]->IsObject()) {
+        Handle<Object> options = Handle<Object>::Cast(args[0]);
+        Handle<Value> value = options->Get(String::NewFromUtf8(isolate,
+                                                               "floor"));
+        if (value->IsNumber()) {
+            floor = value->NumberValue();
+        }
+        value = options->Get(String::NewFromUtf8(isolate, "sigmas"));
+        if (value->IsNumber()) {
+            sigmas = value->NumberValue();
+        }
+        value = options->Get(String::NewFromUtf8(isolate, "rate"));
+        if (value->IsNumber()) {
+            rate = value->Uint32Value();
+        }
+    }
+
+    sState->backgroundModel(enabled, floor, sigmas, rate);
+    args.GetReturnValue().Set(args.This());
+}
+
+static void AdaptiveWindow(const FunctionCallbackInfo<Value>& args) {
+    sState->adaptiveWindow(args.Length() == 0 || args[0]->BooleanValue());
+    args.GetReturnValue().Set(args.This());
+}
+
+static void FindBright(const FunctionCallbackInfo<Value>& args) {
+    double x, y;
+
+    if (QueueCapture(args, CaptureWork::FIND_BRIGHT)) {
+        return;
+    }
+
+    if (sState->findBright(args[0]->NumberValue(), x, y)) {
+        Isolate *isolate = args.GetIsolate();
+        Handle<Array> xy = Array::New(isolate, 2);
+        xy->Set(0, Number::New(isolate, x));
+        xy->Set(1, Number::New(isolate, y));
+        args.GetReturnValue().Set(xy);
+    }
+}
+
+static void FindMask(const FunctionCallbackInfo<Value>& args) {
+    double x, y;
+
+    if (QueueCapture(args, CaptureWork::FIND_MASK)) {
+        return;
+    }
+
+    if (sState->findMask(args[0]->NumberValue(),
+                         args[1]->NumberValue(),
+                         args[2]->NumberValue(),
+                         x, y)) {
+        Isolate *isolate = args.GetIsolate();
+        Handle<Array> xy = Array::New(isolate, 2);
+        xy->Set(0, Number::New(isolate, x));
+        xy->Set(1, Number::New(isolate, y));
+        args.GetReturnValue().Set(xy);
+    }
+}
+
+static void FindGPU(const FunctionCallbackInfo<Value>& args) {
+    double x, y;
+
+    if (QueueCapture(args, CaptureWork::FIND_GPU)) {
+        return;
+    }
+
+    if (sState->findGPU(args[0]->NumberValue(),
+                        args[1]->NumberValue(),
+                        args[2]->NumberValue(),
+                        x, y)) {
+        Isolate *isolate = args.GetIsolate();
+        Handle<Array> xy = Array::New(isolate, 2);
+        xy->Set(0, Number::New(isolate, x));
+        xy->Set(1, Number::New(isolate, y));
+        args.GetReturnValue().Set(xy);
+    }
+}
+
+static void Analyze(const FunctionCallbackInfo<Value>& args) {
+    if (QueueCapture(args, CaptureWork::ANALYZE)) {
+        return;
+    }
+
+    OffGrid::AnalyzeOptions options;
+    parse_analyze_options(args[0], options);
+    args.GetReturnValue().Set(sState->analyze(
+        args.GetIsolate(), options,
+        sample_target(CaptureWork::ANALYZE, args[0])));
+}
+
+static void Stats(const FunctionCallbackInfo<Value>& args) {
+    if (QueueCapture(args, CaptureWork::STATS)) {
+        return;
+    }
+
+    args.GetReturnValue().Set(sState->stats(args.GetIsolate()));
+}
+
+static void RegionMeans(const FunctionCallbackInfo<Value>& args) {
+    if (QueueCapture(args, CaptureWork::REGION_MEANS)) {
+        return;
+    }
+
+    size_t count = 0;
+    uint32_t *rects = parse_rects(args[0], count);
+    args.GetReturnValue().Set(sState->regionMeans(args.GetIsolate(), rects,
+                                                  count, args[1]));
+    delete[] rects;
+}
+
 static void Width(const FunctionCallbackInfo<Value>& args) {
     args.GetReturnValue().Set(Integer::New(args.GetIsolate(),
-                                           sState->raspitex_state.width));
+                                           sState->width));
 }
 
 static void Height(const FunctionCallbackInfo<Value>& args) {
     args.GetReturnValue().Set(Integer::New(args.GetIsolate(),
-                                           sState->raspitex_state.height));
+                                           sState->height));
 }
 
 static void Save(const FunctionCallbackInfo<Value>& args) {
@@ -849,14 +2483,82 @@ static void Save(const FunctionCallbackInfo<Value>& args) {
     args.GetReturnValue().Set(args.This());
 }
 
+static void PoolStats(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    RASPITEX_BUFFER_POOL *pool = &sState->raspitex_state.pool;
+    Handle<Object> stats = Object::New(isolate);
+
+    vcos_mutex_lock(&pool->lock);
+    stats->Set(String::NewFromUtf8(isolate, "count"),
+               Integer::New(isolate, pool->count));
+    stats->Set(String::NewFromUtf8(isolate, "acquired"),
+               Number::New(isolate, pool->acquired));
+    stats->Set(String::NewFromUtf8(isolate, "exhausted"),
+               Number::New(isolate, pool->exhausted));
+    stats->Set(String::NewFromUtf8(isolate, "outstanding"),
+               Number::New(isolate, pool->outstanding));
+    stats->Set(String::NewFromUtf8(isolate, "highWater"),
+               Number::New(isolate, pool->high_water));
+    vcos_mutex_unlock(&pool->lock);
+
+    args.GetReturnValue().Set(stats);
+}
+
+// The instruction set the CPU kernels were chosen for, e.g. "neon".
+static void KernelISA(const FunctionCallbackInfo<Value>& args) {
+    args.GetReturnValue().Set(String::NewFromUtf8(args.GetIsolate(),
+                                                  kernels().isa));
+}
+
+// How many threads, including the caller's, split find() and sample().
+static void Threads(const FunctionCallbackInfo<Value>& args) {
+    args.GetReturnValue().Set(Integer::New(args.GetIsolate(),
+                                           sState->threads()));
+}
+
+static void CaptureStats(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    RASPITEX_CAPTURE *capture = &sState->raspitex_state.capture;
+    Handle<Object> stats = Object::New(isolate);
+
+    vcos_mutex_lock(&capture->lock);
+    stats->Set(String::NewFromUtf8(isolate, "frame"),
+               Number::New(isolate, capture->frame));
+    stats->Set(String::NewFromUtf8(isolate, "hits"),
+               Number::New(isolate, capture->cache_hits));
+    stats->Set(String::NewFromUtf8(isolate, "crops"),
+               Number::New(isolate, capture->cache_crops));
+    stats->Set(String::NewFromUtf8(isolate, "misses"),
+               Number::New(isolate, capture->cache_misses));
+    vcos_mutex_unlock(&capture->lock);
+
+    args.GetReturnValue().Set(stats);
+}
+
 static void cleanup(void*) {
     delete sState;
 }
 
+// Appends option and the value of the environment variable name, if it
+// is set, so GL options can be given without a command line.
+static void env_option(std::vector<const char *> &argv, const char *name,
+                       const char *option) {
+    const char *value = getenv(name);
+    if (value && *value) {
+        argv.push_back(option);
+        argv.push_back(value);
+    }
+}
+
 void init(Handle<Object> target) {
     sState = new OffGrid();
 
-    const char *argv[] = {
+    // OFFGRID_GLWIN (x,y,w,h) and OFFGRID_GLSCALE override the GL window
+    // and downscale captures by a power of two, as --glwin and --glscale,
+    // and OFFGRID_GLBUFFERS sizes the capture buffer pool (see
+    // poolStats()), as --glbuffers. Later options win, so they follow the
+    // defaults.
+    const char *defaults[] = {
       "offgrid",
       "--glscene", "sobel",
       "--width", "1600",
@@ -864,17 +2566,44 @@ void init(Handle<Object> target) {
       "--hflip", "--vflip",
       "--glwin", "0,0,1600,1200"
     };
-    sState->init(11, argv);
+    std::vector<const char *> argv(defaults, defaults + 11);
+    env_option(argv, "OFFGRID_GLWIN", "--glwin");
+    env_option(argv, "OFFGRID_GLSCALE", "--glscale");
+    env_option(argv, "OFFGRID_GLBUFFERS", "--glbuffers");
+    sState->init(argv.size(), &argv[0]);
+
+    // Only referenced while captures are outstanding, so an idle camera
+    // does not keep the process alive.
+    uv_mutex_init(&sCompletedLock);
+    uv_async_init(uv_default_loop(), &sCaptureAsync, CaptureWorkDeliver);
+    uv_unref(reinterpret_cast<uv_handle_t*>(&sCaptureAsync));
 
     node::AtExit(cleanup);
 
     NODE_SET_METHOD(target, "tare", Tare);
+    NODE_SET_METHOD(target, "pinReference", PinReference);
     NODE_SET_METHOD(target, "setData", SetData);
     NODE_SET_METHOD(target, "sample", Sample);
+    NODE_SET_METHOD(target, "sampleGPU", SampleGPU);
     NODE_SET_METHOD(target, "find", Find);
+    NODE_SET_METHOD(target, "findBlobs", FindBlobs);
+    NODE_SET_METHOD(target, "track", Track);
+    NODE_SET_METHOD(target, "resetTracks", ResetTracks);
+    NODE_SET_METHOD(target, "adaptiveWindow", AdaptiveWindow);
+    NODE_SET_METHOD(target, "backgroundModel", BackgroundModel);
+    NODE_SET_METHOD(target, "findBright", FindBright);
+    NODE_SET_METHOD(target, "findMask", FindMask);
+    NODE_SET_METHOD(target, "findGPU", FindGPU);
+    NODE_SET_METHOD(target, "analyze", Analyze);
+    NODE_SET_METHOD(target, "stats", Stats);
+    NODE_SET_METHOD(target, "regionMeans", RegionMeans);
     NODE_SET_METHOD(target, "save", Save);
     NODE_SET_METHOD(target, "width", Width);
     NODE_SET_METHOD(target, "height", Height);
+    NODE_SET_METHOD(target, "poolStats", PoolStats);
+    NODE_SET_METHOD(target, "captureStats", CaptureStats);
+    NODE_SET_METHOD(target, "kernelISA", KernelISA);
+    NODE_SET_METHOD(target, "threads", Threads);
 }
 
 NODE_MODULE(offgrid, init);
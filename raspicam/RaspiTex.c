@@ -38,6 +38,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <GLES/gl.h>
 #include <GLES/glext.h>
 #include "RaspiTexUtil.h"
+#include "RaspiTexCapture.h"
 #include "interface/vcos/vcos.h"
 #include "interface/mmal/mmal_buffer.h"
 #include "interface/mmal/util/mmal_util.h"
@@ -94,11 +95,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define CommandGLScene   1
 #define CommandGLWin     2
+#define CommandGLBuffers 3
+#define CommandGLScale   4
 
 static COMMAND_LIST cmdline_commands[] =
 {
    { CommandGLScene, "-glscene",  "gs",  "GL scene square,showtime,sobel,calibration,animation", 1 },
    { CommandGLWin,   "-glwin",    "gw",  "GL window settings <'x,y,w,h'>", 1 },
+   { CommandGLBuffers, "-glbuffers", "gb", "Number of pooled capture buffers <n>", 1 },
+   { CommandGLScale, "-glscale",  "gsc", "Capture at 1/n of the GL window size, n = 1,2,4,8,16 (GLES2 scenes)", 1 },
 };
 
 static int cmdline_commands_size = sizeof(cmdline_commands) / sizeof(cmdline_commands[0]);
@@ -167,6 +172,32 @@ int raspitex_parse_cmdline(RASPITEX_STATE *state,
          used = 2;
          break;
       }
+
+      case CommandGLBuffers: // Size of the capture buffer pool
+      {
+         int count;
+         if (sscanf(arg2, "%d", &count) == 1 &&
+               count > 0 && count <= RASPITEX_POOL_MAX_COUNT)
+            state->pool.count = count;
+         else
+            vcos_log_error("Invalid buffer count %s", arg2);
+
+         used = 2;
+         break;
+      }
+
+      case CommandGLScale: // Downscaled capture target
+      {
+         int scale;
+         if (sscanf(arg2, "%d", &scale) == 1 && scale > 0 &&
+               scale <= RASPITEXCAPTURE_MAX_SCALE && (scale & (scale - 1)) == 0)
+            state->capture_scale = scale;
+         else
+            vcos_log_error("Invalid capture scale %s", arg2);
+
+         used = 2;
+         break;
+      }
    }
    return used;
 }
@@ -206,32 +237,243 @@ static void update_fps()
    }
 }
 
+/* Whether two capture requests can share a capture. Params are zeroed
+ * before being filled in, so they can be compared bytewise. */
+static int same_params(const RASPITEX_CAPTURE_REQUEST *a,
+      const RASPITEX_CAPTURE_REQUEST *b)
+{
+   return memcmp(&a->params, &b->params, sizeof(a->params)) == 0;
+}
+
+/* Whether a capture can be shared with later requests for the same frame.
+ * Captures that read or update the GPU reference frame depend on the
+ * order of the requests, so they are never cached. */
+static int cacheable(const RASPITEX_CAPTURE_PARAMS *params)
+{
+   return params->flags == 0;
+}
+
+/* Drops every cached capture not taken from the current frame. Call with
+ * capture.lock held. */
+static void cache_evict_stale(RASPITEX_STATE *state)
+{
+   RASPITEX_CAPTURE *capture = &state->capture;
+   int i;
+
+   for (i = 0; i < RASPITEX_CAPTURE_CACHE_SIZE; i++)
+   {
+      RASPITEX_CAPTURE_CACHE_ENTRY *entry = &capture->cache[i];
+      if (entry->buffer && entry->frame != capture->frame)
+      {
+         raspitex_release_buffer(state, entry->buffer);
+         entry->buffer = NULL;
+      }
+   }
+}
+
 /**
- * Captures the frame-buffer if requested.
+ * Keeps a reference to a capture of the current frame for later requests
+ * with the same params. Call with capture.lock held.
+ * @param state Pointer to the GL preview state.
+ * @param params What was captured.
+ * @param points_serial The points a POINTS capture gathered.
+ * @param buffer The capture, which gains a reference.
+ * @param size Size of the capture in bytes.
+ */
+static void cache_store(RASPITEX_STATE *state,
+      const RASPITEX_CAPTURE_PARAMS *params, unsigned points_serial,
+      uint8_t *buffer, size_t size)
+{
+   RASPITEX_CAPTURE *capture = &state->capture;
+   RASPITEX_CAPTURE_CACHE_ENTRY *entry = NULL;
+   int i;
+
+   if (! cacheable(params))
+      return;
+
+   cache_evict_stale(state);
+
+   for (i = 0; i < RASPITEX_CAPTURE_CACHE_SIZE && ! entry; i++)
+   {
+      if (! capture->cache[i].buffer)
+         entry = &capture->cache[i];
+   }
+   if (! entry)
+   {
+      entry = &capture->cache[capture->cache_next];
+      capture->cache_next =
+         (capture->cache_next + 1) % RASPITEX_CAPTURE_CACHE_SIZE;
+      raspitex_release_buffer(state, entry->buffer);
+   }
+
+   raspitex_retain_buffer(state, buffer, 1);
+   memcpy(&entry->params, params, sizeof(*params));
+   entry->buffer = buffer;
+   entry->size = size;
+   entry->frame = capture->frame;
+   entry->points_serial = points_serial;
+}
+
+/**
+ * Looks for a capture of the current frame that can serve params: either
+ * one with the same params, or for BGRA regions a whole-frame BGRA
+ * capture to cut them from. Call with capture.lock held.
+ * @param state Pointer to the GL preview state.
+ * @param params What to capture.
+ * @return The entry, or NULL if there is none.
+ */
+static RASPITEX_CAPTURE_CACHE_ENTRY *cache_lookup(RASPITEX_STATE *state,
+      const RASPITEX_CAPTURE_PARAMS *params)
+{
+   RASPITEX_CAPTURE *capture = &state->capture;
+   RASPITEX_CAPTURE_CACHE_ENTRY *whole = NULL;
+   int i;
+
+   if (! cacheable(params))
+      return NULL;
+
+   for (i = 0; i < RASPITEX_CAPTURE_CACHE_SIZE; i++)
+   {
+      RASPITEX_CAPTURE_CACHE_ENTRY *entry = &capture->cache[i];
+      if (! entry->buffer || entry->frame != capture->frame)
+         continue;
+
+      if (params->mode == RASPITEX_CAPTURE_POINTS &&
+            entry->points_serial != capture->points_serial)
+         continue;
+
+      if (memcmp(&entry->params, params, sizeof(*params)) == 0)
+         return entry;
+
+      if (params->mode == RASPITEX_CAPTURE_BGRA &&
+            entry->params.mode == RASPITEX_CAPTURE_BGRA &&
+            entry->params.num_rects == 0)
+         whole = entry;
+   }
+
+   return params->num_rects > 0 ? whole : NULL;
+}
+
+/**
+ * Copies BGRA regions out of a whole-frame BGRA capture, packed as
+ * raspitexutil_capture would have read them back.
+ * @param state Pointer to the GL preview state.
+ * @param frame The whole-frame capture.
+ * @param params The regions to copy.
+ * @param sizep Set to the size of the copy in bytes.
+ * @return A new buffer for the caller, or NULL on failure.
+ */
+static uint8_t *crop_capture(RASPITEX_STATE *state, const uint8_t *frame,
+      const RASPITEX_CAPTURE_PARAMS *params, size_t *sizep)
+{
+   size_t stride = state->capture_frame.capture_width * 4;
+   size_t size = 0;
+   uint8_t *buffer, *out;
+   int i, row;
+
+   for (i = 0; i < params->num_rects; i++)
+   {
+      const RASPITEX_RECT *r = &params->rects[i];
+      if (r->x < 0 || r->y < 0 || r->width < 0 || r->height < 0 ||
+            r->x + r->width > state->capture_frame.capture_width ||
+            r->y + r->height > state->capture_frame.capture_height)
+         return NULL;
+      size += r->width * r->height * 4;
+   }
+
+   buffer = raspitex_acquire_buffer(state, size);
+   if (! buffer)
+      return NULL;
+
+   out = buffer;
+   for (i = 0; i < params->num_rects; i++)
+   {
+      const RASPITEX_RECT *r = &params->rects[i];
+      for (row = 0; row < r->height; row++)
+      {
+         memcpy(out, frame + (r->y + row) * stride + r->x * 4, r->width * 4);
+         out += r->width * 4;
+      }
+   }
+
+   *sizep = size;
+   return buffer;
+}
+
+/**
+ * Captures the frame-buffer if requested. Every request pending at this
+ * redraw with the same params is satisfied by a single capture, and each
+ * requester receives its own reference to the shared buffer.
  * @param state RASPITEX STATE
- * @return Zero if successful.
  */
 static void raspitex_do_capture(RASPITEX_STATE *state)
 {
-   uint8_t *buffer = NULL;
-   size_t size = 0;
+   RASPITEX_CAPTURE_REQUEST *requests, *request, *next;
+   RASPITEX_CAPTURE_REQUEST *first, *batch, **link;
+
+   vcos_mutex_lock(&state->capture.lock);
+   requests = state->capture.pending;
+   state->capture.pending = NULL;
+   vcos_mutex_unlock(&state->capture.lock);
 
-   if (state->capture.request)
+   while (requests)
    {
-      if (state->ops.capture(state, &buffer, &size) == 0)
+      uint8_t *buffer = NULL;
+      size_t size = 0;
+      unsigned points_serial;
+      int count = 0;
+
+      /* Move every request matching the first one into the batch */
+      batch = NULL;
+      link = &requests;
+      first = requests;
+      while ((request = *link) != NULL)
       {
-         /* Pass ownership of buffer to main thread via capture state */
-         state->capture.buffer = buffer;
-         state->capture.size = size;
+         if (same_params(request, first))
+         {
+            *link = request->next;
+            request->next = batch;
+            batch = request;
+            count++;
+         }
+         else
+         {
+            link = &request->next;
+         }
+      }
+
+      vcos_mutex_lock(&state->capture.lock);
+      points_serial = state->capture.points_serial;
+      vcos_mutex_unlock(&state->capture.lock);
+
+      if (state->ops.capture(state, &batch->params, &buffer, &size) == 0)
+      {
+         raspitex_retain_buffer(state, buffer, count - 1);
+
+         vcos_mutex_lock(&state->capture.lock);
+         cache_store(state, &batch->params, points_serial, buffer, size);
+         vcos_mutex_unlock(&state->capture.lock);
       }
       else
       {
-         state->capture.buffer = NULL; // Null indicates an error
-         state->capture.size = 0;
+         buffer = NULL; // Null indicates an error
+         size = 0;
       }
 
-      state->capture.request = 0; // Always clear request and post sem
-      vcos_semaphore_post(&state->capture.completed_sem);
+      /* The requester may return as soon as its sem is posted */
+      for (request = batch; request; request = next)
+      {
+         next = request->next;
+         if (request->callback)
+         {
+            request->callback(request->context, buffer, size);
+            free(request);
+            continue;
+         }
+         request->buffer = buffer;
+         request->size = size;
+         vcos_semaphore_post(&request->completed_sem);
+      }
    }
 }
 
@@ -319,6 +561,12 @@ static int raspitex_draw(RASPITEX_STATE *state, MMAL_BUFFER_HEADER_T *buf)
          mmal_buffer_header_release(state->preview_buf);
 
       state->preview_buf = buf;
+
+      /* Captures of the previous frame can no longer be shared */
+      vcos_mutex_lock(&state->capture.lock);
+      state->capture.frame++;
+      cache_evict_stale(state);
+      vcos_mutex_unlock(&state->capture.lock);
    }
 
    /*  Do the drawing */
@@ -433,6 +681,7 @@ end:
       mmal_buffer_header_release(buf);
 
    /* Tear down GL */
+   raspitexcapture_gl_term(&state->capture_frame);
    state->ops.gl_term(state);
    vcos_log_trace("Exiting preview worker");
    return NULL;
@@ -564,6 +813,62 @@ static int open_scene(RASPITEX_STATE *state) {
   return -1;
 }
 
+/* Allocates the capture buffer pool. Each buffer is large enough for a
+ * full frame-buffer readback at the GL window size.
+ * @param state Pointer to the GL preview state.
+ * @return Zero if successful.
+ */
+static int create_buffer_pool(RASPITEX_STATE *state)
+{
+   RASPITEX_BUFFER_POOL *pool = &state->pool;
+   int i;
+
+   if (vcos_mutex_create(&pool->lock, "glcap_pool_lock") != VCOS_SUCCESS)
+      return -1;
+
+   pool->buffer_size = state->width * state->height * 4;
+
+   for (i = 0; i < pool->count; i++)
+   {
+      void *buffer = NULL;
+      if (posix_memalign(&buffer, RASPITEX_POOL_ALIGNMENT,
+               pool->buffer_size) != 0)
+      {
+         vcos_log_error("%s: Failed to allocate buffer %d", VCOS_FUNCTION, i);
+         while (i-- > 0)
+         {
+            free(pool->buffers[i]);
+            pool->buffers[i] = NULL;
+         }
+         vcos_mutex_delete(&pool->lock);
+         return -1;
+      }
+      pool->buffers[i] = buffer;
+      pool->refs[i] = 0;
+   }
+
+   return 0;
+}
+
+/* Frees the capture buffer pool. Buffers that are still lent out are
+ * freed too, so this must only be called once the consumers are done.
+ * @param state Pointer to the GL preview state.
+ */
+static void destroy_buffer_pool(RASPITEX_STATE *state)
+{
+   RASPITEX_BUFFER_POOL *pool = &state->pool;
+   int i;
+
+   for (i = 0; i < pool->count; i++)
+   {
+      free(pool->buffers[i]);
+      pool->buffers[i] = NULL;
+      pool->refs[i] = 0;
+   }
+
+   vcos_mutex_delete(&pool->lock);
+}
+
 /* Initialises GL preview state and creates the dispmanx native window.
  * @param state Pointer to the GL preview state.
  * @return Zero if successful.
@@ -579,22 +884,27 @@ int raspitex_init(RASPITEX_STATE *state)
          state->verbose ? VCOS_LOG_INFO : VCOS_LOG_WARN);
    vcos_log_trace("%s", VCOS_FUNCTION);
 
-   status = vcos_semaphore_create(&state->capture.start_sem,
-         "glcap_start_sem", 1);
+   status = vcos_mutex_create(&state->capture.lock, "glcap_lock");
    if (status != VCOS_SUCCESS)
       goto error;
 
-   status = vcos_semaphore_create(&state->capture.completed_sem,
-         "glcap_completed_sem", 0);
-   if (status != VCOS_SUCCESS)
-      goto error;
+   raspitexcapture_frame_init(&state->capture_frame, state->width,
+         state->height, state->capture_scale);
+
+   rc = create_buffer_pool(state);
+   if (rc != 0)
+      goto error_pool;
 
    rc = open_scene(state);
    if (rc != 0)
-      goto error;
+      goto error_scene;
 
    return 0;
 
+error_scene:
+   destroy_buffer_pool(state);
+error_pool:
+   vcos_mutex_delete(&state->capture.lock);
 error:
    vcos_log_error("%s: failed", VCOS_FUNCTION);
    return -1;
@@ -624,8 +934,15 @@ void raspitex_destroy(RASPITEX_STATE *state)
    if (state->ops.close)
       state->ops.close(state);
 
-   vcos_semaphore_delete(&state->capture.start_sem);
-   vcos_semaphore_delete(&state->capture.completed_sem);
+   /* A frame number no entry has, so every entry is dropped */
+   state->capture.frame++;
+   cache_evict_stale(state);
+
+   vcos_mutex_delete(&state->capture.lock);
+   free(state->capture.points);
+   state->capture.points = NULL;
+   state->capture.num_points = 0;
+   destroy_buffer_pool(state);
 }
 
 /* Initialise the GL / window state to sensible defaults.
@@ -650,12 +967,14 @@ void raspitex_set_defaults(RASPITEX_STATE *state)
    state->width = DEFAULT_WIDTH;
    state->height = DEFAULT_HEIGHT;
    state->scene_id = RASPITEX_SCENE_SQUARE;
+   state->pool.count = RASPITEX_POOL_DEFAULT_COUNT;
+   state->capture_scale = 1;
 
    state->ops.create_native_window = raspitexutil_create_native_window;
    state->ops.gl_init = raspitexutil_gl_init_1_0;
    state->ops.update_model = raspitexutil_update_model;
    state->ops.redraw = raspitexutil_redraw;
-   state->ops.capture = raspitexutil_capture_bgra;
+   state->ops.capture = raspitexutil_capture;
    state->ops.gl_term = raspitexutil_gl_term;
    state->ops.destroy_native_window = raspitexutil_destroy_native_window;
    state->ops.close = raspitexutil_close;
@@ -716,39 +1035,360 @@ int raspitex_start(RASPITEX_STATE *state)
    return (status == VCOS_SUCCESS ? 0 : -1);
 }
 
+/* Unpooled buffers carry their reference count in a header that keeps
+ * the returned pointer aligned. */
+#define UNPOOLED_HEADER_SIZE RASPITEX_POOL_ALIGNMENT
+
+/* Finds the pool slot for buffer.
+ * @return The slot index, or -1 if the buffer is not pooled.
+ */
+static int pool_slot(RASPITEX_BUFFER_POOL *pool, const uint8_t *buffer)
+{
+   int i;
+   for (i = 0; i < pool->count; i++)
+   {
+      if (pool->buffers[i] == buffer)
+         return i;
+   }
+   return -1;
+}
+
+/**
+ * Borrows a capture buffer of at least size bytes from the pool. When the
+ * pool is exhausted, or the request is larger than a pooled buffer, an
+ * unpooled buffer is allocated instead and the exhausted counter bumped.
+ * @param state Pointer to the GL preview state.
+ * @param size Minimum size of the buffer in bytes.
+ * @return The buffer, or NULL if an unpooled allocation failed. The buffer
+ *         starts with one reference and must be returned with
+ *         raspitex_release_buffer.
+ */
+uint8_t *raspitex_acquire_buffer(RASPITEX_STATE *state, size_t size)
+{
+   RASPITEX_BUFFER_POOL *pool = &state->pool;
+   void *buffer = NULL;
+   int i;
+
+   vcos_mutex_lock(&pool->lock);
+
+   if (size <= pool->buffer_size)
+   {
+      for (i = 0; i < pool->count; i++)
+      {
+         if (pool->refs[i] == 0)
+         {
+            pool->refs[i] = 1;
+            buffer = pool->buffers[i];
+            break;
+         }
+      }
+   }
+
+   if (! buffer)
+      pool->exhausted++;
+
+   pool->acquired++;
+   if (++pool->outstanding > pool->high_water)
+      pool->high_water = pool->outstanding;
+
+   vcos_mutex_unlock(&pool->lock);
+
+   if (! buffer)
+   {
+      if (posix_memalign(&buffer, RASPITEX_POOL_ALIGNMENT,
+               UNPOOLED_HEADER_SIZE + size) != 0)
+      {
+         vcos_mutex_lock(&pool->lock);
+         pool->outstanding--;
+         vcos_mutex_unlock(&pool->lock);
+         return NULL;
+      }
+
+      *(int *) buffer = 1;
+      buffer = (uint8_t *) buffer + UNPOOLED_HEADER_SIZE;
+   }
+
+   return buffer;
+}
+
+/**
+ * Adds references to a buffer so that it can be handed to several
+ * consumers, each of which calls raspitex_release_buffer once.
+ * @param state Pointer to the GL preview state.
+ * @param buffer A buffer from raspitex_acquire_buffer.
+ * @param count Number of references to add.
+ */
+void raspitex_retain_buffer(RASPITEX_STATE *state, uint8_t *buffer, int count)
+{
+   RASPITEX_BUFFER_POOL *pool = &state->pool;
+   int slot;
+
+   if (! buffer || count <= 0)
+      return;
+
+   vcos_mutex_lock(&pool->lock);
+
+   slot = pool_slot(pool, buffer);
+   if (slot >= 0)
+      pool->refs[slot] += count;
+   else
+      *(int *) (buffer - UNPOOLED_HEADER_SIZE) += count;
+
+   vcos_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Drops a reference to a buffer obtained from raspitex_acquire_buffer
+ * (directly or via raspitex_capture_to_buffer). The buffer returns to the
+ * pool once the last reference is dropped. NULL is ignored.
+ * @param state Pointer to the GL preview state.
+ * @param buffer The buffer to return.
+ */
+void raspitex_release_buffer(RASPITEX_STATE *state, uint8_t *buffer)
+{
+   RASPITEX_BUFFER_POOL *pool = &state->pool;
+   int *refs;
+   int slot;
+   int last;
+
+   if (! buffer)
+      return;
+
+   vcos_mutex_lock(&pool->lock);
+
+   slot = pool_slot(pool, buffer);
+   refs = slot >= 0 ? &pool->refs[slot] :
+      (int *) (buffer - UNPOOLED_HEADER_SIZE);
+   last = (--*refs == 0);
+   if (last)
+      pool->outstanding--;
+
+   vcos_mutex_unlock(&pool->lock);
+
+   if (last && slot < 0)
+      free(buffer - UNPOOLED_HEADER_SIZE);
+}
+
+/**
+ * Waits for the next redraw and returns the captured frame-buffer.
+ * Concurrent callers are satisfied by the same capture and share the
+ * returned buffer, which must therefore be treated as read-only.
+ * @param state Pointer to the GL preview state.
+ * @param sizep Set to the size of the captured data in bytes.
+ * @return The capture buffer, or NULL on failure. Each caller must return
+ *         it with raspitex_release_buffer.
+ */
 uint8_t *raspitex_capture_to_buffer(RASPITEX_STATE *state, size_t *sizep) {
-  uint8_t *buffer = NULL;
+  return raspitex_capture_rects_to_buffer(state, NULL, 0, sizep);
+}
+
+/**
+ * As raspitex_capture_to_buffer, but only reads back the given regions of
+ * the frame-buffer. The regions are packed one after another, each as
+ * width * height BGRA pixels in bottom-up row order.
+ * @param state Pointer to the GL preview state.
+ * @param rects The regions to read. NULL for the whole frame-buffer.
+ * @param num_rects Number of regions, at most RASPITEX_MAX_RECTS.
+ * @param sizep Set to the size of the captured data in bytes.
+ * @return The capture buffer, or NULL on failure.
+ */
+uint8_t *raspitex_capture_rects_to_buffer(RASPITEX_STATE *state,
+      const RASPITEX_RECT *rects, int num_rects, size_t *sizep) {
+  RASPITEX_CAPTURE_PARAMS params;
+
   *sizep = 0;
+  if (num_rects < 0 || num_rects > RASPITEX_MAX_RECTS ||
+      (num_rects > 0 && !rects)) {
+    vcos_log_error("%s: invalid regions", VCOS_FUNCTION);
+    return NULL;
+  }
 
-  if (state) {
-    /* Only request one capture at a time */
-    vcos_semaphore_wait(&state->capture.start_sem);
-    state->capture.request = 1;
+  memset(&params, 0, sizeof(params));
+  params.mode = RASPITEX_CAPTURE_BGRA;
+  if (num_rects > 0)
+    memcpy(params.rects, rects, num_rects * sizeof(rects[0]));
+  params.num_rects = num_rects;
+
+  return raspitex_capture_params_to_buffer(state, &params, sizep);
+}
+
+/**
+ * Shares a capture of the current frame with request if there is one, or
+ * else joins it to the queue served by the next redraw.
+ * @param state Pointer to the GL preview state.
+ * @param request The request, whose params must be filled in.
+ * @param bufferp Set to the shared capture, or NULL if it could not be
+ *        cropped to the request.
+ * @param sizep Set to the size of the shared capture in bytes.
+ * @return Non-zero if the request was served rather than queued.
+ */
+static int serve_or_queue(RASPITEX_STATE *state,
+      RASPITEX_CAPTURE_REQUEST *request, uint8_t **bufferp, size_t *sizep)
+{
+  const RASPITEX_CAPTURE_PARAMS *params = &request->params;
+  RASPITEX_CAPTURE_CACHE_ENTRY *entry;
+  uint8_t *cached = NULL;
+
+  *bufferp = NULL;
+  *sizep = 0;
+
+  vcos_mutex_lock(&state->capture.lock);
+  entry = cache_lookup(state, params);
+  if (entry) {
+    state->capture.cache_hits++;
+    cached = entry->buffer;
+    raspitex_retain_buffer(state, cached, 1);
+    if (entry->params.num_rects == params->num_rects) {
+      /* The same params, rather than a whole frame to crop */
+      *bufferp = cached;
+      *sizep = entry->size;
+      cached = NULL;
+    } else {
+      state->capture.cache_crops++;
+    }
+  } else {
+    state->capture.cache_misses++;
+    request->next = state->capture.pending;
+    state->capture.pending = request;
+  }
+  vcos_mutex_unlock(&state->capture.lock);
+
+  if (cached) {
+    *bufferp = crop_capture(state, cached, params, sizep);
+    raspitex_release_buffer(state, cached);
+  }
+  return entry != NULL;
+}
+
+/**
+ * Requests a capture described by params without waiting for it. callback
+ * is called with context and the capture once the next redraw has taken
+ * it, on the GL thread, or before this returns if the current frame has
+ * already been captured. Requests are shared as for
+ * raspitex_capture_params_to_buffer.
+ * @param state Pointer to the GL preview state.
+ * @param params What to capture.
+ * @param callback Called exactly once if the request is accepted.
+ * @param context Passed to callback.
+ * @return Zero if the request was accepted.
+ */
+int raspitex_request_capture(RASPITEX_STATE *state,
+      const RASPITEX_CAPTURE_PARAMS *params,
+      RASPITEX_CAPTURE_CALLBACK callback, void *context) {
+  RASPITEX_CAPTURE_REQUEST *request;
+  uint8_t *buffer;
+  size_t size;
+
+  if (params->num_rects < 0 || params->num_rects > RASPITEX_MAX_RECTS) {
+    vcos_log_error("%s: invalid regions", VCOS_FUNCTION);
+    return -1;
+  }
+
+  /* Zeroed, as same_params compares padding too */
+  request = calloc(1, sizeof(*request));
+  if (!request) {
+    vcos_log_error("%s: out of memory", VCOS_FUNCTION);
+    return -1;
+  }
+  memcpy(&request->params, params, sizeof(*params));
+  request->callback = callback;
+  request->context = context;
 
-    /* Wait for capture to start */
-    vcos_semaphore_wait(&state->capture.completed_sem);
+  if (serve_or_queue(state, request, &buffer, &size)) {
+    free(request);
+    callback(context, buffer, buffer ? size : 0);
+  }
+  return 0;
+}
 
-    /* Take ownership of the captured buffer */
-    buffer = state->capture.buffer;
-    *sizep = state->capture.size;
+/**
+ * Waits for the next redraw and returns a capture described by params.
+ * Requests with identical params (including unused fields, which should
+ * be zeroed) are satisfied by the same capture.
+ * @param state Pointer to the GL preview state.
+ * @param params What to capture.
+ * @param sizep Set to the size of the captured data in bytes.
+ * @return The capture buffer, or NULL on failure.
+ */
+uint8_t *raspitex_capture_params_to_buffer(RASPITEX_STATE *state,
+      const RASPITEX_CAPTURE_PARAMS *params, size_t *sizep) {
+  RASPITEX_CAPTURE_REQUEST request;
+  uint8_t *buffer = NULL;
+  *sizep = 0;
 
-    state->capture.request = 0;
-    state->capture.buffer = 0;
-    state->capture.size = 0;
+  if (params->num_rects < 0 || params->num_rects > RASPITEX_MAX_RECTS) {
+    vcos_log_error("%s: invalid regions", VCOS_FUNCTION);
+    return NULL;
+  }
 
-    /* Allow another capture to be requested */
-    vcos_semaphore_post(&state->capture.start_sem);
+  if (state) {
+    /* Copy padding too, as same_params compares bytewise */
+    memset(&request, 0, sizeof(request));
+    memcpy(&request.params, params, sizeof(*params));
+    if (vcos_semaphore_create(&request.completed_sem,
+                              "glcap_completed_sem", 0) != VCOS_SUCCESS) {
+      vcos_log_error("%s: failed to create semaphore", VCOS_FUNCTION);
+      return NULL;
+    }
+
+    if (serve_or_queue(state, &request, &buffer, sizep)) {
+      vcos_semaphore_delete(&request.completed_sem);
+      return buffer;
+    }
+
+    /* Wait for capture to complete */
+    vcos_semaphore_wait(&request.completed_sem);
+    vcos_semaphore_delete(&request.completed_sem);
+
+    /* Take our reference to the captured buffer */
+    buffer = request.buffer;
+    *sizep = request.size;
   }
 
   if (*sizep == 0 || !buffer) {
     vcos_log_error("%s: capture failed", VCOS_FUNCTION);
-    free(buffer);
+    raspitex_release_buffer(state, buffer);
+    *sizep = 0;
     return NULL;
   }
 
   return buffer;
 }
 
+/**
+ * Sets the points read back by RASPITEX_CAPTURE_POINTS captures. They are
+ * copied, and uploaded to the GPU by the next such capture.
+ * @param state Pointer to the GL preview state.
+ * @param points The points, in capture co-ordinates.
+ * @param num_points Number of points. Zero clears them.
+ * @return Zero if successful.
+ */
+int raspitex_set_points(RASPITEX_STATE *state,
+      const RASPITEX_POINT *points, int num_points)
+{
+   RASPITEX_POINT *copy = NULL;
+
+   if (num_points < 0 || (num_points > 0 && ! points))
+      return -1;
+
+   if (num_points > 0)
+   {
+      copy = malloc(num_points * sizeof(*copy));
+      if (! copy)
+         return -1;
+      memcpy(copy, points, num_points * sizeof(*copy));
+   }
+
+   vcos_mutex_lock(&state->capture.lock);
+   free(state->capture.points);
+   state->capture.points = copy;
+   state->capture.num_points = num_points;
+   state->capture.points_serial++;
+   vcos_mutex_unlock(&state->capture.lock);
+
+   return 0;
+}
+
 /**
  * Writes the next GL frame-buffer to a RAW .ppm formatted file
  * using the specified file-handle.
@@ -769,9 +1409,19 @@ int raspitex_capture(RASPITEX_STATE *state, FILE *output_file)
      return -1;
    }
 
-   raspitexutil_brga_to_rgba(buffer, size);
-   int rc = write_tga(output_file, state->width, state->height, buffer, size);
+   /* The capture may be shared, so swap into a private copy */
+   uint8_t *copy = raspitex_acquire_buffer(state, size);
+   if (copy == NULL) {
+     raspitex_release_buffer(state, buffer);
+     return -1;
+   }
+
+   raspitexutil_copy_brga_to_rgba(copy, buffer, size);
+   raspitex_release_buffer(state, buffer);
+
+   int rc = write_tga(output_file, state->capture_frame.capture_width,
+         state->capture_frame.capture_height, copy, size);
    fflush(output_file);
-   free(buffer);
+   raspitex_release_buffer(state, copy);
    return rc;
 }
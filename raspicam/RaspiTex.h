@@ -36,6 +36,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <GLES/glext.h>
 #include <EGL/eglext_brcm.h>
 #include "interface/mmal/mmal.h"
+#include "RaspiTexCapture.h"
 
 #define RASPITEX_VERSION_MAJOR 1
 #define RASPITEX_VERSION_MINOR 0
@@ -81,9 +82,10 @@ typedef struct RASPITEX_SCENE_OPS
    /// Draw the scene - called after update_model
    int (*redraw)(struct RASPITEX_STATE *state);
 
-   /// Allocates a buffer and copies the pixels from the current
-   /// frame-buffer into it.
+   /// Borrows a buffer from the capture pool and copies the pixels
+   /// described by params from the current frame-buffer into it.
    int (*capture)(struct RASPITEX_STATE *state,
+         const RASPITEX_CAPTURE_PARAMS *params,
          uint8_t **buffer, size_t *buffer_size);
 
    /// Creates EGL surface for native window
@@ -96,23 +98,109 @@ typedef struct RASPITEX_SCENE_OPS
    void (*close)(struct RASPITEX_STATE *state);
 } RASPITEX_SCENE_OPS;
 
-typedef struct RASPITEX_CAPTURE
+/// Default number of frame-buffer sized capture buffers in the pool. This
+/// covers the reference frames, the capture cache and a capture in flight.
+#define RASPITEX_POOL_DEFAULT_COUNT 6
+/// Upper limit for --glbuffers
+#define RASPITEX_POOL_MAX_COUNT 16
+/// Alignment in bytes of each pooled capture buffer
+#define RASPITEX_POOL_ALIGNMENT 64
+
+/**
+ * Fixed set of pre-allocated capture buffers. Captures borrow a buffer from
+ * the pool and the consumer hands it back with raspitex_release_buffer, so
+ * steady-state capture never touches the heap. If every buffer is lent out
+ * an unpooled buffer is allocated instead and counted in exhausted.
+ */
+typedef struct RASPITEX_BUFFER_POOL
 {
-   /// Wait for previous capture to complete
-   VCOS_SEMAPHORE_T start_sem;
+   VCOS_MUTEX_T lock;                  /// Guards the slots and counters
+   int count;                          /// Number of pooled buffers
+   size_t buffer_size;                 /// Size of each pooled buffer in bytes
+   uint8_t *buffers[RASPITEX_POOL_MAX_COUNT]; /// The pooled buffers
+   int refs[RASPITEX_POOL_MAX_COUNT];         /// Holders of each buffer
+
+   uint32_t acquired;                  /// Total buffers handed out
+   uint32_t exhausted;                 /// Requests that found no free buffer
+   uint32_t outstanding;               /// Buffers currently lent out
+   uint32_t high_water;                /// Largest value of outstanding seen
+} RASPITEX_BUFFER_POOL;
 
-   /// Posted once the capture is complete
+/**
+ * Called with a finished capture requested by raspitex_request_capture.
+ * The callee owns a reference to buffer, which is NULL if the capture
+ * failed, and must return it with raspitex_release_buffer.
+ */
+typedef void (*RASPITEX_CAPTURE_CALLBACK)(void *context, uint8_t *buffer,
+      size_t size);
+
+/**
+ * A single request for the next frame-buffer capture. Blocking requests
+ * live on the requester's stack while it waits on completed_sem; ones with
+ * a callback are allocated, and freed once it has been called.
+ */
+typedef struct RASPITEX_CAPTURE_REQUEST
+{
+   /// Posted once the capture is complete, unless there is a callback
    VCOS_SEMAPHORE_T completed_sem;
 
-   /// The RGB capture buffer
+   /// Called on the GL thread once the capture is complete, if not NULL
+   RASPITEX_CAPTURE_CALLBACK callback;
+   void *context;
+
+   /// The RGB capture buffer. This may be shared with other requests
+   /// satisfied by the same redraw, so it must be treated as read-only.
    uint8_t *buffer;
 
    /// Size of the captured buffer in bytes
    size_t size;
 
-   /// Frame-buffer capture has been requested. Could use
-   /// a queue instead here to allow multiple capture requests.
-   int request;
+   /// What to capture. Requests with the same params share a capture.
+   RASPITEX_CAPTURE_PARAMS params;
+
+   /// Next request in the pending queue
+   struct RASPITEX_CAPTURE_REQUEST *next;
+} RASPITEX_CAPTURE_REQUEST;
+
+/// Captures kept for reuse until the camera delivers a new frame
+#define RASPITEX_CAPTURE_CACHE_SIZE 2
+
+/**
+ * A finished capture kept so that later requests for the same camera frame
+ * can share it instead of waiting for another redraw.
+ */
+typedef struct RASPITEX_CAPTURE_CACHE_ENTRY
+{
+   RASPITEX_CAPTURE_PARAMS params;     /// What was captured
+   uint8_t *buffer;                    /// The cache's reference, or NULL
+   size_t size;                        /// Size of the capture in bytes
+   unsigned frame;                     /// Camera frame it was read from
+   unsigned points_serial;             /// Points it gathered, for POINTS
+} RASPITEX_CAPTURE_CACHE_ENTRY;
+
+typedef struct RASPITEX_CAPTURE
+{
+   /// Guards the pending queue
+   VCOS_MUTEX_T lock;
+
+   /// Requests waiting for the next redraw. All of them are satisfied
+   /// by a single read of the frame-buffer.
+   RASPITEX_CAPTURE_REQUEST *pending;
+
+   /// Points gathered by RASPITEX_CAPTURE_POINTS, also guarded by lock.
+   /// points_serial changes whenever they do.
+   RASPITEX_POINT *points;
+   int num_points;
+   unsigned points_serial;
+
+   /// Sequence number of the camera frame in the preview texture, also
+   /// guarded by lock. Cached captures are only reused for the same frame.
+   unsigned frame;
+   RASPITEX_CAPTURE_CACHE_ENTRY cache[RASPITEX_CAPTURE_CACHE_SIZE];
+   int cache_next;                     /// Entry to evict next
+   unsigned long cache_hits;           /// Requests served from the cache
+   unsigned long cache_crops;          /// Of those, cut from a full frame
+   unsigned long cache_misses;         /// Requests that waited for a redraw
 } RASPITEX_CAPTURE;
 
 /**
@@ -172,6 +260,11 @@ typedef struct RASPITEX_STATE
    int verbose;                        /// Log FPS
 
    RASPITEX_CAPTURE capture;           /// Frame-buffer capture state
+   RASPITEX_BUFFER_POOL pool;          /// Reusable capture buffers
+
+   /* Captures can be taken from a downscaled copy of the frame-buffer */
+   int capture_scale;                  /// Reduction factor, a power of two
+   RASPITEXCAPTURE_FRAME capture_frame; /// Capture size and passes
 
 } RASPITEX_STATE;
 
@@ -187,6 +280,18 @@ void raspitex_display_help();
 int raspitex_parse_cmdline(RASPITEX_STATE *state,
       const char *arg1, const char *arg2);
 uint8_t *raspitex_capture_to_buffer(RASPITEX_STATE *state, size_t *sizep);
+uint8_t *raspitex_capture_rects_to_buffer(RASPITEX_STATE *state,
+      const RASPITEX_RECT *rects, int num_rects, size_t *sizep);
+int raspitex_request_capture(RASPITEX_STATE *state,
+      const RASPITEX_CAPTURE_PARAMS *params,
+      RASPITEX_CAPTURE_CALLBACK callback, void *context);
+uint8_t *raspitex_capture_params_to_buffer(RASPITEX_STATE *state,
+      const RASPITEX_CAPTURE_PARAMS *params, size_t *sizep);
+int raspitex_set_points(RASPITEX_STATE *state,
+      const RASPITEX_POINT *points, int num_points);
+uint8_t *raspitex_acquire_buffer(RASPITEX_STATE *state, size_t size);
+void raspitex_retain_buffer(RASPITEX_STATE *state, uint8_t *buffer, int count);
+void raspitex_release_buffer(RASPITEX_STATE *state, uint8_t *buffer);
 int raspitex_capture(RASPITEX_STATE *state, FILE* output_file);
 
 #endif /* RASPITEX_H_ */
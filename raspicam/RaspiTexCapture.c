@@ -0,0 +1,1110 @@
+/*
+Copyright (c) 2013, Broadcom Europe Ltd
+Copyright (c) 2013, Tim Gover
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "RaspiTexCapture.h"
+#include "RaspiTexShader.h"
+#include <math.h>
+#include <string.h>
+
+/**
+ * \file RaspiTexCapture.c
+ *
+ * Offscreen passes that prepare the rendered frame for capture, so that
+ * less data has to be read back from the GPU. The frame-buffer is copied
+ * into a texture and reduced by shader passes into small FBOs, which
+ * glReadPixels then reads instead of the window surface. A reference frame
+ * at capture size is kept as a texture so that masks can be computed from
+ * the difference between frames without reading either back.
+ *
+ * The passes need an OpenGL ES 2.X context, so they are only available to
+ * the shader based scenes. GL objects are created on first use and deleted
+ * by raspitexcapture_gl_term before the context goes away.
+ */
+
+/* log2(RASPITEXCAPTURE_MAX_SCALE) */
+#define MAX_LEVELS 4
+
+/* Each sum pass reduces 4x4 blocks, so this covers 65536 pixels across */
+#define MAX_SUM_LEVELS 8
+
+#define CAPTURE_VSHADER_SOURCE \
+    "attribute vec2 vertex;\n" \
+    "varying vec2 texcoord;\n" \
+    "void main(void) {\n" \
+    "   texcoord = 0.5 * (vertex + 1.0);\n" \
+    "   gl_Position = vec4(vertex, 0.0, 1.0);\n" \
+    "}\n"
+
+#define CAPTURE_PRECISION \
+    "#ifdef GL_FRAGMENT_PRECISION_HIGH\n" \
+    "precision highp float;\n" \
+    "#else\n" \
+    "precision mediump float;\n" \
+    "#endif\n"
+
+/* The packing passes below index pixels as gl_FragCoord - 0.5, which is
+ * exact at pixel centres. floor(gl_FragCoord) is not used because Mesa's
+ * llvmpipe rounds it up for some pixels beyond x = 1024.
+ */
+
+/* Halves the source in each direction. tex_scale maps each destination
+ * pixel centre onto the corner shared by a 2x2 block of source texels, so
+ * bilinear filtering returns the average of the block.
+ */
+#define DOWNSAMPLE_FSHADER_SOURCE \
+    CAPTURE_PRECISION \
+    "uniform sampler2D tex;\n" \
+    "uniform vec2 tex_scale;\n" \
+    "varying vec2 texcoord;\n" \
+    "void main(void) {\n" \
+    "    gl_FragColor = texture2D(tex, texcoord * tex_scale);\n" \
+    "}\n"
+
+/* Packs four horizontally adjacent pixels of luma into one RGBA texel.
+ * Each output texel x reads source texels 4x..4x+3 at their centres.
+ */
+#define LUMA_FSHADER_SOURCE \
+    CAPTURE_PRECISION \
+    "uniform sampler2D tex;\n" \
+    "uniform vec2 tex_size;\n" \
+    "const vec3 weights = vec3(0.299, 0.587, 0.114);\n" \
+    "float luma(float x, float y) {\n" \
+    "    return dot(texture2D(tex, vec2(x, y) / tex_size).rgb, weights);\n" \
+    "}\n" \
+    "void main(void) {\n" \
+    "    float x = 4.0 * (gl_FragCoord.x - 0.5) + 0.5;\n" \
+    "    float y = gl_FragCoord.y;\n" \
+    "    gl_FragColor = vec4(luma(x, y), luma(x + 1.0, y),\n" \
+    "                        luma(x + 2.0, y), luma(x + 3.0, y));\n" \
+    "}\n"
+
+/* Packs a one bit threshold of 32 horizontally adjacent pixels into one
+ * RGBA texel, 8 per channel with the leftmost pixel in the lowest bit.
+ * Values are compared in 0-255 units so the result matches the same test
+ * on the CPU, and pixels beyond the right edge are left clear.
+ */
+#define MASK_FSHADER_SOURCE \
+    CAPTURE_PRECISION \
+    "uniform sampler2D tex;\n" \
+    "uniform sampler2D reference;\n" \
+    "uniform vec2 tex_size;\n" \
+    "uniform vec3 weights;\n" \
+    "uniform float threshold;\n" \
+    "uniform float diff;\n" \
+    "vec3 rgb(sampler2D t, vec2 tc) {\n" \
+    "    return floor(texture2D(t, tc).rgb * 255.0 + 0.5);\n" \
+    "}\n" \
+    "float passes(float x, float y) {\n" \
+    "    vec2 tc = vec2(x, y) / tex_size;\n" \
+    "    vec3 d = rgb(tex, tc) - diff * rgb(reference, tc);\n" \
+    "    return float(dot(weights, d) > threshold && x < tex_size.x);\n" \
+    "}\n" \
+    "float bits(float x, float y) {\n" \
+    "    float v = 0.0;\n" \
+    "    float bit = 1.0;\n" \
+    "    for (int k = 0; k < 8; k++) {\n" \
+    "        v += bit * passes(x + float(k), y);\n" \
+    "        bit *= 2.0;\n" \
+    "    }\n" \
+    "    return v / 255.0;\n" \
+    "}\n" \
+    "void main(void) {\n" \
+    "    float x = 32.0 * (gl_FragCoord.x - 0.5) + 0.5;\n" \
+    "    float y = gl_FragCoord.y;\n" \
+    "    gl_FragColor = vec4(bits(x, y), bits(x + 8.0, y),\n" \
+    "                        bits(x + 16.0, y), bits(x + 24.0, y));\n" \
+    "}\n"
+
+/* Floats are stored in RGBA8 targets as a 23 bit mantissa in R, G and B
+ * and the sign and exponent in A, so that sums of millions of pixels keep
+ * their precision through the reduction passes. Zero is all zero bytes.
+ * raspitexutil_unpack_float decodes the same format on the CPU.
+ */
+#define PACK_FLOAT_SOURCE \
+    "vec4 pack(float v) {\n" \
+    "    if (v == 0.0) return vec4(0.0);\n" \
+    "    float s = v < 0.0 ? 128.0 : 0.0;\n" \
+    "    v = abs(v);\n" \
+    "    float e = floor(log2(v));\n" \
+    "    float m = v / exp2(e);\n" \
+    "    if (m >= 2.0) { m *= 0.5; e += 1.0; }\n" \
+    "    if (m < 1.0) { m *= 2.0; e -= 1.0; }\n" \
+    "    float t = floor((m - 1.0) * 8388608.0 + 0.5);\n" \
+    "    if (t >= 8388608.0) { t = 0.0; e += 1.0; }\n" \
+    "    if (e < -63.0) return vec4(0.0);\n" \
+    "    e = min(e, 63.0);\n" \
+    "    float hi = floor(t / 65536.0);\n" \
+    "    t -= hi * 65536.0;\n" \
+    "    float mid = floor(t / 256.0);\n" \
+    "    return vec4(hi, mid, t - mid * 256.0, e + 64.0 + s) / 255.0;\n" \
+    "}\n" \
+    "float unpack(vec4 c) {\n" \
+    "    vec4 b = floor(c * 255.0 + 0.5);\n" \
+    "    if (b.a == 0.0) return 0.0;\n" \
+    "    float s = b.a >= 128.0 ? -1.0 : 1.0;\n" \
+    "    float e = mod(b.a, 128.0) - 64.0;\n" \
+    "    float m = 1.0 + (b.r * 65536.0 + b.g * 256.0 + b.b) / 8388608.0;\n" \
+    "    return s * m * exp2(e);\n" \
+    "}\n"
+
+/* The sum targets hold four lanes side by side, one for each sum, and
+ * each texel holds the sum of a 4x4 block of the level before. row offsets
+ * the last pass into the row of the result target for the region.
+ */
+#define SUM_LANE_SOURCE \
+    "uniform float lane_width;\n" \
+    "uniform float row;\n" \
+    "float lane;\n" \
+    "vec2 block_origin(void) {\n" \
+    "    vec2 p = gl_FragCoord.xy - vec2(0.5, 0.5 + row);\n" \
+    "    lane = floor((p.x + 0.5) / lane_width);\n" \
+    "    return 4.0 * vec2(p.x - lane * lane_width, p.y);\n" \
+    "}\n"
+
+/* First sum pass: thresholds the weighted difference of each pixel in the
+ * region, as the mask does, and sums its lane over 4x4 blocks.
+ */
+#define WEIGH_FSHADER_SOURCE \
+    CAPTURE_PRECISION \
+    PACK_FLOAT_SOURCE \
+    SUM_LANE_SOURCE \
+    "uniform sampler2D tex;\n" \
+    "uniform sampler2D reference;\n" \
+    "uniform vec2 tex_size;\n" \
+    "uniform vec3 weights;\n" \
+    "uniform float threshold;\n" \
+    "uniform float diff;\n" \
+    "uniform vec4 region;\n" \
+    "vec3 rgb(sampler2D t, vec2 tc) {\n" \
+    "    return floor(texture2D(t, tc).rgb * 255.0 + 0.5);\n" \
+    "}\n" \
+    "void main(void) {\n" \
+    "    vec2 origin = block_origin();\n" \
+    "    vec4 sums = vec4(0.0);\n" \
+    "    for (int j = 0; j < 4; j++) {\n" \
+    "        for (int i = 0; i < 4; i++) {\n" \
+    "            vec2 q = origin + vec2(float(i), float(j));\n" \
+    "            if (q.x < region.z && q.y < region.w) {\n" \
+    "                vec2 xy = region.xy + q;\n" \
+    "                vec2 tc = (xy + 0.5) / tex_size;\n" \
+    "                float w = dot(weights,\n" \
+    "                    rgb(tex, tc) - diff * rgb(reference, tc));\n" \
+    "                if (w > threshold)\n" \
+    "                    sums += vec4(w, w * xy.x, w * xy.y, 1.0);\n" \
+    "            }\n" \
+    "        }\n" \
+    "    }\n" \
+    "    vec4 select = vec4(equal(vec4(lane), vec4(0.0, 1.0, 2.0, 3.0)));\n" \
+    "    gl_FragColor = pack(dot(sums, select));\n" \
+    "}\n"
+
+/* Later sum passes: sums 4x4 blocks of the used part of each lane. */
+#define REDUCE_FSHADER_SOURCE \
+    CAPTURE_PRECISION \
+    PACK_FLOAT_SOURCE \
+    SUM_LANE_SOURCE \
+    "uniform sampler2D tex;\n" \
+    "uniform vec2 tex_size;\n" \
+    "uniform float src_lane_width;\n" \
+    "uniform vec2 used;\n" \
+    "void main(void) {\n" \
+    "    vec2 origin = block_origin();\n" \
+    "    vec2 base = vec2(lane * src_lane_width, 0.0) + 0.5;\n" \
+    "    float sum = 0.0;\n" \
+    "    for (int j = 0; j < 4; j++) {\n" \
+    "        for (int i = 0; i < 4; i++) {\n" \
+    "            vec2 q = origin + vec2(float(i), float(j));\n" \
+    "            if (q.x < used.x && q.y < used.y)\n" \
+    "                sum += unpack(texture2D(tex, (base + q) / tex_size));\n" \
+    "        }\n" \
+    "    }\n" \
+    "    gl_FragColor = pack(sum);\n" \
+    "}\n"
+
+/* Gathers points: each vertex is a point's pixel and its output slot, and
+ * is drawn as a single pixel point into that slot.
+ */
+#define GATHER_VSHADER_SOURCE \
+    "attribute vec4 vertex;\n" \
+    "uniform vec2 dst_size;\n" \
+    "varying vec2 centre;\n" \
+    "void main(void) {\n" \
+    "    centre = vertex.xy + 0.5;\n" \
+    "    gl_Position = vec4((vertex.zw + 0.5) / dst_size * 2.0 - 1.0,\n" \
+    "                       0.0, 1.0);\n" \
+    "    gl_PointSize = 1.0;\n" \
+    "}\n"
+
+/* The 3x3 neighbourhood of a point with the centre weighted 4, truncated
+ * as integer division on the CPU would.
+ */
+#define GATHER_FSHADER_SOURCE \
+    CAPTURE_PRECISION \
+    "uniform sampler2D tex;\n" \
+    "uniform vec2 tex_size;\n" \
+    "varying vec2 centre;\n" \
+    "vec3 rgb(float dx, float dy) {\n" \
+    "    vec2 tc = (centre + vec2(dx, dy)) / tex_size;\n" \
+    "    return floor(texture2D(tex, tc).rgb * 255.0 + 0.5);\n" \
+    "}\n" \
+    "void main(void) {\n" \
+    "    vec3 sum = 3.0 * rgb(0.0, 0.0);\n" \
+    "    for (int j = -1; j <= 1; j++)\n" \
+    "        for (int i = -1; i <= 1; i++)\n" \
+    "            sum += rgb(float(i), float(j));\n" \
+    "    gl_FragColor = vec4(floor(sum / 12.0 + 1.0 / 24.0) / 255.0, 1.0);\n" \
+    "}\n"
+
+static const GLfloat quad_varray[] = {
+   -1.0f, -1.0f, 1.0f, 1.0f, 1.0f, -1.0f,
+   -1.0f, 1.0f, 1.0f, 1.0f, -1.0f, -1.0f,
+};
+
+/** An offscreen colour buffer. fbo is zero for texture-only targets. */
+typedef struct CAPTURE_TARGET
+{
+   GLuint fbo;
+   GLuint texture;
+   int width;
+   int height;
+} CAPTURE_TARGET;
+
+typedef struct RASPITEXCAPTURE_STATE
+{
+   GLuint quad_vbo;                    /// Full-screen quad
+   CAPTURE_TARGET frame;               /// Copy of the rendered frame
+   CAPTURE_TARGET levels[MAX_LEVELS];  /// Downsampling chain
+   int num_levels;                     /// Levels in use for capture_scale
+   CAPTURE_TARGET luma;                /// Packed luma, 4 pixels per texel
+   CAPTURE_TARGET mask;                /// Packed mask, 32 pixels per texel
+   CAPTURE_TARGET reference;           /// Reference frame at capture size
+   CAPTURE_TARGET sum_levels[MAX_SUM_LEVELS]; /// Sum reduction chain
+   int num_sum_levels;
+   CAPTURE_TARGET sums;                /// Packed sums, a row per region
+   CAPTURE_TARGET gather;              /// A texel per point
+
+   GLuint points_vbo;                  /// Point positions and output slots
+   int num_points;                     /// Points in points_vbo
+   unsigned points_serial;             /// Serial of the uploaded points
+
+   RASPITEXUTIL_SHADER_PROGRAM_T downsample_shader;
+   RASPITEXUTIL_SHADER_PROGRAM_T luma_shader;
+   RASPITEXUTIL_SHADER_PROGRAM_T mask_shader;
+   RASPITEXUTIL_SHADER_PROGRAM_T weigh_shader;
+   RASPITEXUTIL_SHADER_PROGRAM_T reduce_shader;
+   RASPITEXUTIL_SHADER_PROGRAM_T gather_shader;
+   int bound;                          /// Non-zero while passes are bound
+
+   /* Scene state restored by raspitexcapture_unbind */
+   GLint saved_program;
+   GLint saved_array_buffer;
+   GLint saved_texture;
+   GLint saved_texture1;
+   GLint saved_viewport[4];
+} RASPITEXCAPTURE_STATE;
+
+/**
+ * Creates a texture, and optionally an FBO rendering into it.
+ * @param target The target to initialise.
+ * @param width Width in pixels.
+ * @param height Height in pixels.
+ * @param with_fbo Non-zero to attach the texture to a new FBO.
+ * @return Zero if successful.
+ */
+static int create_target(CAPTURE_TARGET *target, int width, int height,
+      int with_fbo)
+{
+   target->width = width;
+   target->height = height;
+
+   GLCHK(glGenTextures(1, &target->texture));
+   GLCHK(glBindTexture(GL_TEXTURE_2D, target->texture));
+   GLCHK(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+            GL_RGBA, GL_UNSIGNED_BYTE, NULL));
+   GLCHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+   GLCHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+   GLCHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+   GLCHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+
+   if (! with_fbo)
+      return 0;
+
+   GLCHK(glGenFramebuffers(1, &target->fbo));
+   GLCHK(glBindFramebuffer(GL_FRAMEBUFFER, target->fbo));
+   GLCHK(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_2D, target->texture, 0));
+
+   if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+   {
+      vcos_log_error("%s: incomplete framebuffer %dx%d", VCOS_FUNCTION,
+            width, height);
+      return -1;
+   }
+
+   return 0;
+}
+
+/**
+ * Sets the filtering of a target's texture. Passes that read texel centres
+ * need GL_NEAREST, because bilinear weights are only approximate on some
+ * GPUs and would leak neighbouring texels into the result.
+ */
+static void set_filter(const CAPTURE_TARGET *target, GLint filter)
+{
+   GLCHK(glBindTexture(GL_TEXTURE_2D, target->texture));
+   GLCHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter));
+   GLCHK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter));
+}
+
+/**
+ * Creates a target holding packed values, which must not be filtered.
+ * @return Zero if successful.
+ */
+static int create_packed_target(CAPTURE_TARGET *target, int width,
+      int height)
+{
+   int rc = create_target(target, width, height, 1);
+   set_filter(target, GL_NEAREST);
+   return rc;
+}
+
+static void delete_target(CAPTURE_TARGET *target)
+{
+   if (target->fbo)
+      glDeleteFramebuffers(1, &target->fbo);
+   if (target->texture)
+      glDeleteTextures(1, &target->texture);
+   target->fbo = 0;
+   target->texture = 0;
+}
+
+/**
+ * Builds a program for a capture pass.
+ * @param shader The program to build.
+ * @param vertex_source The vertex shader, with a single attribute.
+ * @param fragment_source The fragment shader.
+ * @param uniforms NULL terminated list of uniform names. The first is the
+ *                 sampler for the source texture.
+ * @return Zero if successful.
+ */
+static int build_pass_shader(RASPITEXUTIL_SHADER_PROGRAM_T *shader,
+      const char *vertex_source, const char *fragment_source,
+      const char *const *uniforms)
+{
+   int i;
+
+   memset(shader, 0, sizeof(*shader));
+   shader->vertex_source = vertex_source;
+   shader->fragment_source = fragment_source;
+   for (i = 0; uniforms[i] && i < SHADER_MAX_UNIFORMS; i++)
+      shader->uniform_names[i] = uniforms[i];
+   shader->attribute_names[0] = "vertex";
+   return raspitexutil_build_shader_program(shader);
+}
+
+static void delete_shader(RASPITEXUTIL_SHADER_PROGRAM_T *shader)
+{
+   if (shader->program)
+   {
+      glDeleteProgram(shader->program);
+      glDeleteShader(shader->fs);
+      glDeleteShader(shader->vs);
+   }
+   shader->program = 0;
+}
+
+/**
+ * Allocates the capture state and the GL objects it needs on first use.
+ * @param frame The frame to capture.
+ * @return The capture state, or NULL on failure.
+ */
+static RASPITEXCAPTURE_STATE *capture_gl_init(RASPITEXCAPTURE_FRAME *frame)
+{
+   static const char *const downsample_uniforms[] = {
+      "tex", "tex_scale", NULL
+   };
+   static const char *const luma_uniforms[] = {
+      "tex", "tex_size", NULL
+   };
+   static const char *const mask_uniforms[] = {
+      "tex", "reference", "tex_size", "weights", "threshold", "diff", NULL
+   };
+   /* The sum shaders share their first three uniforms */
+   static const char *const weigh_uniforms[] = {
+      "tex", "lane_width", "row", "reference", "tex_size", "weights",
+      "threshold", "diff", "region", NULL
+   };
+   static const char *const reduce_uniforms[] = {
+      "tex", "lane_width", "row", "tex_size", "src_lane_width", "used", NULL
+   };
+   static const char *const gather_uniforms[] = {
+      "tex", "tex_size", "dst_size", NULL
+   };
+   int lane_width, lane_height;
+   RASPITEXCAPTURE_STATE *cap = frame->gl;
+   uint8_t *zeros;
+   int width = frame->width;
+   int height = frame->height;
+   int rc = 0;
+   int i;
+
+   if (cap)
+      return cap;
+
+   cap = calloc(1, sizeof(*cap));
+   if (! cap)
+      return NULL;
+   frame->gl = cap;
+
+   rc = build_pass_shader(&cap->downsample_shader,
+         CAPTURE_VSHADER_SOURCE, DOWNSAMPLE_FSHADER_SOURCE,
+         downsample_uniforms);
+   if (rc != 0)
+      goto fail;
+
+   rc = build_pass_shader(&cap->luma_shader,
+         CAPTURE_VSHADER_SOURCE, LUMA_FSHADER_SOURCE,
+         luma_uniforms);
+   if (rc != 0)
+      goto fail;
+
+   rc = build_pass_shader(&cap->mask_shader,
+         CAPTURE_VSHADER_SOURCE, MASK_FSHADER_SOURCE,
+         mask_uniforms);
+   if (rc != 0)
+      goto fail;
+
+   rc = build_pass_shader(&cap->weigh_shader,
+         CAPTURE_VSHADER_SOURCE, WEIGH_FSHADER_SOURCE,
+         weigh_uniforms);
+   if (rc != 0)
+      goto fail;
+
+   rc = build_pass_shader(&cap->reduce_shader,
+         CAPTURE_VSHADER_SOURCE, REDUCE_FSHADER_SOURCE,
+         reduce_uniforms);
+   if (rc != 0)
+      goto fail;
+
+   rc = build_pass_shader(&cap->gather_shader,
+         GATHER_VSHADER_SOURCE, GATHER_FSHADER_SOURCE,
+         gather_uniforms);
+   if (rc != 0)
+      goto fail;
+
+   GLCHK(glGenBuffers(1, &cap->quad_vbo));
+   GLCHK(glBindBuffer(GL_ARRAY_BUFFER, cap->quad_vbo));
+   GLCHK(glBufferData(GL_ARRAY_BUFFER, sizeof(quad_varray), quad_varray,
+            GL_STATIC_DRAW));
+
+   rc = create_target(&cap->frame, width, height, 0);
+   if (rc != 0)
+      goto fail;
+
+   for (i = 1; i < frame->scale && cap->num_levels < MAX_LEVELS;
+         i <<= 1)
+   {
+      width = (width + 1) / 2;
+      height = (height + 1) / 2;
+      rc = create_target(&cap->levels[cap->num_levels++], width, height, 1);
+      if (rc != 0)
+         goto fail;
+   }
+
+   rc = create_target(&cap->luma, (width + 3) / 4, height, 1);
+   if (rc != 0)
+      goto fail;
+
+   rc = create_target(&cap->mask, (width + 31) / 32, height, 1);
+   if (rc != 0)
+      goto fail;
+
+   /* The reference starts out black */
+   rc = create_target(&cap->reference, width, height, 0);
+   zeros = calloc(width * height, 4);
+   if (rc != 0 || ! zeros)
+   {
+      free(zeros);
+      goto fail;
+   }
+   set_filter(&cap->reference, GL_NEAREST);
+   GLCHK(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+            GL_RGBA, GL_UNSIGNED_BYTE, zeros));
+   free(zeros);
+
+   /* Sum levels down to, but not including, a single texel per lane */
+   lane_width = (width + 3) / 4;
+   lane_height = (height + 3) / 4;
+   while ((lane_width > 1 || lane_height > 1) &&
+         cap->num_sum_levels < MAX_SUM_LEVELS)
+   {
+      rc = create_packed_target(&cap->sum_levels[cap->num_sum_levels++],
+            RASPITEX_NUM_SUMS * lane_width, lane_height);
+      if (rc != 0)
+         goto fail;
+      lane_width = (lane_width + 3) / 4;
+      lane_height = (lane_height + 3) / 4;
+   }
+
+   rc = create_packed_target(&cap->sums, RASPITEX_NUM_SUMS,
+         RASPITEX_MAX_RECTS);
+   if (rc != 0)
+      goto fail;
+
+   GLCHK(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+   return cap;
+
+fail:
+   vcos_log_error("%s: failed", VCOS_FUNCTION);
+   GLCHK(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+   raspitexcapture_gl_term(frame);
+   return NULL;
+}
+
+/**
+ * Draws the full-screen quad into rows of dst with the given program,
+ * reading from the src texture on unit 0.
+ */
+static void draw_pass_rows(RASPITEXCAPTURE_STATE *cap,
+      RASPITEXUTIL_SHADER_PROGRAM_T *shader,
+      const CAPTURE_TARGET *src, const CAPTURE_TARGET *dst,
+      int first_row, int num_rows)
+{
+   GLCHK(glBindFramebuffer(GL_FRAMEBUFFER, dst->fbo));
+   GLCHK(glViewport(0, first_row, dst->width, num_rows));
+   GLCHK(glActiveTexture(GL_TEXTURE0));
+   GLCHK(glBindTexture(GL_TEXTURE_2D, src->texture));
+   GLCHK(glBindBuffer(GL_ARRAY_BUFFER, cap->quad_vbo));
+   GLCHK(glEnableVertexAttribArray(shader->attribute_locations[0]));
+   GLCHK(glVertexAttribPointer(shader->attribute_locations[0], 2, GL_FLOAT,
+            GL_FALSE, 0, 0));
+   GLCHK(glDrawArrays(GL_TRIANGLES, 0, 6));
+}
+
+/**
+ * Draws the full-screen quad into dst with the given program, reading
+ * from the src texture on unit 0.
+ */
+static void draw_pass(RASPITEXCAPTURE_STATE *cap,
+      RASPITEXUTIL_SHADER_PROGRAM_T *shader,
+      const CAPTURE_TARGET *src, const CAPTURE_TARGET *dst)
+{
+   draw_pass_rows(cap, shader, src, dst, 0, dst->height);
+}
+
+/**
+ * Saves the scene's GL state and copies the just-rendered frame-buffer into
+ * the frame texture.
+ * @return The capture state, or NULL on failure.
+ */
+static RASPITEXCAPTURE_STATE *begin_passes(RASPITEXCAPTURE_FRAME *frame)
+{
+   RASPITEXCAPTURE_STATE *cap = capture_gl_init(frame);
+   if (! cap)
+      return NULL;
+
+   glGetIntegerv(GL_CURRENT_PROGRAM, &cap->saved_program);
+   glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &cap->saved_array_buffer);
+   glGetIntegerv(GL_VIEWPORT, cap->saved_viewport);
+   GLCHK(glActiveTexture(GL_TEXTURE1));
+   glGetIntegerv(GL_TEXTURE_BINDING_2D, &cap->saved_texture1);
+   GLCHK(glActiveTexture(GL_TEXTURE0));
+   glGetIntegerv(GL_TEXTURE_BINDING_2D, &cap->saved_texture);
+
+   GLCHK(glBindTexture(GL_TEXTURE_2D, cap->frame.texture));
+   GLCHK(glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0,
+            cap->frame.width, cap->frame.height));
+   return cap;
+}
+
+/**
+ * Reduces the frame texture by capture_scale in each direction, using a
+ * chain of 2x2 box filter passes.
+ * @return The reduced target, which is the frame itself at scale 1.
+ */
+static const CAPTURE_TARGET *scale_frame(RASPITEXCAPTURE_STATE *cap)
+{
+   RASPITEXUTIL_SHADER_PROGRAM_T *shader = &cap->downsample_shader;
+   const CAPTURE_TARGET *src = &cap->frame;
+   int i;
+
+   GLCHK(glUseProgram(shader->program));
+   GLCHK(glUniform1i(shader->uniform_locations[0], 0));
+
+   for (i = 0; i < cap->num_levels; i++)
+   {
+      const CAPTURE_TARGET *dst = &cap->levels[i];
+      GLCHK(glUniform2f(shader->uniform_locations[1],
+               2.0f * dst->width / src->width,
+               2.0f * dst->height / src->height));
+      draw_pass(cap, shader, src, dst);
+      src = dst;
+   }
+
+   return src;
+}
+
+/**
+ * Runs the packing pass for a mode into its target.
+ * @return The target to read back.
+ */
+static const CAPTURE_TARGET *pack_frame(RASPITEXCAPTURE_STATE *cap,
+      const CAPTURE_TARGET *src, const RASPITEX_CAPTURE_PARAMS *params)
+{
+   RASPITEXUTIL_SHADER_PROGRAM_T *shader;
+
+   switch (params->mode)
+   {
+      case RASPITEX_CAPTURE_LUMA:
+         shader = &cap->luma_shader;
+         GLCHK(glUseProgram(shader->program));
+         GLCHK(glUniform1i(shader->uniform_locations[0], 0));
+         GLCHK(glUniform2f(shader->uniform_locations[1],
+                  src->width, src->height));
+         draw_pass(cap, shader, src, &cap->luma);
+         return &cap->luma;
+
+      case RASPITEX_CAPTURE_MASK:
+         shader = &cap->mask_shader;
+         GLCHK(glActiveTexture(GL_TEXTURE1));
+         GLCHK(glBindTexture(GL_TEXTURE_2D, cap->reference.texture));
+         GLCHK(glUseProgram(shader->program));
+         GLCHK(glUniform1i(shader->uniform_locations[0], 0));
+         GLCHK(glUniform1i(shader->uniform_locations[1], 1));
+         GLCHK(glUniform2f(shader->uniform_locations[2],
+                  src->width, src->height));
+         GLCHK(glUniform3f(shader->uniform_locations[3],
+                  params->weights[0], params->weights[1],
+                  params->weights[2]));
+         GLCHK(glUniform1f(shader->uniform_locations[4], params->threshold));
+         GLCHK(glUniform1f(shader->uniform_locations[5],
+                  (params->flags & RASPITEX_CAPTURE_DIFF) ? 1.0f : 0.0f));
+         draw_pass(cap, shader, src, &cap->mask);
+         return &cap->mask;
+
+      default:
+         return src;
+   }
+}
+
+/**
+ * Reduces a region of the frame to its RASPITEX_CAPTURE_SUMS, which are
+ * written to one row of the sums target.
+ * @param cap The capture state.
+ * @param src The frame at capture size.
+ * @param params The capture, for the weights and threshold.
+ * @param rect The region to sum.
+ * @param row The row of the sums target to write.
+ */
+static void sum_region(RASPITEXCAPTURE_STATE *cap, const CAPTURE_TARGET *src,
+      const RASPITEX_CAPTURE_PARAMS *params, const RASPITEX_RECT *rect,
+      int row)
+{
+   RASPITEXUTIL_SHADER_PROGRAM_T *shader = &cap->weigh_shader;
+   int used_width = rect->width;
+   int used_height = rect->height;
+   int level;
+
+   GLCHK(glActiveTexture(GL_TEXTURE1));
+   GLCHK(glBindTexture(GL_TEXTURE_2D, cap->reference.texture));
+   GLCHK(glUseProgram(shader->program));
+   GLCHK(glUniform1i(shader->uniform_locations[0], 0));
+   GLCHK(glUniform1i(shader->uniform_locations[3], 1));
+   GLCHK(glUniform2f(shader->uniform_locations[4], src->width, src->height));
+   GLCHK(glUniform3f(shader->uniform_locations[5], params->weights[0],
+            params->weights[1], params->weights[2]));
+   GLCHK(glUniform1f(shader->uniform_locations[6], params->threshold));
+   GLCHK(glUniform1f(shader->uniform_locations[7],
+            (params->flags & RASPITEX_CAPTURE_DIFF) ? 1.0f : 0.0f));
+   GLCHK(glUniform4f(shader->uniform_locations[8], rect->x, rect->y,
+            rect->width, rect->height));
+
+   for (level = 0; level <= cap->num_sum_levels; level++)
+   {
+      const CAPTURE_TARGET *dst = level < cap->num_sum_levels ?
+         &cap->sum_levels[level] : &cap->sums;
+      int dst_row = dst == &cap->sums ? row : 0;
+
+      if (level > 0)
+      {
+         shader = &cap->reduce_shader;
+         GLCHK(glUseProgram(shader->program));
+         GLCHK(glUniform1i(shader->uniform_locations[0], 0));
+         GLCHK(glUniform2f(shader->uniform_locations[3],
+                  src->width, src->height));
+         GLCHK(glUniform1f(shader->uniform_locations[4],
+                  src->width / RASPITEX_NUM_SUMS));
+         GLCHK(glUniform2f(shader->uniform_locations[5],
+                  used_width, used_height));
+      }
+
+      used_width = (used_width + 3) / 4;
+      used_height = (used_height + 3) / 4;
+
+      GLCHK(glUniform1f(shader->uniform_locations[1],
+               dst->width / RASPITEX_NUM_SUMS));
+      GLCHK(glUniform1f(shader->uniform_locations[2], dst_row));
+
+      /* Only the rows in use, or the region's row of the result */
+      draw_pass_rows(cap, shader, src, dst, dst_row,
+            dst == &cap->sums ? 1 : used_height);
+      src = dst;
+   }
+}
+
+/**
+ * Uploads the frame's points if they have changed, with the output slot
+ * of each, and sizes the gather target to hold them.
+ * @return Zero if successful.
+ */
+static int update_points(RASPITEXCAPTURE_FRAME *frame,
+      RASPITEXCAPTURE_STATE *cap)
+{
+   GLfloat *vertices = NULL;
+   int width, height, i;
+   int rc = 0;
+
+   if (frame->points_serial == cap->points_serial && cap->points_vbo)
+      goto done;
+
+   cap->num_points = frame->num_points;
+   cap->points_serial = frame->points_serial;
+   if (cap->num_points == 0)
+      goto done;
+
+   width = (int) ceil(sqrt(cap->num_points));
+   height = (cap->num_points + width - 1) / width;
+
+   vertices = malloc(cap->num_points * 4 * sizeof(GLfloat));
+   if (! vertices)
+   {
+      rc = -1;
+      goto done;
+   }
+   for (i = 0; i < cap->num_points; i++)
+   {
+      vertices[4 * i + 0] = frame->points[i].x;
+      vertices[4 * i + 1] = frame->points[i].y;
+      vertices[4 * i + 2] = i % width;
+      vertices[4 * i + 3] = i / width;
+   }
+
+   if (! cap->points_vbo)
+      GLCHK(glGenBuffers(1, &cap->points_vbo));
+   GLCHK(glBindBuffer(GL_ARRAY_BUFFER, cap->points_vbo));
+   GLCHK(glBufferData(GL_ARRAY_BUFFER,
+            cap->num_points * 4 * sizeof(GLfloat), vertices, GL_STATIC_DRAW));
+
+   if (cap->gather.width != width || cap->gather.height != height)
+   {
+      delete_target(&cap->gather);
+      rc = create_packed_target(&cap->gather, width, height);
+   }
+
+done:
+   free(vertices);
+   if (rc != 0)
+      cap->points_serial--;
+   return rc;
+}
+
+/**
+ * Draws each point into its texel of the gather target.
+ */
+static void gather_points(RASPITEXCAPTURE_STATE *cap,
+      const CAPTURE_TARGET *src)
+{
+   RASPITEXUTIL_SHADER_PROGRAM_T *shader = &cap->gather_shader;
+   const CAPTURE_TARGET *dst = &cap->gather;
+
+   GLCHK(glBindFramebuffer(GL_FRAMEBUFFER, dst->fbo));
+   GLCHK(glViewport(0, 0, dst->width, dst->height));
+   GLCHK(glActiveTexture(GL_TEXTURE0));
+   GLCHK(glBindTexture(GL_TEXTURE_2D, src->texture));
+   GLCHK(glUseProgram(shader->program));
+   GLCHK(glUniform1i(shader->uniform_locations[0], 0));
+   GLCHK(glUniform2f(shader->uniform_locations[1], src->width, src->height));
+   GLCHK(glUniform2f(shader->uniform_locations[2], dst->width, dst->height));
+   GLCHK(glBindBuffer(GL_ARRAY_BUFFER, cap->points_vbo));
+   GLCHK(glEnableVertexAttribArray(shader->attribute_locations[0]));
+   GLCHK(glVertexAttribPointer(shader->attribute_locations[0], 4, GL_FLOAT,
+            GL_FALSE, 0, 0));
+   GLCHK(glDrawArrays(GL_POINTS, 0, cap->num_points));
+}
+
+/**
+ * Copies a frame, which must be at capture size, into the reference.
+ * The frame texture has no FBO, but the window surface still holds it.
+ */
+static void store_reference(RASPITEXCAPTURE_STATE *cap,
+      const CAPTURE_TARGET *src)
+{
+   GLCHK(glBindFramebuffer(GL_FRAMEBUFFER, src->fbo));
+   GLCHK(glActiveTexture(GL_TEXTURE0));
+   GLCHK(glBindTexture(GL_TEXTURE_2D, cap->reference.texture));
+   GLCHK(glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0,
+            src->width, src->height));
+}
+
+/**
+ * @return The number of pixels packed into each RGBA texel by a mode.
+ */
+static int pixels_per_texel(RASPITEX_CAPTURE_MODE mode)
+{
+   switch (mode)
+   {
+      case RASPITEX_CAPTURE_LUMA:
+         return 4;
+      case RASPITEX_CAPTURE_MASK:
+         return 32;
+      default:
+         return 1;
+   }
+}
+
+/**
+ * Maps the pixel regions of a capture onto the texels to read back, and
+ * checks that they lie within the captured frame.
+ * @param frame The frame to capture.
+ * @param params The capture.
+ * @param texels Receives the texel regions, RASPITEX_MAX_RECTS entries.
+ * @param num_texels Receives the number of texel regions.
+ * @return Zero if successful.
+ */
+static int map_rects(const RASPITEXCAPTURE_FRAME *frame,
+      const RASPITEX_CAPTURE_PARAMS *params,
+      RASPITEX_RECT *texels, int *num_texels)
+{
+   RASPITEX_RECT full = {0, 0, frame->capture_width, frame->capture_height};
+   const RASPITEX_RECT *rects = params->rects;
+   int num_rects = params->num_rects;
+   int per_texel = pixels_per_texel(params->mode);
+   int i;
+
+   if (num_rects == 0)
+   {
+      rects = &full;
+      num_rects = 1;
+   }
+
+   for (i = 0; i < num_rects; i++)
+   {
+      const RASPITEX_RECT *r = &rects[i];
+      if (r->x < 0 || r->y < 0 || r->width < 0 || r->height < 0 ||
+            r->x + r->width > frame->capture_width ||
+            r->y + r->height > frame->capture_height ||
+            r->x % per_texel != 0)
+      {
+         vcos_log_error("%s: region %d,%d,%d,%d outside frame",
+               VCOS_FUNCTION, r->x, r->y, r->width, r->height);
+         return -1;
+      }
+
+      if (params->mode == RASPITEX_CAPTURE_SUMS)
+      {
+         /* One row of the sums target per region */
+         texels[i].x = 0;
+         texels[i].y = i;
+         texels[i].width = RASPITEX_NUM_SUMS;
+         texels[i].height = 1;
+      }
+      else
+      {
+         texels[i].x = r->x / per_texel;
+         texels[i].y = r->y;
+         texels[i].width = (r->width + per_texel - 1) / per_texel;
+         texels[i].height = r->height;
+      }
+   }
+
+   *num_texels = num_rects;
+   return 0;
+}
+
+/**
+ * Sets the size of a frame and of its captures, and clears the rest.
+ * @param frame The frame to set up.
+ * @param width Width of the rendered frame.
+ * @param height Height of the rendered frame.
+ * @param scale Reduction factor for captures, a power of two.
+ */
+void raspitexcapture_frame_init(RASPITEXCAPTURE_FRAME *frame,
+      int32_t width, int32_t height, int scale)
+{
+   int i;
+
+   memset(frame, 0, sizeof(*frame));
+   frame->width = width;
+   frame->height = height;
+   frame->scale = scale;
+
+   /* Each 2x reduction rounds odd sizes up */
+   frame->capture_width = width;
+   frame->capture_height = height;
+   for (i = 1; i < scale; i <<= 1)
+   {
+      frame->capture_width = (frame->capture_width + 1) / 2;
+      frame->capture_height = (frame->capture_height + 1) / 2;
+   }
+}
+
+/**
+ * Prepares the current frame for capture as described by params, and
+ * binds the framebuffer to read it from. Plain BGRA captures at scale 1
+ * that leave the reference alone read the window surface directly;
+ * anything else renders offscreen passes, after which the caller must
+ * call raspitexcapture_unbind.
+ * @param frame The frame to capture.
+ * @param params The capture.
+ * @param texels Receives the RGBA texel regions to read back, one for each
+ *               region in params. Must hold RASPITEX_MAX_RECTS entries.
+ * @param num_texels Receives the number of texel regions.
+ * @return Zero if successful.
+ */
+int raspitexcapture_bind(RASPITEXCAPTURE_FRAME *frame,
+      const RASPITEX_CAPTURE_PARAMS *params,
+      RASPITEX_RECT *texels, int *num_texels)
+{
+   const CAPTURE_TARGET *scaled, *target;
+   RASPITEXCAPTURE_STATE *cap;
+
+   if (map_rects(frame, params, texels, num_texels) != 0)
+      return -1;
+
+   if (params->mode == RASPITEX_CAPTURE_BGRA &&
+         ! (params->flags & RASPITEX_CAPTURE_SET_REFERENCE) &&
+         frame->scale <= 1)
+      return 0;
+
+   cap = begin_passes(frame);
+   if (! cap)
+      return -1;
+   cap->bound = 1;
+
+   if (params->mode == RASPITEX_CAPTURE_POINTS)
+   {
+      if (update_points(frame, cap) != 0 || cap->num_points == 0)
+         return -1;
+      texels[0].x = 0;
+      texels[0].y = 0;
+      texels[0].width = cap->gather.width;
+      texels[0].height = cap->gather.height;
+      *num_texels = 1;
+   }
+
+   scaled = scale_frame(cap);
+   set_filter(scaled, GL_NEAREST);
+   if (params->mode == RASPITEX_CAPTURE_SUMS)
+   {
+      RASPITEX_RECT full = {0, 0, scaled->width, scaled->height};
+      int i;
+
+      for (i = 0; i < *num_texels; i++)
+         sum_region(cap, scaled, params,
+               params->num_rects ? &params->rects[i] : &full, i);
+      target = &cap->sums;
+   }
+   else if (params->mode == RASPITEX_CAPTURE_POINTS)
+   {
+      gather_points(cap, scaled);
+      target = &cap->gather;
+   }
+   else
+   {
+      target = pack_frame(cap, scaled, params);
+   }
+   if (params->flags & RASPITEX_CAPTURE_SET_REFERENCE)
+      store_reference(cap, scaled);
+   set_filter(scaled, GL_LINEAR);
+
+   /* The unscaled frame copy has no FBO, but the window surface matches */
+   GLCHK(glBindFramebuffer(GL_FRAMEBUFFER, target->fbo));
+   return 0;
+}
+
+/**
+ * Rebinds the window surface and restores the scene's GL state after
+ * a capture pass.
+ * @param frame The captured frame.
+ */
+void raspitexcapture_unbind(RASPITEXCAPTURE_FRAME *frame)
+{
+   RASPITEXCAPTURE_STATE *cap = frame->gl;
+   if (! cap || ! cap->bound)
+      return;
+
+   cap->bound = 0;
+   GLCHK(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+   GLCHK(glViewport(cap->saved_viewport[0], cap->saved_viewport[1],
+            cap->saved_viewport[2], cap->saved_viewport[3]));
+   GLCHK(glUseProgram(cap->saved_program));
+   GLCHK(glBindBuffer(GL_ARRAY_BUFFER, cap->saved_array_buffer));
+   GLCHK(glActiveTexture(GL_TEXTURE1));
+   GLCHK(glBindTexture(GL_TEXTURE_2D, cap->saved_texture1));
+   GLCHK(glActiveTexture(GL_TEXTURE0));
+   GLCHK(glBindTexture(GL_TEXTURE_2D, cap->saved_texture));
+}
+
+/**
+ * Deletes the capture GL objects. Must be called on the GL thread while
+ * the context is still current.
+ * @param frame The captured frame.
+ */
+void raspitexcapture_gl_term(RASPITEXCAPTURE_FRAME *frame)
+{
+   RASPITEXCAPTURE_STATE *cap = frame->gl;
+   int i;
+
+   if (! cap)
+      return;
+
+   for (i = 0; i < cap->num_levels; i++)
+      delete_target(&cap->levels[i]);
+   delete_target(&cap->frame);
+   delete_target(&cap->luma);
+   delete_target(&cap->mask);
+   delete_target(&cap->reference);
+   for (i = 0; i < cap->num_sum_levels; i++)
+      delete_target(&cap->sum_levels[i]);
+   delete_target(&cap->sums);
+   delete_target(&cap->gather);
+
+   if (cap->quad_vbo)
+      glDeleteBuffers(1, &cap->quad_vbo);
+   if (cap->points_vbo)
+      glDeleteBuffers(1, &cap->points_vbo);
+   delete_shader(&cap->downsample_shader);
+   delete_shader(&cap->luma_shader);
+   delete_shader(&cap->mask_shader);
+   delete_shader(&cap->weigh_shader);
+   delete_shader(&cap->reduce_shader);
+   delete_shader(&cap->gather_shader);
+
+   free(cap);
+   frame->gl = NULL;
+}
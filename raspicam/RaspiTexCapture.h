@@ -0,0 +1,156 @@
+/*
+Copyright (c) 2013, Broadcom Europe Ltd
+Copyright (c) 2013, Tim Gover
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef RASPITEX_CAPTURE_H_
+#define RASPITEX_CAPTURE_H_
+
+#include <stdint.h>
+
+/// Maximum number of rectangles in a single capture request
+#define RASPITEX_MAX_RECTS 8
+
+/**
+ * A region of the frame-buffer in GL window co-ordinates, i.e. with the
+ * origin at the bottom-left.
+ */
+typedef struct RASPITEX_RECT
+{
+   int32_t x;                          /// x-offset in pixels
+   int32_t y;                          /// y-offset in pixels
+   int32_t width;                      /// width in pixels
+   int32_t height;                     /// height in pixels
+} RASPITEX_RECT;
+
+/** A pixel position in capture co-ordinates */
+typedef struct RASPITEX_POINT
+{
+   int32_t x;
+   int32_t y;
+} RASPITEX_POINT;
+
+/** What a capture reads back from the frame. */
+typedef enum {
+   /// 4 bytes per pixel, straight from the frame
+   RASPITEX_CAPTURE_BGRA = 0,
+   /// 1 byte of Rec. 601 luma per pixel, packed 4 pixels per RGBA texel on
+   /// the GPU. Rows are padded to a multiple of 4 pixels and regions must
+   /// start on a multiple of 4.
+   RASPITEX_CAPTURE_LUMA,
+
+   /// One bit per pixel, set where the pixel passes the threshold given in
+   /// RASPITEX_CAPTURE_PARAMS. Each byte holds 8 horizontally adjacent
+   /// pixels, least significant bit first. Rows are padded with zero bits
+   /// to a multiple of 32 pixels and regions must start on a multiple of 32.
+   RASPITEX_CAPTURE_MASK,
+
+   /// The sums over each region of w, w * x, w * y and 1 for the pixels
+   /// whose weighted sum w passes the mask threshold, reduced on the GPU.
+   /// Each region reads back as four packed floats, RASPITEX_SUM_W etc.,
+   /// which raspitexutil_unpack_float decodes. Regions may start anywhere.
+   RASPITEX_CAPTURE_SUMS,
+
+   /// One RGBA texel for each point given to raspitex_set_points, in order:
+   /// the average of its 3x3 neighbourhood with the centre weighted 4,
+   /// truncated to whole values. The texels fill rows of a square block,
+   /// so the capture may end with unused texels. Regions are ignored.
+   RASPITEX_CAPTURE_POINTS,
+} RASPITEX_CAPTURE_MODE;
+
+/// Order of the packed floats read back for each RASPITEX_CAPTURE_SUMS region
+enum
+{
+   RASPITEX_SUM_W = 0,
+   RASPITEX_SUM_WX,
+   RASPITEX_SUM_WY,
+   RASPITEX_SUM_COUNT,
+   RASPITEX_NUM_SUMS
+};
+
+/// Subtract the reference frame before thresholding. The reference
+/// is black until one is stored.
+#define RASPITEX_CAPTURE_DIFF          (1 << 0)
+/// Store the captured frame as the reference after the readback. Batches
+/// that update the reference are processed in the order they were queued.
+#define RASPITEX_CAPTURE_SET_REFERENCE (1 << 1)
+
+/**
+ * Describes a capture. Requests with identical parameters share a single
+ * readback, so unused fields should be zero.
+ */
+typedef struct RASPITEX_CAPTURE_PARAMS
+{
+   RASPITEX_CAPTURE_MODE mode;         /// What to read back
+
+   /// Regions to read back, or the whole frame if num_rects is zero.
+   /// Regions are packed one after another in the capture buffer.
+   RASPITEX_RECT rects[RASPITEX_MAX_RECTS];
+   int num_rects;
+
+   unsigned flags;                     /// RASPITEX_CAPTURE_DIFF etc.
+
+   /// For RASPITEX_CAPTURE_MASK and SUMS, a pixel passes if the weighted sum of its
+   /// R, G and B values (0-255) exceeds threshold.
+   float weights[3];
+   float threshold;
+} RASPITEX_CAPTURE_PARAMS;
+
+/// Largest supported --glscale factor
+#define RASPITEXCAPTURE_MAX_SCALE 16
+
+/**
+ * What the capture passes need to know about the frame they capture. It
+ * is kept apart from RASPITEX_STATE so that the passes build against any
+ * EGL and GLES2, without the Broadcom headers.
+ */
+typedef struct RASPITEXCAPTURE_FRAME
+{
+   int32_t width;                      /// Width of the rendered frame
+   int32_t height;                     /// Height of the rendered frame
+   int scale;                          /// Reduction factor, a power of two
+   int32_t capture_width;              /// Width of captured frames
+   int32_t capture_height;             /// Height of captured frames
+
+   /// Points gathered by RASPITEX_CAPTURE_POINTS. They are uploaded when
+   /// points_serial changes, so the caller must keep them still until
+   /// raspitexcapture_bind returns.
+   const RASPITEX_POINT *points;
+   int num_points;
+   unsigned points_serial;
+
+   struct RASPITEXCAPTURE_STATE *gl;   /// GL objects, made on first use
+} RASPITEXCAPTURE_FRAME;
+
+void raspitexcapture_frame_init(RASPITEXCAPTURE_FRAME *frame,
+      int32_t width, int32_t height, int scale);
+int raspitexcapture_bind(RASPITEXCAPTURE_FRAME *frame,
+      const RASPITEX_CAPTURE_PARAMS *params,
+      RASPITEX_RECT *texels, int *num_texels);
+void raspitexcapture_unbind(RASPITEXCAPTURE_FRAME *frame);
+void raspitexcapture_gl_term(RASPITEXCAPTURE_FRAME *frame);
+
+#endif /* RASPITEX_CAPTURE_H_ */
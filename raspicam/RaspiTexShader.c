@@ -0,0 +1,161 @@
+/*
+Copyright (c) 2013, Broadcom Europe Ltd
+Copyright (c) 2013, Tim Gover
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "RaspiTexShader.h"
+#include <math.h>
+
+/**
+ * \file RaspiTexShader.c
+ *
+ * Shader helpers shared by the GL scenes and the capture passes. They only
+ * need GLES2, so the capture passes can be built without the rest of
+ * RaspiTex.
+ */
+
+/**
+ * Decodes a float packed into an RGBA texel by the capture passes: a 23 bit
+ * mantissa in R, G and B, and the exponent biased by 64 with the sign in
+ * the top bit in A. Zero is all zero bytes.
+ * @param texel The four bytes of the texel, in R, G, B, A order.
+ * @return The value.
+ */
+double raspitexutil_unpack_float(const uint8_t *texel)
+{
+   uint32_t mantissa;
+   double value;
+
+   if (texel[3] == 0)
+      return 0.0;
+
+   mantissa = (texel[0] << 16) | (texel[1] << 8) | texel[2];
+   value = ldexp(1.0 + mantissa / 8388608.0, (texel[3] & 0x7f) - 64);
+   return (texel[3] & 0x80) ? -value : value;
+}
+
+/**
+ * Takes a description of shader program, compiles it and gets the locations
+ * of uniforms and attributes.
+ *
+ * @param p The shader program state.
+ * @return Zero if successful.
+ */
+int raspitexutil_build_shader_program(RASPITEXUTIL_SHADER_PROGRAM_T *p)
+{
+    GLint status;
+    int i = 0;
+    char log[1024];
+    int logLen = 0;
+    vcos_assert(p);
+    vcos_assert(p->vertex_source);
+    vcos_assert(p->fragment_source);
+
+    if (! (p && p->vertex_source && p->fragment_source))
+        goto fail;
+
+    p->vs = p->fs = 0;
+
+    p->vs = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(p->vs, 1, &p->vertex_source, NULL);
+    glCompileShader(p->vs);
+    glGetShaderiv(p->vs, GL_COMPILE_STATUS, &status);
+    if (! status) {
+        glGetShaderInfoLog(p->vs, sizeof(log), &logLen, log);
+        vcos_log_error("Program info log %s", log);
+        goto fail;
+    }
+
+    p->fs = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(p->fs, 1, &p->fragment_source, NULL);
+    glCompileShader(p->fs);
+
+    glGetShaderiv(p->fs, GL_COMPILE_STATUS, &status);
+    if (! status) {
+        glGetShaderInfoLog(p->fs, sizeof(log), &logLen, log);
+        vcos_log_error("Program info log %s", log);
+        goto fail;
+    }
+
+    p->program = glCreateProgram();
+    glAttachShader(p->program, p->vs);
+    glAttachShader(p->program, p->fs);
+    glLinkProgram(p->program);
+    glGetProgramiv(p->program, GL_LINK_STATUS, &status);
+    if (! status)
+    {
+        vcos_log_error("Failed to link shader program");
+        glGetProgramInfoLog(p->program, sizeof(log), &logLen, log);
+        vcos_log_error("Program info log %s", log);
+        goto fail;
+    }
+
+    for (i = 0; i < SHADER_MAX_ATTRIBUTES; ++i)
+    {
+        if (! p->attribute_names[i])
+            break;
+        p->attribute_locations[i] = glGetAttribLocation(p->program, p->attribute_names[i]);
+        if (p->attribute_locations[i] == -1)
+        {
+            vcos_log_error("Failed to get location for attribute %s",
+                  p->attribute_names[i]);
+            goto fail;
+        }
+        else {
+            vcos_log_trace("Attribute for %s is %d",
+                  p->attribute_names[i], p->attribute_locations[i]);
+        }
+    }
+
+    for (i = 0; i < SHADER_MAX_UNIFORMS; ++i)
+    {
+        if (! p->uniform_names[i])
+            break;
+        p->uniform_locations[i] = glGetUniformLocation(p->program, p->uniform_names[i]);
+        if (p->uniform_locations[i] == -1)
+        {
+            vcos_log_error("Failed to get location for uniform %s",
+                  p->uniform_names[i]);
+            goto fail;
+        }
+        else {
+            vcos_log_trace("Uniform for %s is %d",
+                  p->uniform_names[i], p->uniform_locations[i]);
+        }
+    }
+
+    return 0;
+
+fail:
+    vcos_log_error("%s: Failed to build shader program", VCOS_FUNCTION);
+    if (p)
+    {
+        glDeleteProgram(p->program);
+        glDeleteShader(p->fs);
+        glDeleteShader(p->vs);
+    }
+    return -1;
+}
@@ -0,0 +1,104 @@
+/*
+Copyright (c) 2013, Broadcom Europe Ltd
+Copyright (c) 2013, Tim Gover
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef RASPITEX_SHADER_H_
+#define RASPITEX_SHADER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <GLES2/gl2.h>
+
+#if defined(RASPITEX_STANDALONE)
+/* Built without vcos, as for the headless checks: errors go to stderr */
+#include <assert.h>
+#include <stdio.h>
+#define VCOS_FUNCTION __func__
+#define vcos_log_error(...) \
+   (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define vcos_log_trace(...) ((void) 0)
+#define vcos_assert(X) assert(X)
+#else
+#ifndef VCOS_LOG_CATEGORY
+#define VCOS_LOG_CATEGORY (&raspitex_log_category)
+#endif
+#include "interface/vcos/vcos.h"
+
+extern VCOS_LOG_CAT_T raspitex_log_category;
+#endif /* RASPITEX_STANDALONE */
+
+#define SHADER_MAX_ATTRIBUTES 16
+#define SHADER_MAX_UNIFORMS   16
+/**
+ * Container for a simple shader program. The uniform and attribute locations
+ * are automatically setup by raspitex_build_shader_program.
+ */
+typedef struct RASPITEXUTIL_SHADER_PROGRAM_T
+{
+   const char *vertex_source;       /// Pointer to vertex shader source
+   const char *fragment_source;     /// Pointer to fragment shader source
+
+   /// Array of uniform names for raspitex_build_shader_program to process
+   const char *uniform_names[SHADER_MAX_UNIFORMS];
+   /// Array of attribute names for raspitex_build_shader_program to process
+   const char *attribute_names[SHADER_MAX_ATTRIBUTES];
+
+   GLint vs;                        /// Vertex shader handle
+   GLint fs;                        /// Fragment shader handle
+   GLint program;                   /// Shader program handle
+
+   /// The locations for uniforms defined in uniform_names
+   GLint uniform_locations[SHADER_MAX_UNIFORMS];
+
+   /// The locations for attributes defined in attribute_names
+   GLint attribute_locations[SHADER_MAX_ATTRIBUTES];
+} RASPITEXUTIL_SHADER_PROGRAM_T;
+
+
+/* Uncomment to enable extra GL error checking */
+//#define CHECK_GL_ERRORS
+#if defined(CHECK_GL_ERRORS)
+#define GLCHK(X) \
+do { \
+    GLenum err = GL_NO_ERROR; \
+    X; \
+   while ((err = glGetError())) \
+   { \
+      vcos_log_error("GL error 0x%x in " #X "file %s line %d", err, __FILE__,__LINE__); \
+      vcos_assert(err == GL_NO_ERROR); \
+      exit(err); \
+   } \
+} \
+while(0)
+#else
+#define GLCHK(X) X
+#endif /* CHECK_GL_ERRORS */
+
+int raspitexutil_build_shader_program(RASPITEXUTIL_SHADER_PROGRAM_T *p);
+double raspitexutil_unpack_float(const uint8_t *texel);
+
+#endif /* RASPITEX_SHADER_H_ */
@@ -28,6 +28,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "RaspiTexUtil.h"
 #include "RaspiTex.h"
+#include "RaspiTexCapture.h"
 #include <bcm_host.h>
 #include <GLES2/gl2.h>
 
@@ -462,148 +463,112 @@ void raspitexutil_brga_to_rgba(uint8_t *buffer, size_t size)
    }
 }
 
+/**
+ * Copies a buffer while swapping BGRA to RGBA, leaving the source intact.
+ * @param dst The destination buffer of at least size bytes.
+ * @param src The source buffer.
+ * @param size Size of the buffer in bytes.
+ */
+void raspitexutil_copy_brga_to_rgba(uint8_t *dst, const uint8_t *src,
+      size_t size)
+{
+   const uint8_t* end = src + size;
+
+   while (src < end)
+   {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+      dst[3] = src[3];
+      dst += 4;
+      src += 4;
+   }
+}
+
 /**
  * Uses glReadPixels to grab the current frame-buffer contents
- * and returns the result in a newly allocate buffer along with
- * the its size.
+ * and returns the result in a buffer borrowed from the capture pool
+ * along with its size.
  * Data is returned in BGRA format for TGA output. PPM output doesn't
  * require the channel order swap but would require a vflip. The TGA
  * format also supports alpha. The byte swap is not done in this function
  * to avoid blocking the GL rendering thread.
+ * If capture_scale is greater than one, or params asks for a packed mode,
+ * the data comes from offscreen passes rendered by RaspiTexCapture.c and
+ * regions are given in capture_width x capture_height co-ordinates.
  * @param state Pointer to the GL preview state.
- * @param buffer Address of pointer to set to pointer to new buffer.
- * @param buffer_size The size of the new buffer in bytes (out param)
+ * @param params The mode and regions to capture. Only the pixels in the
+ *               regions are transferred from the GPU, packed one region
+ *               after another in the buffer.
+ * @param buffer Address of pointer to set to the pooled buffer. It must be
+ *               returned with raspitex_release_buffer.
+ * @param buffer_size The size of the captured data in bytes (out param)
  * @return Zero if successful.
  */
-int raspitexutil_capture_bgra(RASPITEX_STATE *state,
+int raspitexutil_capture(RASPITEX_STATE *state,
+      const RASPITEX_CAPTURE_PARAMS *params,
       uint8_t **buffer, size_t *buffer_size)
 {
-   const int bytes_per_pixel = 4;
+   const int bytes_per_texel = 4;
+   RASPITEXCAPTURE_FRAME *frame = &state->capture_frame;
+   RASPITEX_RECT texels[RASPITEX_MAX_RECTS];
+   int num_texels = 0;
+   uint8_t *out;
+   int i, rc;
+
+   vcos_log_trace("%s: %dx%d mode %d rects %d", VCOS_FUNCTION,
+         frame->capture_width, frame->capture_height,
+         params->mode, params->num_rects);
+
+   *buffer = NULL;
+   *buffer_size = 0;
+
+   if (params->mode == RASPITEX_CAPTURE_POINTS)
+   {
+      /* The points are uploaded by bind, so hold them still until then */
+      vcos_mutex_lock(&state->capture.lock);
+      frame->points = state->capture.points;
+      frame->num_points = state->capture.num_points;
+      frame->points_serial = state->capture.points_serial;
+      rc = raspitexcapture_bind(frame, params, texels, &num_texels);
+      frame->points = NULL;
+      vcos_mutex_unlock(&state->capture.lock);
+   }
+   else
+   {
+      rc = raspitexcapture_bind(frame, params, texels, &num_texels);
+   }
+   if (rc != 0)
+      goto error;
 
-   vcos_log_trace("%s: %dx%d %d", VCOS_FUNCTION,
-         state->width, state->height, bytes_per_pixel);
+   for (i = 0; i < num_texels; i++)
+      *buffer_size += texels[i].width * texels[i].height * bytes_per_texel;
 
-   *buffer_size = state->width * state->height * bytes_per_pixel;
-   *buffer = calloc(*buffer_size, 1);
+   *buffer = raspitex_acquire_buffer(state, *buffer_size);
    if (! *buffer)
       goto error;
 
-   glReadPixels(0, 0, state->width, state->height, GL_RGBA,
-         GL_UNSIGNED_BYTE, *buffer);
+   /* Pack rows tightly so each region is width * 4 bytes per row */
+   glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+   out = *buffer;
+   for (i = 0; i < num_texels; i++)
+   {
+      const RASPITEX_RECT *r = &texels[i];
+      glReadPixels(r->x, r->y, r->width, r->height, GL_RGBA,
+            GL_UNSIGNED_BYTE, out);
+      out += r->width * r->height * bytes_per_texel;
+   }
    if (glGetError() != GL_NO_ERROR)
       goto error;
 
+   raspitexcapture_unbind(frame);
    return 0;
 
 error:
+   raspitexcapture_unbind(frame);
    *buffer_size = 0;
-   if (*buffer)
-      free(*buffer);
+   raspitex_release_buffer(state, *buffer);
    *buffer = NULL;
    return -1;
 }
-
-
-/**
- * Takes a description of shader program, compiles it and gets the locations
- * of uniforms and attributes.
- *
- * @param p The shader program state.
- * @return Zero if successful.
- */
-int raspitexutil_build_shader_program(RASPITEXUTIL_SHADER_PROGRAM_T *p)
-{
-    GLint status;
-    int i = 0;
-    char log[1024];
-    int logLen = 0;
-    vcos_assert(p);
-    vcos_assert(p->vertex_source);
-    vcos_assert(p->fragment_source);
-
-    if (! (p && p->vertex_source && p->fragment_source))
-        goto fail;
-
-    p->vs = p->fs = 0;
-
-    p->vs = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(p->vs, 1, &p->vertex_source, NULL);
-    glCompileShader(p->vs);
-    glGetShaderiv(p->vs, GL_COMPILE_STATUS, &status);
-    if (! status) {
-        glGetShaderInfoLog(p->vs, sizeof(log), &logLen, log);
-        vcos_log_error("Program info log %s", log);
-        goto fail;
-    }
-
-    p->fs = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(p->fs, 1, &p->fragment_source, NULL);
-    glCompileShader(p->fs);
-
-    glGetShaderiv(p->fs, GL_COMPILE_STATUS, &status);
-    if (! status) {
-        glGetShaderInfoLog(p->fs, sizeof(log), &logLen, log);
-        vcos_log_error("Program info log %s", log);
-        goto fail;
-    }
-
-    p->program = glCreateProgram();
-    glAttachShader(p->program, p->vs);
-    glAttachShader(p->program, p->fs);
-    glLinkProgram(p->program);
-    glGetProgramiv(p->program, GL_LINK_STATUS, &status);
-    if (! status)
-    {
-        vcos_log_error("Failed to link shader program");
-        glGetProgramInfoLog(p->program, sizeof(log), &logLen, log);
-        vcos_log_error("Program info log %s", log);
-        goto fail;
-    }
-
-    for (i = 0; i < SHADER_MAX_ATTRIBUTES; ++i)
-    {
-        if (! p->attribute_names[i])
-            break;
-        p->attribute_locations[i] = glGetAttribLocation(p->program, p->attribute_names[i]);
-        if (p->attribute_locations[i] == -1)
-        {
-            vcos_log_error("Failed to get location for attribute %s",
-                  p->attribute_names[i]);
-            goto fail;
-        }
-        else {
-            vcos_log_trace("Attribute for %s is %d",
-                  p->attribute_names[i], p->attribute_locations[i]);
-        }
-    }
-
-    for (i = 0; i < SHADER_MAX_UNIFORMS; ++i)
-    {
-        if (! p->uniform_names[i])
-            break;
-        p->uniform_locations[i] = glGetUniformLocation(p->program, p->uniform_names[i]);
-        if (p->uniform_locations[i] == -1)
-        {
-            vcos_log_error("Failed to get location for uniform %s",
-                  p->uniform_names[i]);
-            goto fail;
-        }
-        else {
-            vcos_log_trace("Uniform for %s is %d",
-                  p->uniform_names[i], p->uniform_locations[i]);
-        }
-    }
-
-    return 0;
-
-fail:
-    vcos_log_error("%s: Failed to build shader program", VCOS_FUNCTION);
-    if (p)
-    {
-        glDeleteProgram(p->program);
-        glDeleteShader(p->fs);
-        glDeleteShader(p->vs);
-    }
-    return -1;
-}
-
@@ -37,56 +37,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 #include "RaspiTex.h"
-#include "interface/vcos/vcos.h"
-
-extern VCOS_LOG_CAT_T raspitex_log_category;
-
-#define SHADER_MAX_ATTRIBUTES 16
-#define SHADER_MAX_UNIFORMS   16
-/**
- * Container for a simple shader program. The uniform and attribute locations
- * are automatically setup by raspitex_build_shader_program.
- */
-typedef struct RASPITEXUTIL_SHADER_PROGRAM_T
-{
-   const char *vertex_source;       /// Pointer to vertex shader source
-   const char *fragment_source;     /// Pointer to fragment shader source
-
-   /// Array of uniform names for raspitex_build_shader_program to process
-   const char *uniform_names[SHADER_MAX_UNIFORMS];
-   /// Array of attribute names for raspitex_build_shader_program to process
-   const char *attribute_names[SHADER_MAX_ATTRIBUTES];
-
-   GLint vs;                        /// Vertex shader handle
-   GLint fs;                        /// Fragment shader handle
-   GLint program;                   /// Shader program handle
-
-   /// The locations for uniforms defined in uniform_names
-   GLint uniform_locations[SHADER_MAX_UNIFORMS];
-
-   /// The locations for attributes defined in attribute_names
-   GLint attribute_locations[SHADER_MAX_ATTRIBUTES];
-} RASPITEXUTIL_SHADER_PROGRAM_T;
-
-
-/* Uncomment to enable extra GL error checking */
-//#define CHECK_GL_ERRORS
-#if defined(CHECK_GL_ERRORS)
-#define GLCHK(X) \
-do { \
-    GLenum err = GL_NO_ERROR; \
-    X; \
-   while ((err = glGetError())) \
-   { \
-      vcos_log_error("GL error 0x%x in " #X "file %s line %d", err, __FILE__,__LINE__); \
-      vcos_assert(err == GL_NO_ERROR); \
-      exit(err); \
-   } \
-} \
-while(0)
-#else
-#define GLCHK(X) X
-#endif /* CHECK_GL_ERRORS */
+#include "RaspiTexShader.h"
 
 /* Default GL scene ops functions */
 int raspitexutil_create_native_window(RASPITEX_STATE *raspitex_state);
@@ -105,12 +56,14 @@ int raspitexutil_update_u_texture(RASPITEX_STATE *raspitex_state,
       EGLClientBuffer mm_buf);
 int raspitexutil_update_v_texture(RASPITEX_STATE *raspitex_state,
       EGLClientBuffer mm_buf);
-int raspitexutil_capture_bgra(struct RASPITEX_STATE *state,
+int raspitexutil_capture(struct RASPITEX_STATE *state,
+      const RASPITEX_CAPTURE_PARAMS *params,
       uint8_t **buffer, size_t *buffer_size);
 void raspitexutil_close(RASPITEX_STATE* raspitex_state);
 
 /* Utility functions */
-int raspitexutil_build_shader_program(RASPITEXUTIL_SHADER_PROGRAM_T *p);
 void raspitexutil_brga_to_rgba(uint8_t *buffer, size_t size);
+void raspitexutil_copy_brga_to_rgba(uint8_t *dst, const uint8_t *src,
+      size_t size);
 
 #endif /* RASPITEX_UTIL_H_ */
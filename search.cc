@@ -0,0 +1,91 @@
+#include <math.h>
+
+#include <algorithm>
+
+#include "search.h"
+
+// Gains for position and velocity. With beta = alpha^2 / (2 - alpha) the
+// filter is tuned for a target that moves smoothly but not uniformly.
+#define SEARCH_ALPHA 0.6
+#define SEARCH_BETA 0.26
+
+// How much of each new prediction error goes into the running mean.
+#define SEARCH_ERROR_GAIN 0.3
+
+// The radius is at least this many pixels, and otherwise this many
+// times the running error.
+#define SEARCH_MIN_RADIUS 48
+#define SEARCH_ERROR_RADII 3
+
+// Misses in a row before the target is given up on. By then the radius
+// spans any camera frame.
+#define SEARCH_MAX_MISSES 5
+
+SearchWindow::SearchWindow() {
+    reset();
+}
+
+void SearchWindow::reset() {
+    locked = false;
+    x = y = vx = vy = 0;
+    error = 0;
+    misses = 0;
+}
+
+void SearchWindow::hit(double hx, double hy) {
+    if (!locked) {
+        locked = true;
+        x = hx;
+        y = hy;
+        vx = vy = 0;
+        error = SEARCH_MIN_RADIUS / SEARCH_ERROR_RADII;
+        misses = 0;
+        return;
+    }
+
+    double px = x + vx;
+    double py = y + vy;
+    double rx = hx - px;
+    double ry = hy - py;
+
+    x = px + SEARCH_ALPHA * rx;
+    y = py + SEARCH_ALPHA * ry;
+    vx += SEARCH_BETA * rx;
+    vy += SEARCH_BETA * ry;
+    error += SEARCH_ERROR_GAIN * (sqrt(rx * rx + ry * ry) - error);
+    misses = 0;
+}
+
+void SearchWindow::miss() {
+    if (!locked) {
+        return;
+    }
+
+    x += vx;
+    y += vy;
+    if (++misses > SEARCH_MAX_MISSES) {
+        reset();
+    }
+}
+
+void SearchWindow::region(int32_t width, int32_t height, int32_t &rx,
+                          int32_t &ry, int32_t &rw, int32_t &rh) const {
+    double radius = std::max((double) SEARCH_MIN_RADIUS,
+                             SEARCH_ERROR_RADII * error);
+    radius = ldexp(radius, misses);
+
+    double cx = x + vx;
+    double cy = y + vy;
+    double reachX = radius + fabs(vx);
+    double reachY = radius + fabs(vy);
+
+    int32_t x1 = (int32_t) std::max(0.0, floor(cx - reachX));
+    int32_t y1 = (int32_t) std::max(0.0, floor(cy - reachY));
+    int32_t x2 = (int32_t) std::min((double) width, ceil(cx + reachX));
+    int32_t y2 = (int32_t) std::min((double) height, ceil(cy + reachY));
+
+    rx = std::min(x1, width);
+    ry = std::min(y1, height);
+    rw = std::max(x2 - rx, 0);
+    rh = std::max(y2 - ry, 0);
+}
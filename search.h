@@ -0,0 +1,45 @@
+#ifndef OFFGRID_SEARCH_H
+#define OFFGRID_SEARCH_H
+
+#include <stdint.h>
+
+// Follows find()'s target with an alpha-beta filter, so each frame only
+// the region around its predicted position needs to be read back and
+// scanned.
+//
+// The region's radius is a few times the recent prediction error, and
+// doubles with each miss in a row. After a few misses the target is given
+// up on, and the whole frame is searched until it turns up again. The
+// region also reaches one frame's motion further than the radius, so the
+// next frame's region mostly lies inside this capture, which becomes the
+// reference it is diffed against.
+class SearchWindow {
+public:
+    SearchWindow();
+
+    // Forgets the target.
+    void reset();
+
+    // Corrects the prediction with where the target was found.
+    void hit(double x, double y);
+
+    // Coasts on the prediction and widens the search.
+    void miss();
+
+    // Whether there is a target to predict.
+    bool tracking() const { return locked; }
+
+    // The region to capture next, clipped to a frame of the given size.
+    // Only meaningful while tracking().
+    void region(int32_t width, int32_t height, int32_t &x, int32_t &y,
+                int32_t &w, int32_t &h) const;
+
+private:
+    bool locked;
+    double x, y;        // estimated position
+    double vx, vy;      // estimated motion per frame
+    double error;       // running mean distance of hits from predictions
+    uint32_t misses;    // in a row
+};
+
+#endif
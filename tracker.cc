@@ -0,0 +1,166 @@
+#include <math.h>
+
+#include <algorithm>
+
+#include "tracker.h"
+
+namespace {
+
+// One blob's centroid and grid cell.
+struct Detection {
+    double x, y;
+    int32_t cx, cy;
+    uint32_t area;
+    int32_t next;       // next detection in the same bucket, or -1
+    bool taken;
+};
+
+// A track and a detection close enough to be the same blob.
+struct Candidate {
+    double distance2;
+    uint32_t track;
+    uint32_t detection;
+};
+
+bool closer(const Candidate &a, const Candidate &b) {
+    return a.distance2 < b.distance2;
+}
+
+uint32_t bucketFor(int32_t cx, int32_t cy, uint32_t mask) {
+    return ((uint32_t) cx * 73856093u ^ (uint32_t) cy * 19349663u) & mask;
+}
+
+}
+
+BlobTracker::BlobTracker(double gate, uint32_t birthHits,
+                         uint32_t deathMisses)
+{
+    reset(gate, birthHits, deathMisses);
+}
+
+void BlobTracker::reset(double gate, uint32_t birthHits,
+                        uint32_t deathMisses) {
+    this->gate = gate > 0 ? gate : 1;
+    this->birthHits = birthHits;
+    this->deathMisses = deathMisses;
+    nextId = 1;
+    live.clear();
+}
+
+void BlobTracker::update(const std::vector<Blob> &blobs) {
+    // Hash the blobs into grid cells one gate wide, in a power-of-two
+    // table with room to spare.
+    uint32_t buckets = 16;
+    while (buckets < blobs.size() * 2) {
+        buckets <<= 1;
+    }
+    std::vector<int32_t> heads(buckets, -1);
+    std::vector<Detection> detections(blobs.size());
+
+    for (size_t i = 0; i < blobs.size(); ++i) {
+        Detection &d = detections[i];
+        d.x = (double) blobs[i].wx / blobs[i].w;
+        d.y = (double) blobs[i].wy / blobs[i].w;
+        d.cx = (int32_t) floor(d.x / gate);
+        d.cy = (int32_t) floor(d.y / gate);
+        d.area = blobs[i].area;
+        d.taken = false;
+
+        uint32_t bucket = bucketFor(d.cx, d.cy, buckets - 1);
+        d.next = heads[bucket];
+        heads[bucket] = i;
+    }
+
+    // Pair each track's prediction with the blobs in the cells around it.
+    std::vector<Candidate> candidates;
+    for (size_t t = 0; t < live.size(); ++t) {
+        double px = live[t].x + live[t].vx;
+        double py = live[t].y + live[t].vy;
+        int32_t cx = (int32_t) floor(px / gate);
+        int32_t cy = (int32_t) floor(py / gate);
+
+        for (int32_t dy = -1; dy <= 1; ++dy) {
+            for (int32_t dx = -1; dx <= 1; ++dx) {
+                int32_t i = heads[bucketFor(cx + dx, cy + dy, buckets - 1)];
+                for (; i >= 0; i = detections[i].next) {
+                    const Detection &d = detections[i];
+                    if (d.cx != cx + dx || d.cy != cy + dy) {
+                        continue;
+                    }
+                    double distance2 = (d.x - px) * (d.x - px) +
+                                       (d.y - py) * (d.y - py);
+                    if (distance2 <= gate * gate) {
+                        Candidate candidate = { distance2, (uint32_t) t,
+                                                (uint32_t) i };
+                        candidates.push_back(candidate);
+                    }
+                }
+            }
+        }
+    }
+
+    // Closest pairs first, each track and blob used once.
+    std::sort(candidates.begin(), candidates.end(), closer);
+    std::vector<bool> matched(live.size(), false);
+    for (size_t c = 0; c < candidates.size(); ++c) {
+        Track &track = live[candidates[c].track];
+        Detection &d = detections[candidates[c].detection];
+        if (matched[candidates[c].track] || d.taken) {
+            continue;
+        }
+        matched[candidates[c].track] = true;
+        d.taken = true;
+
+        track.vx = d.x - track.x;
+        track.vy = d.y - track.y;
+        track.x = d.x;
+        track.y = d.y;
+        track.area = d.area;
+        ++track.hits;
+        track.misses = 0;
+        if (!confirmed(track) && track.hits >= birthHits) {
+            track.id = nextId++;
+        }
+    }
+
+    // Unmatched tracks coast, and die once they have missed too often;
+    // tentative ones die on their first miss.
+    size_t kept = 0;
+    for (size_t t = 0; t < live.size(); ++t) {
+        Track &track = live[t];
+        ++track.age;
+        if (!matched[t]) {
+            track.x += track.vx;
+            track.y += track.vy;
+            track.hits = 0;
+            ++track.misses;
+            if (!confirmed(track) || track.misses > deathMisses) {
+                continue;
+            }
+        }
+        live[kept++] = track;
+    }
+    live.resize(kept);
+
+    // Every blob left over starts a tentative track.
+    for (size_t i = 0; i < detections.size(); ++i) {
+        const Detection &d = detections[i];
+        if (d.taken) {
+            continue;
+        }
+
+        Track track;
+        track.id = 0;
+        track.x = d.x;
+        track.y = d.y;
+        track.vx = track.vy = 0;
+        track.area = d.area;
+        track.hits = 1;
+        track.misses = 0;
+        track.age = 0;
+        if (track.hits >= birthHits) {
+            track.id = nextId++;
+        }
+        live.push_back(track);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef OFFGRID_TRACKER_H
+#define OFFGRID_TRACKER_H
+
+#include <vector>
+
+#include "blobs.h"
+
+// A blob followed from frame to frame.
+struct Track {
+    uint32_t id;        // 0 until the track is confirmed
+    double x, y;        // centroid, or where it was predicted to be
+    double vx, vy;      // pixels per update
+    uint32_t area;      // of the blob last matched
+    uint32_t hits;      // updates matched in a row
+    uint32_t misses;    // updates missed in a row
+    uint32_t age;       // updates since birth
+};
+
+// Gives the blobs of successive findBlobs() calls stable identities.
+//
+// Each track predicts its next position with a constant velocity. Blobs
+// are bucketed in a uniform grid of cells one gate wide, so each track
+// only considers the blobs in the 3x3 cells around its prediction, and
+// the closest track-blob pairs within the gate are matched first. A new
+// blob must be matched birthHits times in a row before the track gets an
+// id, and a confirmed track coasts on its prediction for up to
+// deathMisses updates before it is dropped, so a flickering blob neither
+// spawns nor loses ids.
+class BlobTracker {
+public:
+    explicit BlobTracker(double gate = 40, uint32_t birthHits = 3,
+                         uint32_t deathMisses = 5);
+
+    // Drops every track and sets new parameters. Ids start again from 1.
+    void reset(double gate, uint32_t birthHits, uint32_t deathMisses);
+
+    void update(const std::vector<Blob> &blobs);
+
+    // Every live track, confirmed or not, oldest first.
+    const std::vector<Track> &tracks() const { return live; }
+
+    bool confirmed(const Track &track) const { return track.id != 0; }
+
+private:
+    double gate;
+    uint32_t birthHits;
+    uint32_t deathMisses;
+    uint32_t nextId;
+    std::vector<Track> live;
+};
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "workers.h"
+
+// Bands shorter than this cost more to hand off than they save.
+#define MIN_BAND_ROWS 32
+
+struct WorkerStart {
+    WorkerPool *pool;
+    unsigned part;
+};
+
+static unsigned defaultThreads() {
+    const char *forced = getenv("OFFGRID_THREADS");
+    if (forced && atoi(forced) > 0) {
+        return atoi(forced);
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? cpus : 1;
+}
+
+static unsigned clampThreads(unsigned threads) {
+    return threads > WORKERS_MAX ? WORKERS_MAX : threads;
+}
+
+WorkerPool::WorkerPool(unsigned count)
+    : threadCount(clampThreads(count ? count : defaultThreads()))
+    , threads(NULL)
+    , generation(0)
+    , pending(0)
+    , stopping(false)
+    , job(NULL)
+    , context(NULL)
+    , parts(0)
+{
+    pthread_mutex_init(&runLock, NULL);
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&started, NULL);
+    pthread_cond_init(&finished, NULL);
+
+    // Thread i runs part i; part 0 is always the caller's.
+    threads = new pthread_t[threadCount];
+    for (unsigned i = 1; i < threadCount; ++i) {
+        WorkerStart *start = new WorkerStart();
+        start->pool = this;
+        start->part = i;
+        if (pthread_create(&threads[i], NULL, threadMain, start) != 0) {
+            delete start;
+            threadCount = i;
+            break;
+        }
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&started);
+    pthread_mutex_unlock(&lock);
+
+    for (unsigned i = 1; i < threadCount; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    delete[] threads;
+
+    pthread_cond_destroy(&finished);
+    pthread_cond_destroy(&started);
+    pthread_mutex_destroy(&lock);
+    pthread_mutex_destroy(&runLock);
+}
+
+void WorkerPool::run(WorkerJob job, void *context, unsigned parts) {
+    if (parts > threadCount) {
+        parts = threadCount;
+    }
+    if (parts <= 1) {
+        job(context, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&runLock);
+
+    pthread_mutex_lock(&lock);
+    this->job = job;
+    this->context = context;
+    this->parts = parts;
+    pending = parts - 1;
+    ++generation;
+    pthread_cond_broadcast(&started);
+    pthread_mutex_unlock(&lock);
+
+    job(context, 0, parts);
+
+    pthread_mutex_lock(&lock);
+    while (pending > 0) {
+        pthread_cond_wait(&finished, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    pthread_mutex_unlock(&runLock);
+}
+
+void *WorkerPool::threadMain(void *arg) {
+    WorkerStart *start = static_cast<WorkerStart *>(arg);
+    WorkerPool *pool = start->pool;
+    unsigned part = start->part;
+    delete start;
+
+    pool->work(part);
+    return NULL;
+}
+
+void WorkerPool::work(unsigned part) {
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!stopping && generation == seen) {
+            pthread_cond_wait(&started, &lock);
+        }
+        if (stopping) {
+            break;
+        }
+        seen = generation;
+
+        // Threads beyond this job's parts sit it out.
+        if (part >= parts) {
+            continue;
+        }
+
+        WorkerJob job = this->job;
+        void *context = this->context;
+        unsigned parts = this->parts;
+        pthread_mutex_unlock(&lock);
+
+        job(context, part, parts);
+
+        pthread_mutex_lock(&lock);
+        if (--pending == 0) {
+            pthread_cond_signal(&finished);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+unsigned bandParts(WorkerPool *workers, int32_t rows) {
+    unsigned parts = workers ? workers->size() : 1;
+    if (parts > WORKERS_MAX) {
+        parts = WORKERS_MAX;
+    }
+    if (parts > (unsigned) rows / MIN_BAND_ROWS) {
+        parts = rows / MIN_BAND_ROWS;
+    }
+    return parts ? parts : 1;
+}
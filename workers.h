@@ -0,0 +1,69 @@
+#ifndef OFFGRID_WORKERS_H
+#define OFFGRID_WORKERS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// The most parts a job is split into, for callers that keep per-part
+// results in fixed arrays.
+#define WORKERS_MAX 16
+
+// Runs one part of a job. Parts are numbered from 0 to parts - 1.
+typedef void (*WorkerJob)(void *context, unsigned part, unsigned parts);
+
+// A persistent set of threads that split each job between them and the
+// calling thread, so a frame can be analysed on every core without
+// creating threads per call. Jobs run one at a time.
+class WorkerPool {
+public:
+    // Count includes the caller, so 1 runs everything inline. Zero means
+    // one per online CPU, or OFFGRID_THREADS from the environment. Either
+    // way it is capped at WORKERS_MAX.
+    explicit WorkerPool(unsigned count = 0);
+    ~WorkerPool();
+
+    unsigned size() const { return threadCount; }
+
+    // Calls job(context, part, parts) for each part, with parts at most
+    // size(), and returns once they have all finished. The caller runs
+    // part 0.
+    void run(WorkerJob job, void *context, unsigned parts);
+
+private:
+    static void *threadMain(void *arg);
+    void work(unsigned part);
+
+    unsigned threadCount;
+    pthread_t *threads;
+
+    pthread_mutex_t runLock;    // serialises run()
+    pthread_mutex_t lock;
+    pthread_cond_t started;
+    pthread_cond_t finished;
+
+    // Guarded by lock.
+    unsigned generation;        // bumped for each job
+    unsigned pending;           // parts still running
+    bool stopping;
+    WorkerJob job;
+    void *context;
+    unsigned parts;
+
+    WorkerPool(const WorkerPool &);
+    WorkerPool &operator=(const WorkerPool &);
+};
+
+// Splits count items into parts near-equal ranges and returns the one for
+// part as [begin, end).
+static inline void workerRange(unsigned count, unsigned part, unsigned parts,
+                               unsigned &begin, unsigned &end) {
+    begin = (unsigned) ((unsigned long long) count * part / parts);
+    end = (unsigned) ((unsigned long long) count * (part + 1) / parts);
+}
+
+// The number of bands to split rows between, at most one per thread of
+// workers (which may be NULL) and never too short to be worth handing
+// off. Always at least 1.
+unsigned bandParts(WorkerPool *workers, int32_t rows);
+
+#endif